@@ -0,0 +1,34 @@
+#ifndef ADV_REPORT_H_
+#define ADV_REPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#ifndef EVT_LE_EXTENDED_ADVERTISING_REPORT
+#define EVT_LE_EXTENDED_ADVERTISING_REPORT 0x0D
+#endif
+
+#define ADV_REPORT_MAX_DATA 229										// Most AD data one extended report carries
+#define EXT_ADV_REPORT_SIZE 24										// Extended report up to its data
+
+/**
+ Walks the reports batched in one LE Advertising Report or LE Extended
+ Advertising Report subevent. Legacy reports are returned in place, nothing
+ is copied, extended ones are converted to the legacy layout in scratch.
+ Every report is checked against the event length before it is handed out.
+**/
+struct adv_report_iter {
+	const uint8_t *ptr;
+	const uint8_t *end;
+	uint8_t remaining;											// Reports left according to num_reports
+	uint8_t extended;
+	uint8_t scratch[LE_ADVERTISING_INFO_SIZE + ADV_REPORT_MAX_DATA + 1];
+};
+
+int adv_report_iter_init(struct adv_report_iter *it, const evt_le_meta_event *meta, size_t len);
+le_advertising_info* adv_report_next(struct adv_report_iter *it, int8_t *rssi);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef BDADDR_KEY_H_
+#define BDADDR_KEY_H_
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+
+/*
+Bluetooth addresses are kept as the 48-bit bdaddr_t packed into a uint64_t,
+with the most significant octet of the printed address in the top byte.
+Keys therefore compare the same way as the "XX:XX:..." strings do, and
+0 (00:00:00:00:00:00) means "no address". Strings are only produced when
+logging or handing an address to the socket API.
+*/
+
+#define BDADDR_KEY_NONE 0
+
+/** Packs a bdaddr_t into a key **/
+static inline uint64_t bdaddr_to_key(const bdaddr_t *ba) {
+	uint64_t key = 0;
+
+	for (int i = 5; i >= 0; i--)
+		key = (key << 8) | ba->b[i];
+	return key;
+}
+
+/** Unpacks a key into a bdaddr_t **/
+static inline void key_to_bdaddr(uint64_t key, bdaddr_t *ba) {
+	for (int i = 0; i < 6; i++) {
+		ba->b[i] = key & 0xff;
+		key >>= 8;
+	}
+}
+
+/** Formats a key as "XX:XX:XX:XX:XX:XX", str must hold 18 bytes **/
+static inline char* key_to_str(uint64_t key, char *str) {
+	bdaddr_t ba;
+
+	key_to_bdaddr(key, &ba);
+	ba2str(&ba, str);
+	return str;
+}
+
+/** Parses "XX:XX:XX:XX:XX:XX", returns BDADDR_KEY_NONE if it is malformed **/
+static inline uint64_t str_to_key(const char *str) {
+	bdaddr_t ba;
+
+	if (str2ba(str, &ba) < 0)
+		return BDADDR_KEY_NONE;
+	return bdaddr_to_key(&ba);
+}
+
+#endif
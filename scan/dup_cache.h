@@ -0,0 +1,37 @@
+#ifndef DUP_CACHE_H_
+#define DUP_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DUP_CACHE_SLOTS 1024										// Must be a power of two
+#define DUP_CACHE_PROBE 8											// Slots searched per lookup
+#define DUP_CACHE_TTL_MS 5000
+
+struct dup_entry {
+	uint64_t key;													// bdaddr key, BDADDR_KEY_NONE when empty
+	uint32_t payload_hash;
+	uint64_t expires_ms;
+};
+
+/**
+ Fixed-capacity set of recently seen (address, payload hash) pairs. Each
+ pair is remembered for ttl_ms from when it was first seen, so a node that
+ keeps advertising the same data is forwarded once per TTL and a node whose
+ data changes is forwarded immediately. Lookups probe at most
+ DUP_CACHE_PROBE slots; when they are all live the one closest to expiry
+ is evicted.
+**/
+struct dup_cache {
+	struct dup_entry slots[DUP_CACHE_SLOTS];
+	unsigned int ttl_ms;
+	unsigned long forwarded;
+	unsigned long suppressed;
+	unsigned long evictions;
+};
+
+void dup_cache_init(struct dup_cache *cache, unsigned int ttl_ms);
+uint32_t dup_payload_hash(const uint8_t *data, size_t len);
+int dup_cache_check(struct dup_cache *cache, uint64_t key, uint32_t payload_hash, uint64_t now_ms);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+epoll/timerfd event loop for the HCI socket. A scan window ends exactly when
+its monotonic deadline passes, independently of how many events arrive.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "hci_loop.h"
+
+#define MAX_EPOLL_EVENTS 2
+
+/** Milliseconds on the monotonic clock **/
+uint64_t monotonic_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ Sets up the loop for the non-blocking HCI socket fd. Returns 0 on success,
+ -1 on failure.
+**/
+int hci_loop_init(struct hci_loop *loop, int fd) {
+	struct epoll_event ev;
+
+	memset(loop, 0, sizeof(*loop));
+	loop->fd = fd;
+	loop->timerfd = -1;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (loop->timerfd < 0) {
+		perror("timerfd_create");
+		goto failed;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = loop->timerfd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) < 0) {
+		perror("epoll_ctl timerfd");
+		goto failed;
+	}
+
+	ev.data.fd = fd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl hci");
+		goto failed;
+	}
+
+	return 0;
+
+failed:
+	hci_loop_close(loop);
+	return -1;
+}
+
+/** Calls fn for every LE meta event with the given subevent code **/
+void hci_loop_set_handler(struct hci_loop *loop, uint8_t subevent, hci_subevent_fn fn, void *arg) {
+	if (subevent >= HCI_LOOP_MAX_SUBEVENT)
+		return;
+	loop->handlers[subevent] = fn;
+	loop->args[subevent] = arg;
+}
+
+/** Arms the timerfd to fire at the absolute monotonic time deadline_ms **/
+static int arm_deadline(struct hci_loop *loop, uint64_t deadline_ms) {
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline_ms / 1000;
+	its.it_value.tv_nsec = (deadline_ms % 1000) * 1000000;
+	return timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/** Hands one HCI event packet to the handler for its subevent **/
+static void dispatch(struct hci_loop *loop, unsigned char *buf, int len) {
+	hci_event_hdr *hdr;
+	evt_le_meta_event *meta;
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE + 1 || buf[0] != HCI_EVENT_PKT)
+		return;
+
+	hdr = (hci_event_hdr *) (buf + 1);
+	if (hdr->evt != EVT_LE_META_EVENT)
+		return;
+
+	meta = (evt_le_meta_event *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+	len -= 1 + HCI_EVENT_HDR_SIZE;
+	loop->events++;
+
+	if (meta->subevent >= HCI_LOOP_MAX_SUBEVENT || !loop->handlers[meta->subevent]) {
+		loop->unhandled++;
+		return;
+	}
+	loop->handlers[meta->subevent](meta, len, loop->args[meta->subevent]);
+}
+
+/** Reads and dispatches everything queued on the socket. Returns -1 on error. **/
+static int drain(struct hci_loop *loop) {
+	unsigned char buf[HCI_MAX_EVENT_SIZE];
+	int len;
+
+	while (1) {
+		len = read(loop->fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		dispatch(loop, buf, len);
+	}
+}
+
+/**
+ Runs the loop until the monotonic time deadline (see monotonic_ms()).
+ Returns 0 when the deadline passes, 1 if a signal interrupted the wait,
+ -1 on error.
+**/
+int hci_loop_run_until(struct hci_loop *loop, uint64_t deadline) {
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	uint64_t expirations;
+	int n;
+
+	if (arm_deadline(loop, deadline) < 0) {
+		perror("timerfd_settime");
+		return -1;
+	}
+
+	while (1) {
+		n = epoll_wait(loop->epfd, events, MAX_EPOLL_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				return 1;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == loop->timerfd) {
+				while (read(loop->timerfd, &expirations, sizeof(expirations)) > 0);
+				return 0;
+			}
+			if (drain(loop) < 0) {
+				perror("HCI read");
+				return -1;
+			}
+		}
+
+		if (monotonic_ms() >= deadline)
+			return 0;
+	}
+}
+
+/** Runs the loop for window_ms milliseconds, see hci_loop_run_until() **/
+int hci_loop_run(struct hci_loop *loop, unsigned int window_ms) {
+	return hci_loop_run_until(loop, monotonic_ms() + window_ms);
+}
+
+/** Closes the epoll and timer descriptors, the HCI socket is left open **/
+void hci_loop_close(struct hci_loop *loop) {
+	if (loop->timerfd >= 0)
+		close(loop->timerfd);
+	if (loop->epfd >= 0)
+		close(loop->epfd);
+	loop->timerfd = loop->epfd = -1;
+}
@@ -22,15 +22,110 @@
 
 struct ll {
     struct ll *next;
+    struct ll_arena *arena; /* NULL if malloced */
     void *value[];
 };
 
+struct ll_slab {
+    struct ll_slab *next;
+    _Alignas(16) unsigned char data[LL_SLAB_SIZE];
+};
+
+static _Thread_local struct ll_arena *current_arena;
+
+void
+ll_arena_init(struct ll_arena *arena)
+{
+    arena->first = arena->current = NULL;
+    arena->used = arena->in_use = arena->high_water = arena->slabs = 0;
+    arena->resets = 0;
+}
+
+/* Makes ll_new() in the calling thread allocate from arena, or from malloc
+ * if arena is NULL. Returns the arena that was set before. */
+struct ll_arena *
+ll_arena_set(struct ll_arena *arena)
+{
+    struct ll_arena *prev = current_arena;
+    current_arena = arena;
+    return prev;
+}
+
+/* Releases every node allocated from arena, whichever lists they are in */
+void
+ll_arena_reset(struct ll_arena *arena)
+{
+    arena->current = NULL;
+    arena->used = 0;
+    arena->in_use = 0;
+    arena->resets++;
+}
+
+void
+ll_arena_destroy(struct ll_arena *arena)
+{
+    struct ll_slab *slab, *next;
+    for (slab = arena->first; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    ll_arena_init(arena);
+}
+
+static void *
+arena_alloc(struct ll_arena *arena, size_t size)
+{
+    struct ll_slab *slab;
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > LL_SLAB_SIZE)
+        return NULL;
+    if (!arena->current || arena->used + size > LL_SLAB_SIZE) {
+        slab = arena->current ? arena->current->next : arena->first;
+        if (!slab) {
+            slab = malloc(sizeof(*slab));
+            if (!slab)
+                return NULL;
+            slab->next = NULL;
+            if (arena->current)
+                arena->current->next = slab;
+            else
+                arena->first = slab;
+            arena->slabs++;
+        }
+        arena->current = slab;
+        arena->used = 0;
+    }
+    p = arena->current->data + arena->used;
+    arena->used += size;
+    arena->in_use += size;
+    if (arena->in_use > arena->high_water)
+        arena->high_water = arena->in_use;
+    return p;
+}
+
+static void
+ll_release(struct ll *ll)
+{
+    if (!ll->arena)
+        free(ll);
+}
+
 void *
 _ll_new(void *next, size_t size)
 {
-    struct ll *ll = malloc(sizeof(struct ll) + size);
-    if (!ll)
-        return NULL;
+    struct ll *ll = NULL;
+    if (current_arena)
+        ll = arena_alloc(current_arena, sizeof(struct ll) + size);
+    if (ll) {
+        ll->arena = current_arena;
+    } else {
+        ll = malloc(sizeof(struct ll) + size);
+        if (!ll)
+            return NULL;
+        ll->arena = NULL;
+    }
     ll->next = next;
     return &ll->value;
 }
@@ -50,7 +145,7 @@ _ll_pop(void *_ll)
     ll = _ll;
     ll--;
     next = ll->next;
-    free(ll);
+    ll_release(ll);
     return next;
 }
 
@@ -61,7 +156,7 @@ ll_free(void *_ll)
     for (ll = _ll; ll; ll = next) {
         ll--;
         next = ll->next;
-        free(ll);
+        ll_release(ll);
     }
 }
 
@@ -76,7 +171,7 @@ _ll_reduce(void *_ll, int (fn)(void *, void *), void *value)
         next = ll->next;
         if (fn(value, &ll->value))
             return &ll->value;
-        free(ll);
+        ll_release(ll);
     }
     return NULL;
 }
@@ -0,0 +1,54 @@
+#ifndef MESH_ADV_H_
+#define MESH_ADV_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ad_parser.h"
+
+/*
+Binary mesh advertisement, carried in one manufacturer specific AD
+structure and nothing else:
+
+	len | 0xFF | company (2, LE) | version << 4 | type | seq | addr * n
+
+Addresses are 6 bytes each in over-the-air (little endian) order, so one
+31 byte legacy advertisement holds MESH_ADV_MAX_ADDRS of them, an extended
+advertisement up to MESH_ADV_EXT_MAX_ADDRS (it is kept to what one
+extended advertising report can carry). A DIGEST frame carries no
+addresses but digest (4, LE), generation (2, LE) and the size of the
+sender's whole neighbour set (1) instead.
+*/
+#define MESH_ADV_COMPANY_ID 0xFFFF									// Reserved for testing by the SIG
+#define MESH_ADV_VERSION 1
+#define MESH_ADV_HEADER_SIZE 6										// len, type, company, version/type, seq
+#define MESH_ADV_ADDR_SIZE 6
+#define MESH_ADV_MAX_ADDRS ((31 - MESH_ADV_HEADER_SIZE) / MESH_ADV_ADDR_SIZE)
+#define MESH_ADV_EXT_MAX_SIZE 229
+#define MESH_ADV_EXT_MAX_ADDRS ((MESH_ADV_EXT_MAX_SIZE - MESH_ADV_HEADER_SIZE) / MESH_ADV_ADDR_SIZE)
+#define MESH_ADV_DIGEST_SIZE 7
+
+enum mesh_adv_type {
+	MESH_ADV_NEIGHBOURS = 1,										// Some of the sender's neighbours
+	MESH_ADV_DELEGATE = 2,											// addrs[0] should take over the sender's prey
+	MESH_ADV_DIGEST = 3,											// Summary of the sender's whole neighbour set
+	MESH_ADV_DONE = 4,												// Sender has formed its links, addrs are its peers
+	MESH_ADV_CONNECT = 5											// Sender took the delegation of addrs[0] over
+};
+
+/** One decoded mesh advertisement, addresses are bdaddr keys **/
+struct mesh_adv {
+	uint8_t type;
+	uint8_t seq;
+	uint8_t count;
+	uint64_t addrs[MESH_ADV_EXT_MAX_ADDRS];
+	uint32_t digest;												// DIGEST only
+	uint16_t generation;
+	uint8_t total;
+};
+
+int mesh_adv_encode(const struct mesh_adv *msg, uint8_t *buf, size_t size);
+int mesh_adv_decode(const uint8_t *data, const struct ad_fields *ad, struct mesh_adv *msg);
+uint32_t mesh_adv_digest(const uint64_t *addrs, int count);
+
+#endif
@@ -1,91 +1,420 @@
 /*
-This code will take information about neighbours and store it in an array of linked lists.
-This code is based on Charles Lehner code ll.c which is free software.
+This code will take information about neighbours and store it in a graph:
+a hash table of neighbours, each with a hash set of its own neighbours.
+Entries not seen for a while are aged out by nb_data_expire().
+rtn_nb_ptr() still hands the neighbours out as a list, using Charles Lehner
+code ll.c which is free software.
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "ll.h"
+#include "nb_data.h"
+#include "bdaddr_key.h"
 
-#define MAX_ARR_LENGTH 16
-
-// Global variables
-int nmb_arr_entries = 0;
-struct nb_object *ptr[16] = { 0 };
-
-
-/** nb_bdaddr is neighbour bluetooth address, nb_nb is nb's neighbour address **/
-struct nb_object {
- 	char nb_bdaddr[18];
-	char nb_nb_bdaddr[18];
-};
-
-/** Adds a LL to an entry in the array **/
-void add_nb(struct nb_object **ptr, char *nb_bdaddr, char *nb_nb_bdaddr){
-  struct nb_object *nb_object = NULL;
-  nb_object = ll_new(nb_object);
-  strcpy(nb_object->nb_bdaddr, nb_bdaddr);
-  strcpy(nb_object->nb_nb_bdaddr, nb_nb_bdaddr);
-  ptr[nmb_arr_entries] = nb_object;
-  printf("Neighbour %s is now neigbour with %s\n", nb_bdaddr, nb_nb_bdaddr);
-  nmb_arr_entries++;
-}
-
-/** Adds new nb_nb. If nb not found it runs add_nb and then adds nb_nb. **/
-void add_nb_nb(struct nb_object **ptr, char *nb_bdaddr, char *nb_nb_bdaddr){
-	for(int j = 0; j < nmb_arr_entries; j++){
-		if(0 == strcmp(ptr[j]->nb_bdaddr, nb_bdaddr)){	
-			ll_foreach(ptr[j], it){
-				if(0 == strcmp(it->nb_nb_bdaddr, nb_nb_bdaddr)){
-					printf("Duplicate\n");
-					return;
-				}
-			}
-			ptr[j] = ll_new(ptr[j]);
-			strcpy(ptr[j]->nb_bdaddr, nb_bdaddr);
-			strcpy(ptr[j]->nb_nb_bdaddr, nb_nb_bdaddr);
-			printf("Neighbour %s is now neigbour with %s\n", ptr[j]->nb_bdaddr, nb_nb_bdaddr);
-			return;
-		} else {
+#define NB_INDEX_MIN 16
+#define NB_NB_MIN 8
+
+static uint32_t hash_key(uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+/** Returns 1 if home lies cyclically in (hole, slot], then the key at slot must stay put **/
+static int stays(uint32_t home, uint32_t hole, uint32_t slot) {
+	if (hole <= slot)
+		return home > hole && home <= slot;
+	return home > hole || home <= slot;
+}
+
+void nb_data_init(struct nb_data *nb) {
+	memset(nb, 0, sizeof(*nb));
+}
+
+/** Forgets every neighbour but keeps the memory, so refilling allocates nothing **/
+void nb_data_clear(struct nb_data *nb) {
+	for (uint32_t i = 0; i < nb->count; i++) {
+		if (nb->entries[i].nb_nb_count)
+			memset(nb->entries[i].nb_nb, 0, nb->entries[i].nb_nb_size * sizeof(struct nb_link));
+		nb->entries[i].nb_nb_count = 0;
+	}
+	nb->count = 0;
+	if (nb->index)
+		memset(nb->index, 0, nb->index_size * sizeof(uint32_t));
+}
+
+void nb_data_free(struct nb_data *nb) {
+	for (uint32_t i = 0; i < nb->capacity; i++)
+		free(nb->entries[i].nb_nb);
+	free(nb->entries);
+	free(nb->index);
+	nb_data_init(nb);
+}
+
+static void emit(const struct nb_data *nb, enum nb_event_type type, uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr) {
+	if (nb->event != NULL)
+		nb->event(nb->event_arg, type, nb_bdaddr, nb_nb_bdaddr);
+}
+
+/** Slot of nb_bdaddr in the index, or of the free slot it would go in **/
+static uint32_t index_slot(const struct nb_data *nb, uint64_t nb_bdaddr) {
+	uint32_t mask = nb->index_size - 1;
+	uint32_t slot = hash_key(nb_bdaddr) & mask;
+
+	while (nb->index[slot] && nb->entries[nb->index[slot] - 1].nb_bdaddr != nb_bdaddr)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/** Empties an index slot, moving later keys of the same cluster back so lookups still find them **/
+static void index_remove(struct nb_data *nb, uint32_t hole) {
+	uint32_t mask = nb->index_size - 1, slot = hole, home;
+
+	while (nb->index[slot = (slot + 1) & mask]) {
+		home = hash_key(nb->entries[nb->index[slot] - 1].nb_bdaddr) & mask;
+		if (!stays(home, hole, slot)) {
+			nb->index[hole] = nb->index[slot];
+			hole = slot;
+		}
+	}
+	nb->index[hole] = 0;
+}
+
+/** Returns the entry for nb_bdaddr, or NULL if it is not a neighbour **/
+struct nb_entry* nb_find(const struct nb_data *nb, uint64_t nb_bdaddr) {
+	uint32_t slot;
+
+	if (nb->count == 0)
+		return NULL;
+	slot = index_slot(nb, nb_bdaddr);
+	return nb->index[slot] ? &nb->entries[nb->index[slot] - 1] : NULL;
+}
+
+/** Doubles the index and rehashes it, the table is kept at most half full **/
+static int grow_index(struct nb_data *nb) {
+	uint32_t size = nb->index_size ? nb->index_size * 2 : NB_INDEX_MIN;
+	uint32_t *index = calloc(size, sizeof(uint32_t));
+
+	if (index == NULL) {
+		perror("nb_data index");
+		return -1;
+	}
+	free(nb->index);
+	nb->index = index;
+	nb->index_size = size;
+	for (uint32_t i = 0; i < nb->count; i++)
+		nb->index[index_slot(nb, nb->entries[i].nb_bdaddr)] = i + 1;
+	return 0;
+}
+
+static int grow_entries(struct nb_data *nb) {
+	uint32_t capacity = nb->capacity ? nb->capacity * 2 : NB_INDEX_MIN / 2;
+	struct nb_entry *entries = realloc(nb->entries, capacity * sizeof(*entries));
+
+	if (entries == NULL) {
+		perror("nb_data entries");
+		return -1;
+	}
+	memset(entries + nb->capacity, 0, (capacity - nb->capacity) * sizeof(*entries));
+	nb->entries = entries;
+	nb->capacity = capacity;
+	return 0;
+}
+
+/**
+ Returns the entry for nb_bdaddr, adding it if needed, and marks it seen
+ now. NULL if out of memory.
+**/
+struct nb_entry* add_nb(struct nb_data *nb, uint64_t nb_bdaddr) {
+	struct nb_entry *entry;
+	uint32_t slot;
+
+	if ((entry = nb_find(nb, nb_bdaddr)) == NULL) {
+		if ((nb->count + 1) * 2 > nb->index_size && grow_index(nb) < 0)
+			return NULL;
+		if (nb->count == nb->capacity && grow_entries(nb) < 0)
+			return NULL;
+
+		slot = index_slot(nb, nb_bdaddr);
+		entry = &nb->entries[nb->count];							// A spare entry may still own an empty nb_nb set
+		entry->nb_bdaddr = nb_bdaddr;
+		entry->provisional = 0;
+		nb->index[slot] = ++nb->count;
+		emit(nb, NB_JOIN, nb_bdaddr, BDADDR_KEY_NONE);
+	}
+	entry->last_seen_ms = nb->now_ms;
+	entry->generation = nb->generation;
+	return entry;
+}
+
+static uint32_t nb_nb_slot(const struct nb_entry *entry, uint64_t nb_nb_bdaddr) {
+	uint32_t mask = entry->nb_nb_size - 1;
+	uint32_t slot = hash_key(nb_nb_bdaddr) & mask;
+
+	while (entry->nb_nb[slot].nb_nb_bdaddr != BDADDR_KEY_NONE && entry->nb_nb[slot].nb_nb_bdaddr != nb_nb_bdaddr)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+static void nb_nb_remove(struct nb_entry *entry, uint32_t hole) {
+	uint32_t mask = entry->nb_nb_size - 1, slot = hole, home;
+
+	while (entry->nb_nb[slot = (slot + 1) & mask].nb_nb_bdaddr != BDADDR_KEY_NONE) {
+		home = hash_key(entry->nb_nb[slot].nb_nb_bdaddr) & mask;
+		if (!stays(home, hole, slot)) {
+			entry->nb_nb[hole] = entry->nb_nb[slot];
+			hole = slot;
+		}
+	}
+	memset(&entry->nb_nb[hole], 0, sizeof(entry->nb_nb[hole]));
+	entry->nb_nb_count--;
+}
+
+/** Returns 1 if nb_nb_bdaddr is a neighbour of entry, 0 if not **/
+int nb_has_nb_nb(const struct nb_entry *entry, uint64_t nb_nb_bdaddr) {
+	if (entry->nb_nb_count == 0 || nb_nb_bdaddr == BDADDR_KEY_NONE)
+		return 0;
+	return entry->nb_nb[nb_nb_slot(entry, nb_nb_bdaddr)].nb_nb_bdaddr == nb_nb_bdaddr;
+}
+
+/**
+ Iterates the neighbours of entry. Start with *pos = 0, returns
+ BDADDR_KEY_NONE when there are no more.
+**/
+uint64_t nb_nb_next(const struct nb_entry *entry, uint32_t *pos) {
+	if (entry->nb_nb_count == 0)
+		return BDADDR_KEY_NONE;
+	while (*pos < entry->nb_nb_size) {
+		uint64_t key = entry->nb_nb[(*pos)++].nb_nb_bdaddr;
+		if (key != BDADDR_KEY_NONE)
+			return key;
+	}
+	return BDADDR_KEY_NONE;
+}
+
+static int grow_nb_nb(struct nb_entry *entry) {
+	uint32_t size = entry->nb_nb_size ? entry->nb_nb_size * 2 : NB_NB_MIN;
+	struct nb_link *old = entry->nb_nb, *set = calloc(size, sizeof(struct nb_link));
+	uint32_t old_size = entry->nb_nb_size;
+
+	if (set == NULL) {
+		perror("nb_data set");
+		return -1;
+	}
+	entry->nb_nb = set;
+	entry->nb_nb_size = size;
+	for (uint32_t i = 0; i < old_size; i++) {
+		if (old[i].nb_nb_bdaddr != BDADDR_KEY_NONE)
+			set[nb_nb_slot(entry, old[i].nb_nb_bdaddr)] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+/** Returns the link of entry to nb_nb_bdaddr, adding it if needed. *added tells which. **/
+static struct nb_link* add_link(struct nb_entry *entry, uint64_t nb_nb_bdaddr, int *added) {
+	uint32_t slot;
+
+	*added = 0;
+	if (entry->nb_nb_count > 0) {
+		slot = nb_nb_slot(entry, nb_nb_bdaddr);
+		if (entry->nb_nb[slot].nb_nb_bdaddr == nb_nb_bdaddr)
+			return &entry->nb_nb[slot];
+	}
+	if ((entry->nb_nb_count + 1) * 2 > entry->nb_nb_size && grow_nb_nb(entry) < 0)
+		return NULL;
+	slot = nb_nb_slot(entry, nb_nb_bdaddr);
+	entry->nb_nb[slot].nb_nb_bdaddr = nb_nb_bdaddr;
+	entry->nb_nb_count++;
+	*added = 1;
+	return &entry->nb_nb[slot];
+}
+
+/**
+ Records that nb_nb_bdaddr is a neighbour of nb_bdaddr, adding nb_bdaddr
+ first if needed, and marks both seen now. BDADDR_KEY_NONE as
+ nb_nb_bdaddr only adds the neighbour. Returns 1 if the link is new, 0 if
+ it was known, -1 if out of memory.
+**/
+int add_nb_nb(struct nb_data *nb, uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr){
+	char addr[18], nb_addr[18];
+	struct nb_entry *entry;
+	struct nb_link *link;
+	uint32_t count = nb->count;
+	int added;
+
+	if ((entry = add_nb(nb, nb_bdaddr)) == NULL)
+		return -1;
+	if (nb->count != count && !nb->quiet)
+		printf("Added %s to the array\n", key_to_str(nb_bdaddr, addr));
+	if (nb_nb_bdaddr == BDADDR_KEY_NONE)
+		return 0;
+	if ((link = add_link(entry, nb_nb_bdaddr, &added)) == NULL)
+		return -1;
+	link->last_seen_ms = nb->now_ms;
+	link->generation = nb->generation;
+	if (!added) {
+		if (!nb->quiet)
+			printf("Duplicate\n");
+		return 0;
+	}
+	emit(nb, NB_LINK_UP, nb_bdaddr, nb_nb_bdaddr);
+	if (!nb->quiet)
+		printf("Neighbour %s is now neigbour with %s\n", key_to_str(nb_bdaddr, addr), key_to_str(nb_nb_bdaddr, nb_addr));
+	return 1;
+}
+
+/**
+ Marks nb_bdaddr seen now without adding anything, and those of its links
+ that go to one of the count addresses in links. Links it no longer
+ reports are left to age out. Returns 0, or -1 if it is not a neighbour.
+**/
+int nb_touch(struct nb_data *nb, uint64_t nb_bdaddr, const uint64_t *links, int count) {
+	struct nb_entry *entry = nb_find(nb, nb_bdaddr);
+	struct nb_link *link;
+
+	if (entry == NULL)
+		return -1;
+	entry->last_seen_ms = nb->now_ms;
+	entry->generation = nb->generation;
+	for (int i = 0; i < count && entry->nb_nb_count; i++) {
+		if (links[i] == BDADDR_KEY_NONE)
 			continue;
+		link = &entry->nb_nb[nb_nb_slot(entry, links[i])];
+		if (link->nb_nb_bdaddr == links[i]) {
+			link->last_seen_ms = nb->now_ms;
+			link->generation = nb->generation;
 		}
 	}
-	printf("Added %s to the array\n", nb_bdaddr);
-	add_nb(ptr, nb_bdaddr, nb_nb_bdaddr);
+	return 0;
+}
+
+/**
+ Makes dst a copy of src, stamps and all, reusing the memory dst already
+ has. No events are sent. Returns -1 if out of memory.
+**/
+int nb_data_copy(struct nb_data *dst, const struct nb_data *src) {
+	struct nb_entry *entry;
+	struct nb_link *link;
+	nb_event_fn event = dst->event;
+	int added;
+
+	nb_data_clear(dst);
+	dst->event = NULL;
+	nb_data_foreach(src, from) {
+		if ((entry = add_nb(dst, from->nb_bdaddr)) == NULL)
+			goto failed;
+		entry->provisional = from->provisional;
+		entry->last_seen_ms = from->last_seen_ms;
+		entry->generation = from->generation;
+		for (uint32_t i = 0; i < from->nb_nb_size && from->nb_nb_count; i++) {
+			if (from->nb_nb[i].nb_nb_bdaddr == BDADDR_KEY_NONE)
+				continue;
+			if ((link = add_link(entry, from->nb_nb[i].nb_nb_bdaddr, &added)) == NULL)
+				goto failed;
+			*link = from->nb_nb[i];
+		}
+	}
+	dst->now_ms = src->now_ms;
+	dst->generation = src->generation;
+	dst->event = event;
+	return 0;
+
+failed:
+	dst->event = event;
+	return -1;
+}
+
+/** Removes entry i, moving the last entry into its place **/
+static void remove_entry(struct nb_data *nb, uint32_t i) {
+	uint32_t last = nb->count - 1;
+	struct nb_entry tmp;
+
+	index_remove(nb, index_slot(nb, nb->entries[i].nb_bdaddr));
+	if (i != last) {
+		nb->index[index_slot(nb, nb->entries[last].nb_bdaddr)] = i + 1;
+		tmp = nb->entries[i];										// Swapped, so the removed entry's set is kept for reuse
+		nb->entries[i] = nb->entries[last];
+		nb->entries[last] = tmp;
+	}
+	if (nb->entries[last].nb_nb_count)
+		memset(nb->entries[last].nb_nb, 0, nb->entries[last].nb_nb_size * sizeof(struct nb_link));
+	nb->entries[last].nb_nb_count = 0;
+	nb->count--;
+}
+
+/**
+ Sweeps the graph: neighbours and links not seen in the last ttl_ms
+ before now_ms are removed, with an NB_LEAVE or NB_LINK_DOWN event for
+ each, and the generation moves on. A leaving neighbour takes its links
+ along without separate events. Returns the number of neighbours removed.
+**/
+int nb_data_expire(struct nb_data *nb, uint64_t ttl_ms) {
+	uint64_t now = nb->now_ms, gone;
+	struct nb_entry *entry;
+	int removed = 0;
+
+	for (uint32_t i = 0; i < nb->count; ) {
+		entry = &nb->entries[i];
+		if (now - entry->last_seen_ms > ttl_ms) {
+			gone = entry->nb_bdaddr;
+			remove_entry(nb, i);									// Entry i is now another one, look at it again
+			emit(nb, NB_LEAVE, gone, BDADDR_KEY_NONE);
+			removed++;
+			continue;
+		}
+		for (uint32_t slot = 0; slot < entry->nb_nb_size && entry->nb_nb_count; ) {
+			struct nb_link *link = &entry->nb_nb[slot];
+			if (link->nb_nb_bdaddr == BDADDR_KEY_NONE || now - link->last_seen_ms <= ttl_ms) {
+				slot++;
+				continue;
+			}
+			gone = link->nb_nb_bdaddr;
+			nb_nb_remove(entry, slot);								// A later link may have moved into slot
+			emit(nb, NB_LINK_DOWN, entry->nb_bdaddr, gone);
+		}
+		i++;
+	}
+	nb->generation++;
+	return removed;
 }
 
 /** Prints all neighbours **/
-void print_nb(struct nb_object **ptr){
-	for(int j = 0; j < nmb_arr_entries; j++){
-		printf("%s\n", ptr[j]->nb_bdaddr);
+void print_nb(const struct nb_data *nb){
+	char addr[18];
+	nb_data_foreach(nb, entry){
+		printf("%s\n", key_to_str(entry->nb_bdaddr, addr));
 	}
 }
 
-struct nb_object* rtn_nb_ptr (struct nb_object **ptr){
+/** Returns the neighbours as a list, one node each with nb_nb_bdaddr unset **/
+struct nb_object* rtn_nb_ptr(const struct nb_data *nb){
   struct nb_object *nb_ptr = NULL;
-  for(int j = 0; j < nmb_arr_entries; j++){
+  nb_data_foreach(nb, entry){
     nb_ptr = ll_new(nb_ptr);
-    strcpy(nb_ptr->nb_bdaddr, ptr[j]->nb_bdaddr);
+    nb_ptr->nb_bdaddr = entry->nb_bdaddr;
+    nb_ptr->nb_nb_bdaddr = BDADDR_KEY_NONE;
   }
   return nb_ptr;
 }
 
 /** Prints all the neigbours of nb_bdaddr **/
-void print_nb_nb(struct nb_object **ptr, char *nb_bdaddr){
-	for(int j = 0; j < nmb_arr_entries; j++){
-		if(0 == strcmp(ptr[j]->nb_bdaddr, nb_bdaddr)){	
-			ll_foreach(ptr[j], it){
-				printf("%s: %s\n", nb_bdaddr, it->nb_nb_bdaddr);
-			}
-		}
-	}
+void print_nb_nb(const struct nb_data *nb, uint64_t nb_bdaddr){
+	char addr[18], nb_addr[18];
+	struct nb_entry *entry = nb_find(nb, nb_bdaddr);
+	uint32_t pos = 0;
+	uint64_t key;
+
+	if (entry == NULL)
+		return;
+	while ((key = nb_nb_next(entry, &pos)) != BDADDR_KEY_NONE)
+		printf("%s: %s\n", key_to_str(nb_bdaddr, addr), key_to_str(key, nb_addr));
 }
 
-/** Adds all entries from list_ptr and stores them without duplicates in ptr **/
-struct nb_object* fill_entries(struct nb_object **ptr, struct nb_object *list_ptr){
+/** Adds all entries from list_ptr without duplicates. Returns -1 if out of memory, 0 otherwise. **/
+int fill_entries(struct nb_data *nb, struct nb_object *list_ptr){
   ll_foreach(list_ptr, it){
-    add_nb_nb(ptr, it->nb_bdaddr, it->nb_nb_bdaddr);
+    if (add_nb_nb(nb, it->nb_bdaddr, it->nb_nb_bdaddr) < 0)
+      return -1;
   }
-  return *ptr;
+  return 0;
 }
-
-
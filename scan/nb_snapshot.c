@@ -0,0 +1,281 @@
+/*
+Warm start for the neighbour graph. The graph is written to a file on every
+change and mapped back in on startup, where it serves as a provisional
+topology until live scanning confirms its entries or the first round ends.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nb_snapshot.h"
+#include "bdaddr_key.h"
+
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t entry_hash(uint64_t nb_bdaddr) {
+	return mix(nb_bdaddr);
+}
+
+static uint64_t link_hash(uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr) {
+	return mix(mix(nb_bdaddr) ^ nb_nb_bdaddr);
+}
+
+static uint64_t wall_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void nb_snapshot_init(struct nb_snapshot *snap, const char *path) {
+	memset(snap, 0, sizeof(*snap));
+	snap->path = path;
+}
+
+/**
+ Digest of the neighbours and their links. It does not depend on the
+ order they are stored in, so equal topologies always digest the same.
+ Provisional entries are left out.
+**/
+uint64_t nb_snapshot_digest(const struct nb_data *nb) {
+	uint64_t digest = 0, key;
+	uint32_t pos;
+
+	nb_data_foreach(nb, entry) {
+		if (entry->provisional)
+			continue;
+		digest += entry_hash(entry->nb_bdaddr);
+		pos = 0;
+		while ((key = nb_nb_next(entry, &pos)) != BDADDR_KEY_NONE)
+			digest += link_hash(entry->nb_bdaddr, key);
+	}
+	return digest;
+}
+
+/** Writes the confirmed part of nb into the mapped file at base **/
+static void fill_snapshot(struct nb_snapshot *snap, const struct nb_data *nb, void *base,
+                          uint32_t entries, uint32_t links, uint64_t digest) {
+	struct nb_snapshot_header *hdr = base;
+	struct nb_snapshot_entry *rec = (struct nb_snapshot_entry *) (hdr + 1);
+	uint64_t *link = (uint64_t *) (rec + entries), key;
+	uint32_t n = 0, pos;
+
+	hdr->magic = NB_SNAPSHOT_MAGIC;
+	hdr->version = NB_SNAPSHOT_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->entries = entries;
+	hdr->links = links;
+	hdr->generation = snap->generation;
+	hdr->saved_ms = wall_ms();
+	hdr->digest = digest;
+
+	nb_data_foreach(nb, entry) {
+		if (entry->provisional)
+			continue;
+		rec->nb_bdaddr = entry->nb_bdaddr;
+		rec->first_link = n;
+		pos = 0;
+		while ((key = nb_nb_next(entry, &pos)) != BDADDR_KEY_NONE)
+			link[n++] = key;
+		rec->link_count = n - rec->first_link;
+		rec++;
+	}
+}
+
+/**
+ Saves nb if its topology changed since the last save or load and it has
+ any confirmed neighbours at all. The file is built in path.tmp and
+ renamed over path, so a crash never leaves a half written snapshot
+ behind. Returns 1 if written, 0 if unchanged, -1 on failure.
+**/
+int nb_snapshot_save(struct nb_snapshot *snap, const struct nb_data *nb) {
+	uint64_t digest = nb_snapshot_digest(nb);
+	uint32_t entries = 0, links = 0;
+	char tmp[PATH_MAX];
+	size_t size;
+	void *base;
+	int fd;
+
+	if (digest == snap->digest && snap->generation > 0) {
+		snap->unchanged++;
+		return 0;
+	}
+	nb_data_foreach(nb, entry) {
+		if (!entry->provisional) {
+			entries++;
+			links += entry->nb_nb_count;
+		}
+	}
+	if (entries == 0) {											// Nothing heard yet, keep the last snapshot
+		snap->unchanged++;
+		return 0;
+	}
+	size = sizeof(struct nb_snapshot_header) + entries * sizeof(struct nb_snapshot_entry) + links * sizeof(uint64_t);
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", snap->path) >= (int) sizeof(tmp)) {
+		fprintf(stderr, "Snapshot path too long\n");
+		return -1;
+	}
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("Snapshot open");
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("Snapshot truncate");
+		goto failed;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("Snapshot mmap");
+		goto failed;
+	}
+
+	snap->generation++;
+	fill_snapshot(snap, nb, base, entries, links, digest);
+	munmap(base, size);
+	if (fdatasync(fd) < 0) {										// The data must be on disk before the rename is
+		perror("Snapshot sync");
+		goto failed;
+	}
+	close(fd);
+	if (rename(tmp, snap->path) < 0) {
+		perror("Snapshot rename");
+		unlink(tmp);
+		return -1;
+	}
+	snap->digest = digest;
+	snap->saves++;
+	return 1;
+
+failed:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/** Checks the mapped file is a complete snapshot of this version **/
+static int check_snapshot(const void *base, size_t size) {
+	const struct nb_snapshot_header *hdr = base;
+	const struct nb_snapshot_entry *rec;
+	uint64_t need;
+
+	if (size < sizeof(*hdr) || hdr->magic != NB_SNAPSHOT_MAGIC)
+		return -1;
+	if (hdr->version != NB_SNAPSHOT_VERSION || hdr->header_size != sizeof(*hdr))
+		return -1;
+	need = sizeof(*hdr) + (uint64_t) hdr->entries * sizeof(*rec) + (uint64_t) hdr->links * sizeof(uint64_t);
+	if (need != size)
+		return -1;
+	rec = (const struct nb_snapshot_entry *) (hdr + 1);
+	for (uint32_t i = 0; i < hdr->entries; i++) {
+		if ((uint64_t) rec[i].first_link + rec[i].link_count > hdr->links)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ Replaces the contents of nb with the snapshot at snap->path if there is
+ a valid one no older than max_age_s seconds. Returns the number of
+ neighbours loaded, 0 if there was nothing usable.
+**/
+int nb_snapshot_load(struct nb_snapshot *snap, struct nb_data *nb, unsigned int max_age_s) {
+	const struct nb_snapshot_header *hdr;
+	const struct nb_snapshot_entry *rec;
+	const uint64_t *link;
+	struct stat st;
+	void *base;
+	int fd, loaded = 0, quiet = nb->quiet;
+
+	nb_data_clear(nb);
+	fd = open(snap->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror("Snapshot open");
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("Snapshot mmap");
+		return 0;
+	}
+
+	hdr = base;
+	if (check_snapshot(base, st.st_size) < 0) {
+		fprintf(stderr, "Ignoring snapshot %s, it is damaged or from another version\n", snap->path);
+		goto done;
+	}
+	if (wall_ms() - hdr->saved_ms > (uint64_t) max_age_s * 1000)
+		goto done;
+
+	nb->quiet = 1;
+	rec = (const struct nb_snapshot_entry *) (hdr + 1);
+	link = (const uint64_t *) (rec + hdr->entries);
+	for (uint32_t i = 0; i < hdr->entries; i++) {
+		if (add_nb(nb, rec[i].nb_bdaddr) == NULL)
+			break;
+		for (uint32_t j = 0; j < rec[i].link_count; j++)
+			add_nb_nb(nb, rec[i].nb_bdaddr, link[rec[i].first_link + j]);
+	}
+	nb->quiet = quiet;
+
+	if (nb_snapshot_digest(nb) != hdr->digest) {
+		fprintf(stderr, "Ignoring snapshot %s, its digest does not match\n", snap->path);
+		nb_data_clear(nb);
+		goto done;
+	}
+	snap->digest = hdr->digest;
+	snap->generation = hdr->generation;
+	loaded = nb->count;
+
+done:
+	munmap(base, st.st_size);
+	return loaded;
+}
+
+/**
+ Adds the neighbours of warm that nb does not have yet, with their links,
+ as provisional entries. Entries nb already has were confirmed by live
+ scanning and are left alone. Returns the number of provisional entries
+ added, so 0 once everything in warm has been heard.
+**/
+int nb_snapshot_merge(struct nb_data *nb, const struct nb_data *warm) {
+	int quiet = nb->quiet, added = 0;
+	struct nb_entry *entry;
+	uint64_t key;
+	uint32_t pos;
+
+	nb->quiet = 1;
+	nb_data_foreach(warm, old) {
+		if (nb_find(nb, old->nb_bdaddr) != NULL)
+			continue;
+		if ((entry = add_nb(nb, old->nb_bdaddr)) == NULL)
+			break;
+		entry->provisional = 1;
+		added++;
+		pos = 0;
+		while ((key = nb_nb_next(old, &pos)) != BDADDR_KEY_NONE)
+			add_nb_nb(nb, old->nb_bdaddr, key);
+	}
+	nb->quiet = quiet;
+	return added;
+}
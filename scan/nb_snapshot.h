@@ -0,0 +1,54 @@
+#ifndef NB_SNAPSHOT_H_
+#define NB_SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "nb_data.h"
+
+/*
+Snapshot file layout, host byte order: a header, then entries records,
+then links two-hop addresses. Entry i owns links [first_link,
+first_link + link_count). digest covers the topology, see
+nb_snapshot_digest(), and doubles as the file checksum.
+*/
+#define NB_SNAPSHOT_MAGIC 0x4E53424EU								// "NBSN"
+#define NB_SNAPSHOT_VERSION 1
+#define NB_SNAPSHOT_MAX_AGE_S 600									// Older snapshots say little about the mesh now
+
+struct nb_snapshot_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint32_t entries;
+	uint32_t links;
+	uint64_t generation;
+	uint64_t saved_ms;												// Wall clock, monotonic time restarts with the node
+	uint64_t digest;
+} __attribute__ ((packed));
+
+struct nb_snapshot_entry {
+	uint64_t nb_bdaddr;
+	uint32_t first_link;
+	uint32_t link_count;
+} __attribute__ ((packed));
+
+/**
+ Persists a neighbour graph to path, so a restarted node can start from
+ the topology it last saw instead of an empty table. Saving rewrites the
+ file only when the topology changed since the last save or load.
+**/
+struct nb_snapshot {
+	const char *path;
+	uint64_t digest;
+	uint64_t generation;
+	unsigned long saves;
+	unsigned long unchanged;
+};
+
+void nb_snapshot_init(struct nb_snapshot *snap, const char *path);
+uint64_t nb_snapshot_digest(const struct nb_data *nb);
+int nb_snapshot_save(struct nb_snapshot *snap, const struct nb_data *nb);
+int nb_snapshot_load(struct nb_snapshot *snap, struct nb_data *nb, unsigned int max_age_s);
+int nb_snapshot_merge(struct nb_data *nb, const struct nb_data *warm);
+
+#endif
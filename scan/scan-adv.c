@@ -20,61 +20,37 @@
 
 #include "ll.h"
 #include "structs.h"
+#include "bdaddr_key.h"
+#include "ad_parser.h"
 #include "nb_data.h"
+#include "nb_snapshot.h"
+#include "scan_session.h"
+#include "adv_report.h"
+#include "hci_loop.h"
+#include "dup_cache.h"
+#include "advertiser.h"
+#include "mesh_adv.h"
+#include "adv_scheduler.h"
 #include <wiringPi.h>
 
-#define FLAGS_AD_TYPE 0x01
-#define FLAGS_LIMITED_MODE_BIT 0x01
-#define FLAGS_GENERAL_MODE_BIT 0x02
-
-#define EIR_FLAGS                   0x01  /* flags */
-#define EIR_UUID16_SOME             0x02  /* 16-bit UUID, more available */
-#define EIR_UUID16_ALL              0x03  /* 16-bit UUID, all listed */
-#define EIR_UUID32_SOME             0x04  /* 32-bit UUID, more available */
-#define EIR_UUID32_ALL              0x05  /* 32-bit UUID, all listed */
-#define EIR_UUID128_SOME            0x06  /* 128-bit UUID, more available */
-#define EIR_UUID128_ALL             0x07  /* 128-bit UUID, all listed */
-#define EIR_NAME_SHORT              0x08  /* shortened local name */
-#define EIR_NAME_COMPLETE           0x09  /* complete local name */
-#define EIR_TX_POWER                0x0A  /* transmit power level */
-#define EIR_DEVICE_ID               0x10  /* device ID */
+#define SCAN_WINDOW_MS 1000
+#define NB_ARRAY_SIZE 10
+#define ADV_PERIOD_MS 500
+#define SNAPSHOT_PATH "nb_graph.snap"
 
 void delay(unsigned int);
 
 /**
  This function sets up hci flags for BLE 
 **/
-struct hci_request ble_hci_request(uint16_t ocf, int clen, void * status, void * cparam) {
-	struct hci_request rq;
-	memset(&rq, 0, sizeof(rq));
-	rq.ogf = OGF_LE_CTL;
-	rq.ocf = ocf;
-	rq.cparam = cparam;
-	rq.clen = clen;
-	rq.rparam = status;
-	rq.rlen = 1;
-	return rq;
-}
-
 /**
- This function sets up the advertisement data 
+ This function sets up the advertisement data, see mesh_adv.h 
 **/
-le_set_advertising_data_cp ble_hci_params_for_set_adv_data(char * name, char * btaddr) {
-	int name_len = strlen(name);
-
+le_set_advertising_data_cp ble_hci_params_for_mesh_adv(const struct mesh_adv *msg) {
 	le_set_advertising_data_cp adv_data_cp;
 	memset(&adv_data_cp, 0, sizeof(adv_data_cp));
 
-	adv_data_cp.data[0] = 0x02; // Length.
-	adv_data_cp.data[1] = 0x01; // Flags
-	adv_data_cp.data[2] = 0x01; // LE Limited Discoverable Flag set
-
-	adv_data_cp.data[3] = name_len + 1; // Length of name.
-	adv_data_cp.data[4] = 0x09; // Name field.
-	memcpy(adv_data_cp.data + 5, name, name_len); // Name
-	memcpy(adv_data_cp.data + 5 + name_len, btaddr, strlen(btaddr)); // Data
-
-	adv_data_cp.length = strlen(adv_data_cp.data);
+	adv_data_cp.length = mesh_adv_encode(msg, adv_data_cp.data, sizeof(adv_data_cp.data));
 
 	return adv_data_cp;
 }
@@ -88,91 +64,19 @@ static void sigint_handler(int sig) {
 	signal_received = sig;
 }
 
-/**
-Parse name function from hcitool.c 
-**/
-static void eir_parse_name(uint8_t *eir, size_t eir_len,
-						char *buf, size_t buf_len) {
-	size_t offset;
-
-	offset = 0;
-	while (offset < eir_len) {
-		uint8_t field_len = eir[0];
-		size_t name_len;
-
-		/* Check for the end of EIR */
-		if (field_len == 0)
-			break;
-
-		if (offset + field_len > eir_len)
-			goto failed;
-
-		switch (eir[1]) {
-		case EIR_NAME_SHORT:
-		case EIR_NAME_COMPLETE:
-			name_len = field_len - 1;
-			if (name_len > buf_len)
-				goto failed;
-
-			memcpy(buf, &eir[2], name_len);
-			return;
-		}
-
-		offset += field_len + 1;
-		eir += field_len + 1;
-	}
-
-failed:
-	snprintf(buf, buf_len, "(unknown)");
-}
-
-/**
-Flags function from hcitool.c 
-**/
-static int read_flags(uint8_t *flags, const uint8_t *data, size_t size) {
-	size_t offset;
-
-	if (!flags || !data)
-		return -EINVAL;
-
-	offset = 0;
-	while (offset < size) {
-		uint8_t len = data[offset];
-		uint8_t type;
-
-		/* Check if it is the end of the significant part */
-		if (len == 0)
-			break;
-
-		if (len + offset > size)
-			break;
-
-		type = data[offset + 1];
-
-		if (type == FLAGS_AD_TYPE) {
-			*flags = data[offset + 2];
-			return 0;
-		}
-
-		offset += 1 + len;
-	}
-
-	return -ENOENT;
-}
-
 /**
 Removing duplicates function from hcitool.c 
 **/
-static int check_report_filter(uint8_t procedure, le_advertising_info *info)
+static int check_report_filter(uint8_t procedure, const struct ad_fields *ad)
 {
-	uint8_t flags;
+	uint8_t flags = ad->flags;
 
 	/* If no discovery procedure is set, all reports are treat as valid */
 	if (procedure == 0)
 		return 1;
 
-	/* Read flags AD type value from the advertising report if it exists */
-	if (read_flags(&flags, info->data, info->length))
+	/* Flags AD type value from the advertising report if it exists */
+	if (!ad->has_flags)
 		return 0;
 
 	switch (procedure) {
@@ -192,244 +96,227 @@ static int check_report_filter(uint8_t procedure, le_advertising_info *info)
 }
 
 /**
-Detecting advertising devices and adding them to our struct function, 
-modified from hcitool.c 
+Reports seen within the last DUP_CACHE_TTL_MS, kept across scan windows 
 **/
-struct nb_object* print_advertising_devices(int dd, uint8_t filter_type, struct nb_object *nb_object) {
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-	struct hci_filter nf;
-	struct hci_filter of;
-	struct sigaction sa;
-	socklen_t olen;
-	int len;
-	time_t start = time(0);
-	struct timeval tv;												//Timeout for socket options for read() to be nonblocking
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	char arr [100][18];
-	char addr_table[1000][18];
-	int addr_counter = 0;
-	
-	olen = sizeof(of);
-	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-		printf("Could not get socket options\n");
-		exit(-1);
-	}
+static struct dup_cache dup_cache;
 
-	hci_filter_clear(&nf);
-	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+/**
+State shared between print_advertising_devices and its report handler 
+**/
+struct scan_context {
+	uint8_t filter_type;
+	struct nb_object *nb_object;
+};
+
+/**
+Handler for LE Advertising Report subevents, adds every new or changed 
+"Pi" report in the event to our struct, modified from hcitool.c 
+**/
+static void handle_adv_reports(const evt_le_meta_event *meta, size_t len, void *arg) {
+	struct scan_context *ctx = arg;
+	struct nb_object *nb_object = ctx->nb_object;
+	struct adv_report_iter reports;
+	le_advertising_info *info;
+	int8_t report_rssi;
+	char addr[18];
+	uint64_t now = monotonic_ms();
+
+	adv_report_iter_init(&reports, meta, len);
+
+	while ((info = adv_report_next(&reports, &report_rssi)) != NULL) {
+		struct ad_fields ad;
+		struct mesh_adv msg;
+
+		if (!dup_cache_check(&dup_cache, bdaddr_to_key(&info->bdaddr),
+				dup_payload_hash(info->data, info->length), now))
+			continue;												// Seen with the same data, nothing new
+
+		ad_parse(info->data, info->length, &ad);					// One pass over the AD data
+		if (!check_report_filter(ctx->filter_type, &ad))
+			continue;
+		if (mesh_adv_decode(info->data, &ad, &msg) < 0 || msg.type != MESH_ADV_NEIGHBOURS)
+			continue;												// Not a mesh node, skip before any formatting
+		if (msg.count == 0)
+			msg.addrs[msg.count++] = BDADDR_KEY_NONE;
+
+		for (int i = 0; i < msg.count; i++) {
+			nb_object = ll_new(nb_object);
+			nb_object->nb_bdaddr = bdaddr_to_key(&info->bdaddr);
+			nb_object->nb_nb_bdaddr = msg.addrs[i];
+		}
 
-	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-		printf("Could not set socket options\n");
-		exit(-1);
+		ba2str(&info->bdaddr, addr);
+		printf("%s Pi seq %u rssi %d\n", addr, msg.seq, report_rssi);
 	}
 
+	ctx->nb_object = nb_object;
+}
+
+/**
+Detecting advertising devices for window_ms milliseconds and adding them 
+to our struct function 
+**/
+struct nb_object* print_advertising_devices(struct hci_loop *loop, uint8_t filter_type, struct nb_object *nb_object, unsigned int window_ms) {
+	struct scan_context ctx;
+	struct sigaction sa;
+	uint64_t deadline = monotonic_ms() + window_ms;
+	int ret;
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_flags = SA_NOCLDSTOP;
 	sa.sa_handler = sigint_handler;
 	sigaction(SIGINT, &sa, NULL);
-	setsockopt(dd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);	
 
-	while (1) {
-		evt_le_meta_event *meta;
-		le_advertising_info *info;
-		char addr[18];
-		int addr_exists;
-	
-		while ((len = read(dd, buf, sizeof(buf))) < 0) {
-			if (errno == EINTR && signal_received == SIGINT) {
-				len = 0;
-				goto done;
-			}
-
-			if (errno == EAGAIN || errno == EINTR)
-				continue;
-			goto done;
-		}
+	ctx.filter_type = filter_type;
+	ctx.nb_object = nb_object;
+	hci_loop_set_handler(loop, EVT_LE_ADVERTISING_REPORT, handle_adv_reports, &ctx);
 
-		if (time(0) - start >= 1) {
-			goto done;
-		}
+	do {
+		ret = hci_loop_run_until(loop, deadline);
+	} while (ret == 1 && signal_received != SIGINT);					// Other signals don't end the window early
 
-		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-		len -= (1 + HCI_EVENT_HDR_SIZE);
-
-		meta = (void *) ptr;
-
-		if (meta->subevent != 0x02)
-			goto done;
-
-		
-		info = (le_advertising_info *) (meta->data + 1);
-		if (check_report_filter(filter_type, info)) {					// Ignoring multiple reports
-			char name[30];
-
-			memset(name, 0, sizeof(name));
-
-			ba2str(&info->bdaddr, addr);
-			eir_parse_name(info->data, info->length,
-							name, sizeof(name) - 1);
-			char rssi;
-			
-			if (strcmp("Pi", name) == 0) {
-				
-				char sec_addr[31];
-				for (int i = 7; i < 24; i++) {
-					sec_addr[i-7] = info->data[i];
-				}
-				if(sec_addr[2] == ':' && sec_addr[5] == ':'){
-					nb_object = ll_new(nb_object);
-					strcpy(nb_object->nb_bdaddr, addr);
-					strcpy(nb_object->nb_nb_bdaddr, sec_addr);
-				} else {
-					nb_object = ll_new(nb_object);
-					strcpy(nb_object->nb_bdaddr, addr);
-				}
-			}
-			printf("%s %s ", addr, name);
-			for (int i = 0; i < info->length; i++) {
-				rssi = info->data[i];
-				printf("%d ", rssi); 
-			}
-			printf("\n");
-			
-			addr_counter++;
-			if (addr_counter == (sizeof(addr_table)/sizeof(addr_table[0]) - 1)) addr_counter = 0;
-		}
-	}
-	
-done:
-	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
+	hci_loop_set_handler(loop, EVT_LE_ADVERTISING_REPORT, NULL, NULL);
+	nb_object = ctx.nb_object;
 
 	ll_foreach(nb_object, it) {											// ll for each iterates through the linked list
-		printf("My_Neighbour: %s", it->nb_bdaddr);
-		printf(" Neighbours_Neighbour: %s\n", it->nb_nb_bdaddr);
+		char addr[18], nb_addr[18];
+		printf("My_Neighbour: %s", key_to_str(it->nb_bdaddr, addr));
+		printf(" Neighbours_Neighbour: %s\n", key_to_str(it->nb_nb_bdaddr, nb_addr));
 	}
 	
-	if (len < 0) exit(-1);
+	if (ret < 0) exit(-1);
 
 	return nb_object;
 }
 
+static struct advertiser advertiser = { .dd = -1 };
+static struct adv_scheduler scheduler = { .timerfd = -1, .stopfd = -1 };
+
+static void close_advertiser(void) {
+	adv_scheduler_stop(&scheduler);
+	advertiser_close(&advertiser);
+}
+
+static struct mesh_adv last_adv;
 
 /**
-Function to advertise with an input as the advertisement message 
+Function to advertise up to MESH_ADV_MAX_ADDRS neighbours from addrs in 
+one frame, the sequence number goes up whenever they change. The adapter 
+is opened on the first call, later calls only send the HCI commands whose 
+inputs changed. 
 **/
-int advertise(char *array) {	
-	int ret, status;
-
-	const int device = hci_open_dev(hci_get_route(NULL));
-	if ( device < 0 ) { 
-		perror("Failed to open HC device.");
-		return 0; 
+int advertise(const uint64_t *addrs, int count) {
+	struct mesh_adv msg = { .type = MESH_ADV_NEIGHBOURS };
+
+	msg.count = count < MESH_ADV_MAX_ADDRS ? count : MESH_ADV_MAX_ADDRS;
+	for (int i = 0; i < msg.count; i++)
+		msg.addrs[i] = addrs[i];
+	msg.seq = last_adv.seq;
+	if (memcmp(&msg, &last_adv, sizeof(msg)) != 0)
+		msg.seq++;
+	last_adv = msg;
+
+	if (advertiser.dd < 0) {
+		if (advertiser_open(&advertiser, 0) < 0)
+			return 0;
+		atexit(close_advertiser);
 	}
 
-	le_set_advertising_parameters_cp adv_params_cp;							// Set BLE advertisement parameters.
-	memset(&adv_params_cp, 0, sizeof(adv_params_cp));
-	adv_params_cp.min_interval = htobs(0x0800);
-	adv_params_cp.max_interval = htobs(0x0800);
-	adv_params_cp.chan_map = 7;
-	
-	struct hci_request adv_params_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISING_PARAMETERS,
-		LE_SET_ADVERTISING_PARAMETERS_CP_SIZE, &status, &adv_params_cp);
-	
-	ret = hci_send_req(device, &adv_params_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set advertisement parameters data.");
+	le_set_advertising_data_cp adv_data_cp = ble_hci_params_for_mesh_adv(&msg);
+
+	if (advertiser_set_params(&advertiser, 0x0800, 0x0800) < 0)
 		return 0;
-	}
-	
-	le_set_advertising_data_cp adv_data_cp = ble_hci_params_for_set_adv_data("Pi", array);		// Set BLE advertisement data.
-	
-	struct hci_request adv_data_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISING_DATA,
-		LE_SET_ADVERTISING_DATA_CP_SIZE, &status, &adv_data_cp);
-
-	ret = hci_send_req(device, &adv_data_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set advertising data.");
+	if (advertiser_set_data(&advertiser, &adv_data_cp) < 0)
 		return 0;
-	}
+	advertiser_enable(&advertiser, 1);
 
-	le_set_advertise_enable_cp advertise_cp;							// Enable advertising.
-	memset(&advertise_cp, 0, sizeof(advertise_cp));
-	advertise_cp.enable = 0x01;
+	return 0;
+}
 
-	struct hci_request enable_adv_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISE_ENABLE,
-		LE_SET_ADVERTISE_ENABLE_CP_SIZE, &status, &advertise_cp);
+/**
+Scheduler callback, sends the frame it picked for this tick. 
+**/
+static void send_mesh_adv(const struct mesh_adv *msg, void *arg) {
+	char adv_addr[18];
 
-	ret = hci_send_req(device, &enable_adv_rq, 1000);
-	if (ret < 0) {
-		hci_close_dev(device);
-		perror("Failed to enable advertising.");
-		return 0;
-	}
+	for (int i = 0; i < msg->count; i++)
+		printf("this is being advertised %s\n", key_to_str(msg->addrs[i], adv_addr));
+	advertise(msg->addrs, msg->count);
+}
 
-	hci_close_dev(device);
-	
-	return 0;
+static struct ll_arena round_arena;								// Every list of the current round
+static struct nb_data round_graph;								// Two-hop graph of the current round
+static struct nb_data warm_graph;								// Topology from the snapshot, until a round confirms or drops it
+static struct nb_snapshot snapshot;
+
+static struct scan_session session = { .dd = -1 };
+static struct hci_loop loop = { .epfd = -1, .timerfd = -1 };
+
+static void close_scan_session(void) {
+	hci_loop_close(&loop);
+	scan_session_close(&session);
 }
 
 /**
-Function that scans for advertising devices 
+Function that scans for advertising devices for window_ms milliseconds. 
+The scan session is opened on the first call and kept enabled across 
+calls, each call collects one window of reports from it. 
 **/
-struct nb_object* scan(struct nb_object *nb_object) {
-	int err, opt, dd, dev_id;
-	uint8_t own_type = LE_PUBLIC_ADDRESS;
-	uint8_t scan_type = 0x01;
+struct nb_object* scan_window(struct nb_object *nb_object, unsigned int window_ms) {
 	uint8_t filter_type = 0;
-	uint8_t filter_policy = 0x00;
-	uint16_t interval = htobs(0x0010);
-	uint16_t window = htobs(0x0010);
-	uint8_t filter_dup = 0x01;
-	
-	dev_id = hci_get_route(NULL);
-
-	dd = hci_open_dev(dev_id);
 	
-	err = hci_le_set_scan_parameters(dd, scan_type, interval, window,
-						own_type, filter_policy, 10000);
-	if (err < 0) {
-		perror("Set scan parameters failed");
-		exit(1);
+	if (session.dd < 0) {
+		if (scan_session_open(&session) < 0)
+			exit(1);
+		if (hci_loop_init(&loop, session.dd) < 0)
+			exit(1);
+		dup_cache_init(&dup_cache, DUP_CACHE_TTL_MS);
+		atexit(close_scan_session);
 	}
 
-	err = hci_le_set_scan_enable(dd, 0x01, filter_dup, 10000);
-	if (err < 0) {
-		perror("Enable scan failed");
-		exit(1);
-	}
+	nb_object = print_advertising_devices(&loop, filter_type, nb_object, window_ms);
+	
+	return nb_object;
+}
 
-	printf("LE Scan ...\n");
+/**
+Function that scans for one default length window 
+**/
+struct nb_object* scan(struct nb_object *nb_object) {
+	return scan_window(nb_object, SCAN_WINDOW_MS);
+}
 
-	nb_object = print_advertising_devices(dd, filter_type, nb_object);
+/**
+Returns 1 if every neighbour restored from the snapshot is in arr again, 
+so the round can end without waiting for the timeout. 
+**/
+static int heard_all(const struct nb_data *warm, const uint64_t *arr, int counter) {
+	int i;
 	
-	err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 10000);
-	if (err < 0) {
-		perror("Disable scan failed");
-		exit(1);
+	if (warm->count == 0)
+		return 0;
+	nb_data_foreach(warm, entry) {
+		for (i = 0; i < counter && arr[i] != entry->nb_bdaddr; i++);
+		if (i == counter)
+			return 0;
 	}
-
-	hci_close_dev(dd);
-	return nb_object;
+	return 1;
 }
 
 /**
 Function that adds to an array from a linked list struct 
 **/
-void add_to_array(char (*arr)[18], struct nb_object *nb_object, int *counter){
+void add_to_array(uint64_t *arr, struct nb_object *nb_object, int *counter){
+	if(nb_object->nb_bdaddr == BDADDR_KEY_NONE || *counter >= NB_ARRAY_SIZE){
+		return;
+	}
 	for(int i = 0; i < *counter; i++){
-		if(0 == strcmp(arr[i], nb_object->nb_bdaddr)){
+		if(arr[i] == nb_object->nb_bdaddr){
 			return;
 		}
 	}
-	strcpy(arr[*counter], nb_object->nb_bdaddr);
-	*counter++;
+	arr[*counter] = nb_object->nb_bdaddr;
+	(*counter)++;
 }
 
 /**
@@ -440,53 +327,60 @@ and so on in a loop.
 It then returns all its neighbours and their neighbours neighbours in a list. 
 **/
 int main(int argc, char *argv[]) {
+	nb_snapshot_init(&snapshot, SNAPSHOT_PATH);
+	if (nb_snapshot_load(&snapshot, &warm_graph, NB_SNAPSHOT_MAX_AGE_S) > 0)
+		printf("Warm start with %u neighbours from %s\n", warm_graph.count, SNAPSHOT_PATH);
+	
 	while(1){
 	time_t start = time(0);
 	
-	char arr[10][18];
+	ll_arena_reset(&round_arena);									// The last round's lists all go at once
+	ll_arena_set(&round_arena);
+	
+	uint64_t arr[NB_ARRAY_SIZE];
+	char adv_addr[18];
 	int counter = 0;
-	int current = 0;
 	
 	struct nb_object *nb_object = NULL;
 
+	if (scheduler.stopfd < 0 && adv_scheduler_start(&scheduler, ADV_PERIOD_MS, 0, send_mesh_adv, NULL) < 0)
+		exit(1);
+	adv_scheduler_update(&scheduler, arr, counter);
+
 	while (1) {
-		
-		char neighbour_1 [] = "";
-		
-		if ((nb_object != NULL)) {
-			printf("this is being advertised %s\n", arr[current]);
-			advertise(arr[current]);
-			current++;
-			if(current > counter){
-				current = 0;
-			}
-		} else {
-			advertise(neighbour_1);
-		}
-	
 		nb_object = scan(nb_object);
 		
 		ll_foreach(nb_object, it){
-			add_to_array(arr, nb_object, &counter);
+			add_to_array(arr, it, &counter);
 		}
+		adv_scheduler_update(&scheduler, arr, counter);
 		
 		if (time(0) - start >= 20) {
 			break;
 		}
+		if (heard_all(&warm_graph, arr, counter)) {
+			printf("Every neighbour from the snapshot has been heard again\n");
+			break;
+		}
 	}
+	nb_data_clear(&warm_graph);									// Anything not heard this round ages out
 	
-	struct nb_object *ptr[16];
-	*ptr = fill_entries(ptr, nb_object);
+	nb_data_clear(&round_graph);									// Keeps its memory for the next round
+	if (fill_entries(&round_graph, nb_object) < 0)
+		exit(1);
+	nb_snapshot_save(&snapshot, &round_graph);
 	struct nb_object *rtn = NULL;
-	rtn = rtn_nb_ptr(ptr);
+	rtn = rtn_nb_ptr(&round_graph);
 	
-	printf("%d\n", rtn->nb_bdaddr);
+	printf("%s\n", key_to_str(rtn->nb_bdaddr, adv_addr));
 	
 	printf("List of neighbours: \n");
 	ll_foreach(rtn, it){
 	printf("Neighbour and their specific neighbours\n");
-		print_nb_nb(ptr, it->nb_bdaddr);
+		print_nb_nb(&round_graph, it->nb_bdaddr);
 	}
+	printf("Round used %zu bytes of neighbour lists in %zu slabs\n",
+		round_arena.high_water, round_arena.slabs);
 	delay(20000);
 }
 	return 0;
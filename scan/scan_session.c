@@ -0,0 +1,347 @@
+/*
+Long-lived LE scan session. The adapter is opened, configured and put into
+scanning mode once, and stays that way until scan_session_close().
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "scan_session.h"
+
+#define HCI_TIMEOUT_MS 10000
+#define MS_TO_UNITS(ms) ((ms) * 8 / 5)								// 0.625 ms controller units
+#define SCAN_MAX_MS 10240										// Longest interval the controller takes
+
+#define OCF_LE_SET_EXT_SCAN_PARAMETERS 0x0041
+#define OCF_LE_SET_EXT_SCAN_ENABLE 0x0042
+
+typedef struct {
+	uint8_t own_addr_type;
+	uint8_t filter_policy;
+	uint8_t phys;													// LE 1M only
+	uint8_t scan_type;
+	uint16_t interval;
+	uint16_t window;
+} __attribute__ ((packed)) ext_scan_params_cp;
+
+typedef struct {
+	uint8_t enable;
+	uint8_t filter_dup;
+	uint16_t duration;
+	uint16_t period;
+} __attribute__ ((packed)) ext_scan_enable_cp;
+
+/*
+The mesh payload is carried entirely in ADV_IND, so scan responses add
+nothing but airtime and the default is passive. Duplicate filtering is off
+by default, see scan_session_open().
+*/
+const struct scan_profile scan_profiles[] = {
+	{ "passive",   0x00, 0x0010, 0x0010, 0x00 },					// Continuous, 10 ms windows
+	{ "active",    0x01, 0x0010, 0x0010, 0x00 },
+	{ "duty50",    0x00, 0x0060, 0x0030, 0x00 },					// 30 ms every 60 ms
+	{ "duty10",    0x00, 0x0280, 0x0040, 0x00 },					// 40 ms every 400 ms
+	{ "legacy",    0x01, 0x0010, 0x0010, 0x01 },					// What scan() used to hardcode
+};
+const int nmb_scan_profiles = sizeof(scan_profiles) / sizeof(scan_profiles[0]);
+
+/** Returns the built-in profile called name, or NULL **/
+const struct scan_profile* scan_profile_find(const char *name) {
+	for (int i = 0; i < nmb_scan_profiles; i++) {
+		if (strcmp(scan_profiles[i].name, name) == 0)
+			return &scan_profiles[i];
+	}
+	return NULL;
+}
+
+/**
+ Converts a millisecond option to controller units, rejecting values the
+ 16 bit parameter cannot hold instead of letting them wrap.
+**/
+static int option_units(const char *tok, unsigned int ms, uint16_t *units) {
+	if (ms > SCAN_MAX_MS) {
+		fprintf(stderr, "Scan option \"%s\" is above 10.24 s\n", tok);
+		return -1;
+	}
+	*units = MS_TO_UNITS(ms);
+	return 0;
+}
+
+/**
+ Parses a profile spec: a built-in profile name optionally followed by
+ overrides, e.g. "passive,interval=60,window=30,dup". interval and window
+ are given in milliseconds, "dup"/"nodup" switch duplicate filtering.
+ Returns 0, or -1 with a message if the spec is invalid.
+**/
+int scan_profile_parse(struct scan_profile *profile, const char *spec) {
+	const struct scan_profile *base;
+	char buf[64], *tok, *save;
+	unsigned int ms;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	tok = strtok_r(buf, ",", &save);
+	base = tok ? scan_profile_find(tok) : NULL;
+	if (base == NULL) {
+		fprintf(stderr, "Unknown scan profile \"%s\"\n", spec);
+		return -1;
+	}
+	*profile = *base;
+
+	while ((tok = strtok_r(NULL, ",", &save)) != NULL) {
+		if (sscanf(tok, "interval=%u", &ms) == 1) {
+			if (option_units(tok, ms, &profile->interval) < 0)
+				return -1;
+		}
+		else if (sscanf(tok, "window=%u", &ms) == 1) {
+			if (option_units(tok, ms, &profile->window) < 0)
+				return -1;
+		}
+		else if (strcmp(tok, "dup") == 0)
+			profile->filter_dup = 0x01;
+		else if (strcmp(tok, "nodup") == 0)
+			profile->filter_dup = 0x00;
+		else {
+			fprintf(stderr, "Unknown scan profile option \"%s\"\n", tok);
+			return -1;
+		}
+	}
+
+	if (profile->window < 0x0004 || profile->interval > 0x4000 || profile->window > profile->interval) {
+		fprintf(stderr, "Scan window must be between 2.5 ms and the interval, interval at most 10.24 s\n");
+		return -1;
+	}
+	return 0;
+}
+
+void scan_profile_print(const struct scan_profile *profile) {
+	printf("%s: %s, interval %.2f ms, window %.2f ms, duplicate filter %s",
+		profile->name, profile->scan_type ? "active" : "passive",
+		profile->interval * 0.625, profile->window * 0.625,
+		profile->filter_dup ? "on" : "off");
+}
+
+static int ext_scan_cmd(int dd, uint16_t ocf, void *cp, int clen) {
+	struct hci_request rq;
+	uint8_t status;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = ocf;
+	rq.cparam = cp;
+	rq.clen = clen;
+	rq.rparam = &status;
+	rq.rlen = 1;
+
+	if (hci_send_req(dd, &rq, HCI_TIMEOUT_MS) < 0)
+		return -1;
+	if (status) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ Sends the session's scan parameters over dd, with the extended command if
+ the session is extended. A controller that was given extended advertising
+ commands refuses the legacy scan commands and the other way round.
+**/
+static int set_scan_parameters(int dd, struct scan_session *session) {
+	ext_scan_params_cp cp;
+
+	if (!session->extended)
+		return hci_le_set_scan_parameters(dd, session->scan_type,
+						session->interval, session->window,
+						session->own_type, session->filter_policy, HCI_TIMEOUT_MS);
+
+	memset(&cp, 0, sizeof(cp));
+	cp.own_addr_type = session->own_type;
+	cp.filter_policy = session->filter_policy;
+	cp.phys = 0x01;
+	cp.scan_type = session->scan_type;
+	cp.interval = session->interval;								// Already little endian
+	cp.window = session->window;
+	return ext_scan_cmd(dd, OCF_LE_SET_EXT_SCAN_PARAMETERS, &cp, sizeof(cp));
+}
+
+static int set_scan_enable(int dd, struct scan_session *session, uint8_t enable, uint8_t filter_dup) {
+	ext_scan_enable_cp cp;
+
+	if (!session->extended)
+		return hci_le_set_scan_enable(dd, enable, filter_dup, HCI_TIMEOUT_MS);
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+	cp.filter_dup = filter_dup;
+	return ext_scan_cmd(dd, OCF_LE_SET_EXT_SCAN_ENABLE, &cp, sizeof(cp));
+}
+
+/** Copies profile into a session that has not been opened yet **/
+void scan_session_set_profile(struct scan_session *session, const struct scan_profile *profile) {
+	session->own_type = LE_PUBLIC_ADDRESS;
+	session->filter_policy = 0x00;
+	session->scan_type = profile->scan_type;
+	session->filter_dup = profile->filter_dup;
+	session->interval = htobs(profile->interval);
+	session->window = htobs(profile->window);
+}
+
+/**
+ Switches an open session to profile. Scan parameters can only change while
+ scanning is disabled, so this disables, reconfigures and re-enables it. The
+ commands go through their own HCI socket, the session socket may be owned
+ by a reader thread. Returns 0 on success, -1 on failure.
+**/
+int scan_session_apply_profile(struct scan_session *session, const struct scan_profile *profile) {
+	int ctl, err;
+
+	scan_session_set_profile(session, profile);
+	ctl = hci_open_dev(session->dev_id);
+	if (ctl < 0) {
+		perror("Failed to open HCI device");
+		return -1;
+	}
+
+	set_scan_enable(ctl, session, 0x00, 0x00);
+	err = set_scan_parameters(ctl, session);
+	if (err < 0)
+		perror("Set scan parameters failed");
+	else if ((err = set_scan_enable(ctl, session, 0x01, session->filter_dup)) < 0)
+		perror("Enable scan failed");
+	session->enabled = err == 0;
+
+	hci_close_dev(ctl);
+	return err < 0 ? -1 : 0;
+}
+
+/**
+ Opens the default adapter, sets the scan parameters, installs an LE meta
+ event filter and enables scanning. Returns 0 on success, -1 on failure.
+ A session without a profile gets scan_profiles[0]. Duplicate filtering
+ should stay off for long sessions: the controller only resets its
+ duplicate list when scanning is re-enabled, so a session that never
+ re-enables would only ever see each advertiser once. An extended session
+ receives LE Extended Advertising Reports instead, the kernel enables that
+ event on controllers that support extended scanning.
+**/
+int scan_session_open(struct scan_session *session) {
+	struct hci_filter nf;
+	socklen_t olen;
+	int err, flags;
+
+	if (session->interval == 0)
+		scan_session_set_profile(session, &scan_profiles[0]);
+
+	session->dev_id = hci_get_route(NULL);
+	session->dd = hci_open_dev(session->dev_id);
+	if (session->dd < 0) {
+		perror("Failed to open HCI device");
+		return -1;
+	}
+
+	set_scan_enable(session->dd, session, 0x00, 0x00);				// Scanning may still be on from a previous run
+
+	err = set_scan_parameters(session->dd, session);
+	if (err < 0) {
+		perror("Set scan parameters failed");
+		goto failed;
+	}
+
+	olen = sizeof(session->of);
+	if (getsockopt(session->dd, SOL_HCI, HCI_FILTER, &session->of, &olen) < 0) {
+		perror("Could not get socket options");
+		goto failed;
+	}
+
+	hci_filter_clear(&nf);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+
+	if (setsockopt(session->dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
+		perror("Could not set socket options");
+		goto failed;
+	}
+
+	flags = fcntl(session->dd, F_GETFL, 0);
+	if (flags < 0 || fcntl(session->dd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		perror("Could not make HCI socket non-blocking");
+		goto failed;
+	}
+
+	err = set_scan_enable(session->dd, session, 0x01, session->filter_dup);
+	if (err < 0) {
+		perror("Enable scan failed");
+		goto failed;
+	}
+	session->enabled = 1;
+
+	printf("LE Scan ...\n");
+	return 0;
+
+failed:
+	hci_close_dev(session->dd);
+	session->dd = -1;
+	return -1;
+}
+
+/**
+ Reads one queued HCI event into buf without blocking. Returns the event
+ length, 0 if nothing is queued, or -1 on a socket error.
+**/
+int scan_session_read(struct scan_session *session, unsigned char *buf, size_t size) {
+	int len = read(session->dd, buf, size);
+
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	return len;
+}
+
+/**
+ Waits up to timeout_ms for an event to be queued. Returns 1 if one is
+ ready, 0 on timeout or signal, -1 on error.
+**/
+int scan_session_wait(struct scan_session *session, int timeout_ms) {
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = session->dd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	ret = poll(&pfd, 1, timeout_ms);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -1;
+	return ret > 0;
+}
+
+/**
+ Disables scanning, restores the original socket filter and closes the
+ adapter.
+**/
+void scan_session_close(struct scan_session *session) {
+	if (session->dd < 0)
+		return;
+
+	if (session->enabled) {
+		if (set_scan_enable(session->dd, session, 0x00, session->filter_dup) < 0)
+			perror("Disable scan failed");
+		session->enabled = 0;
+	}
+
+	setsockopt(session->dd, SOL_HCI, HCI_FILTER, &session->of, sizeof(session->of));
+	hci_close_dev(session->dd);
+	session->dd = -1;
+}
@@ -2,10 +2,12 @@
 #define STRUCTS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+/** Addresses are bdaddr keys, see bdaddr_key.h **/
 struct nb_object {
- 	char nb_bdaddr[18];
-	char nb_nb_bdaddr[18];
+	uint64_t nb_bdaddr;
+	uint64_t nb_nb_bdaddr;
 	char edge_color;
 };
 
@@ -0,0 +1,82 @@
+/*
+Single pass over the AD structures of an advertising report. Based on the
+eir_parse_name() and read_flags() loops from hcitool.c.
+*/
+#include <string.h>
+
+#include "ad_parser.h"
+#include "bdaddr_key.h"
+
+/**
+ Walks data once and records the offset and length of the flags, name,
+ manufacturer data and service data values in ad. Parsing stops at a zero
+ length byte or at a structure running past len, whatever follows is
+ recorded as the tail.
+**/
+void ad_parse(const uint8_t *data, size_t len, struct ad_fields *ad) {
+	size_t offset = 0;
+
+	memset(ad, 0, sizeof(*ad));
+
+	while (offset < len) {
+		uint8_t field_len = data[offset];
+		struct ad_field value;
+
+		/* Check for the end of the significant part */
+		if (field_len == 0 || offset + 1 + field_len > len)
+			break;
+
+		value.off = offset + 2;
+		value.len = field_len - 1;
+
+		switch (data[offset + 1]) {
+		case EIR_FLAGS:
+			if (value.len > 0) {
+				ad->has_flags = 1;
+				ad->flags = data[value.off];
+			}
+			break;
+		case EIR_NAME_SHORT:
+		case EIR_NAME_COMPLETE:
+			ad->name = value;
+			break;
+		case EIR_MANUFACTURER_DATA:
+			ad->mfr = value;
+			break;
+		case EIR_SERVICE_DATA16:
+			ad->svc = value;
+			break;
+		}
+
+		offset += 1 + field_len;
+	}
+
+	if (offset < len) {
+		ad->tail.off = offset;
+		ad->tail.len = len - offset;
+	}
+}
+
+/** Returns 1 if the advertised name is exactly name **/
+int ad_name_is(const uint8_t *data, const struct ad_fields *ad, const char *name) {
+	size_t name_len = strlen(name);
+
+	return ad->name.len == name_len && memcmp(data + ad->name.off, name, name_len) == 0;
+}
+
+/**
+ Returns the text address "XX:XX:XX:XX:XX:XX" at the start of the tail as a
+ bdaddr key, or BDADDR_KEY_NONE if the tail doesn't hold one.
+**/
+uint64_t ad_tail_bdaddr(const uint8_t *data, const struct ad_fields *ad) {
+	char addr[18];
+
+	if (ad->tail.len < 17)
+		return BDADDR_KEY_NONE;
+
+	memcpy(addr, data + ad->tail.off, 17);
+	addr[17] = '\0';
+	if (addr[2] != ':' || addr[5] != ':')
+		return BDADDR_KEY_NONE;
+	return str_to_key(addr);
+}
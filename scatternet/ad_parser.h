@@ -0,0 +1,50 @@
+#ifndef AD_PARSER_H_
+#define AD_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLAGS_AD_TYPE 0x01
+#define FLAGS_LIMITED_MODE_BIT 0x01
+#define FLAGS_GENERAL_MODE_BIT 0x02
+
+#define EIR_FLAGS                   0x01  /* flags */
+#define EIR_UUID16_SOME             0x02  /* 16-bit UUID, more available */
+#define EIR_UUID16_ALL              0x03  /* 16-bit UUID, all listed */
+#define EIR_UUID32_SOME             0x04  /* 32-bit UUID, more available */
+#define EIR_UUID32_ALL              0x05  /* 32-bit UUID, all listed */
+#define EIR_UUID128_SOME            0x06  /* 128-bit UUID, more available */
+#define EIR_UUID128_ALL             0x07  /* 128-bit UUID, all listed */
+#define EIR_NAME_SHORT              0x08  /* shortened local name */
+#define EIR_NAME_COMPLETE           0x09  /* complete local name */
+#define EIR_TX_POWER                0x0A  /* transmit power level */
+#define EIR_DEVICE_ID               0x10  /* device ID */
+#define EIR_SERVICE_DATA16          0x16  /* service data, 16-bit UUID */
+#define EIR_MANUFACTURER_DATA       0xFF  /* manufacturer specific data */
+
+/** Value of one AD structure, as an offset into the AD data. len 0 means absent. **/
+struct ad_field {
+	uint8_t off;
+	uint8_t len;
+};
+
+/**
+ Everything the scanner needs from one report's AD data, filled in by a
+ single pass of ad_parse(). tail covers the bytes after the last well-formed
+ AD structure, which is where the text neighbour address of a mesh
+ advertisement sits.
+**/
+struct ad_fields {
+	uint8_t has_flags;
+	uint8_t flags;
+	struct ad_field name;
+	struct ad_field mfr;
+	struct ad_field svc;
+	struct ad_field tail;
+};
+
+void ad_parse(const uint8_t *data, size_t len, struct ad_fields *ad);
+int ad_name_is(const uint8_t *data, const struct ad_fields *ad, const char *name);
+uint64_t ad_tail_bdaddr(const uint8_t *data, const struct ad_fields *ad);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+Advertising interval policy: short while the topology is moving, backing
+off exponentially once it has settled.
+*/
+#include <stdio.h>
+
+#include "adv_policy.h"
+
+static uint16_t ms_to_units(unsigned int ms) {
+	unsigned long units = (unsigned long) ms * 8 / 5;
+
+	if (units < ADV_INTERVAL_MIN)
+		return ADV_INTERVAL_MIN;
+	if (units > ADV_INTERVAL_MAX)
+		return ADV_INTERVAL_MAX;
+	return units;
+}
+
+/**
+ Sets up p to advertise at fast_ms after activity and back off to slow_ms
+ once nothing has changed for stable_ms. It starts out fast, a node that
+ just came up is discovering. Returns 0, or -1 if fast_ms exceeds slow_ms.
+**/
+int adv_policy_init(struct adv_policy *p, unsigned int fast_ms, unsigned int slow_ms, unsigned int stable_ms) {
+	if (fast_ms > slow_ms)
+		return -1;
+	pthread_mutex_init(&p->lock, NULL);
+	p->fast = ms_to_units(fast_ms);
+	p->slow = ms_to_units(slow_ms);
+	p->stable_ms = stable_ms ? stable_ms : 1;
+	p->interval = p->fast;
+	p->quiet_since_ms = p->busy_until_ms = p->last_step_ms = 0;
+	p->activity = p->backoffs = 0;
+	return 0;
+}
+
+/**
+ Parses "fast,slow,stable" in milliseconds into p, e.g. "20,1280,10000".
+ Missing trailing fields keep their defaults. Returns 0, or -1 with a
+ message if the spec is invalid.
+**/
+int adv_policy_parse(struct adv_policy *p, const char *spec) {
+	unsigned int fast = ADV_FAST_MS, slow = ADV_SLOW_MS, stable = ADV_STABLE_MS;
+
+	if (sscanf(spec, "%u,%u,%u", &fast, &slow, &stable) < 1 || adv_policy_init(p, fast, slow, stable) < 0) {
+		fprintf(stderr, "Invalid advertising interval policy \"%s\", expected fast,slow,stable in ms with fast <= slow\n", spec);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ Notes activity at now_ms: the interval drops to fast and stays there for
+ at least hold_ms (a handshake that must be heard), and then until the set
+ has been quiet for stable_ms.
+**/
+void adv_policy_activity(struct adv_policy *p, uint64_t now_ms, unsigned int hold_ms) {
+	pthread_mutex_lock(&p->lock);
+	p->interval = p->fast;
+	if (now_ms + hold_ms > p->busy_until_ms)
+		p->busy_until_ms = now_ms + hold_ms;
+	p->quiet_since_ms = p->busy_until_ms;
+	p->last_step_ms = p->busy_until_ms;
+	p->activity++;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/** Returns the interval to advertise at now_ms, stepping the backoff **/
+uint16_t adv_policy_interval(struct adv_policy *p, uint64_t now_ms) {
+	uint16_t interval;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->last_step_ms == 0)										// First call, the quiet period starts now
+		p->quiet_since_ms = p->last_step_ms = now_ms;
+	if (now_ms >= p->busy_until_ms && now_ms - p->quiet_since_ms >= p->stable_ms) {
+		while (p->interval < p->slow && now_ms - p->last_step_ms >= p->stable_ms) {
+			p->interval = p->interval * 2 < p->slow ? p->interval * 2 : p->slow;
+			p->last_step_ms += p->stable_ms;
+			p->backoffs++;
+		}
+	}
+	interval = p->interval;
+	pthread_mutex_unlock(&p->lock);
+	return interval;
+}
+
+/** The interval currently in use in milliseconds, for reporting **/
+unsigned int adv_policy_interval_ms(struct adv_policy *p) {
+	unsigned int units;
+
+	pthread_mutex_lock(&p->lock);
+	units = p->interval;
+	pthread_mutex_unlock(&p->lock);
+	return units * 5 / 8;
+}
@@ -0,0 +1,40 @@
+#ifndef ADV_POLICY_H_
+#define ADV_POLICY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define ADV_FAST_MS 100												// While discovering or delegating
+#define ADV_SLOW_MS 1280											// Once the neighbour set has settled
+#define ADV_STABLE_MS 10000											// Quiet time before each backoff step
+
+#define ADV_INTERVAL_MIN 0x0020										// 20 ms, in 0.625 ms units
+#define ADV_INTERVAL_MAX 0x4000										// 10.24 s
+
+/**
+ Adaptive advertising interval. Any activity (the advertised neighbour set
+ changing, a delegation in flight) drops the interval to fast. Once nothing
+ has happened for stable_ms the interval doubles, and again after every
+ further stable_ms, until it reaches slow. Intervals are in controller
+ units of 0.625 ms.
+**/
+struct adv_policy {
+	pthread_mutex_t lock;
+	uint16_t fast;
+	uint16_t slow;
+	unsigned int stable_ms;
+	uint16_t interval;
+	uint64_t quiet_since_ms;										// Last activity, or end of the last hold
+	uint64_t busy_until_ms;											// Held at fast until then
+	uint64_t last_step_ms;
+	unsigned long activity;
+	unsigned long backoffs;
+};
+
+int adv_policy_init(struct adv_policy *p, unsigned int fast_ms, unsigned int slow_ms, unsigned int stable_ms);
+int adv_policy_parse(struct adv_policy *p, const char *spec);
+void adv_policy_activity(struct adv_policy *p, uint64_t now_ms, unsigned int hold_ms);
+uint16_t adv_policy_interval(struct adv_policy *p, uint64_t now_ms);
+unsigned int adv_policy_interval_ms(struct adv_policy *p);
+
+#endif
@@ -0,0 +1,125 @@
+/*
+Iterator over the reports of an LE Advertising Report event.
+Each report is an le_advertising_info followed by length bytes of AD data
+and one signed RSSI byte, the reports follow each other back to back.
+Extended reports have a 24 byte header (event type, address, PHYs, SID,
+TX power, RSSI, periodic interval, direct address) and then the data.
+*/
+#include <string.h>
+
+#include "adv_report.h"
+
+#define EXT_EVT_CONNECTABLE 0x0001
+#define EXT_EVT_SCANNABLE 0x0002
+#define EXT_EVT_DIRECTED 0x0004
+#define EXT_EVT_SCAN_RSP 0x0008
+#define EXT_EVT_LEGACY 0x0010
+#define EXT_EVT_DATA_STATUS 0x0060									// 0 when the data is complete
+
+/**
+ Sets up it to walk the meta event of len bytes (subevent byte included).
+ Returns the number of reports announced by the event, or -1 if it is not
+ an advertising report or is too short to hold the num_reports byte.
+**/
+int adv_report_iter_init(struct adv_report_iter *it, const evt_le_meta_event *meta, size_t len) {
+	it->ptr = it->end = NULL;
+	it->remaining = 0;
+
+	if (len < 2 || (meta->subevent != EVT_LE_ADVERTISING_REPORT &&
+	                meta->subevent != EVT_LE_EXTENDED_ADVERTISING_REPORT))
+		return -1;
+
+	it->extended = meta->subevent == EVT_LE_EXTENDED_ADVERTISING_REPORT;
+	it->remaining = meta->data[0];
+	it->ptr = meta->data + 1;
+	it->end = (const uint8_t *) meta + len;
+	return it->remaining;
+}
+
+/** Legacy advertising report event type for an extended one **/
+static uint8_t legacy_evt_type(uint16_t evt) {
+	if (evt & EXT_EVT_SCAN_RSP)
+		return 0x04;												// SCAN_RSP
+	if (evt & EXT_EVT_DIRECTED)
+		return 0x01;												// ADV_DIRECT_IND
+	if (evt & EXT_EVT_CONNECTABLE)
+		return 0x00;												// ADV_IND
+	if (evt & EXT_EVT_SCANNABLE)
+		return 0x02;												// ADV_SCAN_IND
+	return 0x03;													// ADV_NONCONN_IND
+}
+
+/**
+ Converts the next extended report into it->scratch. Data split over
+ several events is not reassembled, the fragments announcing more data are
+ skipped. Mesh frames always fit in one report.
+**/
+static le_advertising_info* next_extended(struct adv_report_iter *it, int8_t *rssi) {
+	le_advertising_info *info = (le_advertising_info *) it->scratch;
+	const uint8_t *p;
+	uint16_t evt;
+	size_t need;
+
+	while (it->remaining > 0) {
+		p = it->ptr;
+		if ((size_t) (it->end - p) < EXT_ADV_REPORT_SIZE)
+			break;
+		need = EXT_ADV_REPORT_SIZE + p[23];
+		if ((size_t) (it->end - p) < need || p[23] > ADV_REPORT_MAX_DATA)
+			break;
+		it->ptr += need;
+		it->remaining--;
+
+		evt = p[0] | p[1] << 8;
+		if (evt & EXT_EVT_DATA_STATUS)
+			continue;
+
+		info->evt_type = legacy_evt_type(evt);
+		info->bdaddr_type = p[2];
+		memcpy(&info->bdaddr, p + 3, sizeof(bdaddr_t));
+		info->length = p[23];
+		memcpy(info->data, p + EXT_ADV_REPORT_SIZE, p[23]);
+		info->data[p[23]] = p[13];									// RSSI after the data, as in legacy reports
+		if (rssi)
+			*rssi = (int8_t) p[13];
+		return info;
+	}
+
+	it->remaining = 0;
+	return NULL;
+}
+
+/**
+ Returns the next report and stores its RSSI in rssi (if not NULL), or
+ returns NULL once all reports are consumed or the next one would run past
+ the end of the event.
+**/
+le_advertising_info* adv_report_next(struct adv_report_iter *it, int8_t *rssi) {
+	const le_advertising_info *info;
+	size_t avail, need;
+
+	if (it->remaining == 0)
+		return NULL;
+	if (it->extended)
+		return next_extended(it, rssi);
+
+	avail = it->end - it->ptr;
+	if (avail < LE_ADVERTISING_INFO_SIZE + 1)
+		goto truncated;
+
+	info = (const le_advertising_info *) it->ptr;
+	need = LE_ADVERTISING_INFO_SIZE + info->length + 1;
+	if (avail < need)
+		goto truncated;
+
+	if (rssi)
+		*rssi = (int8_t) info->data[info->length];
+
+	it->ptr += need;
+	it->remaining--;
+	return (le_advertising_info *) info;
+
+truncated:
+	it->remaining = 0;
+	return NULL;
+}
@@ -0,0 +1,214 @@
+/*
+Advertising rotation on a timerfd driven thread, so the payload changes at
+a fixed rate while the scan pipeline keeps running.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "adv_scheduler.h"
+
+static int arm_timer(struct adv_scheduler *s) {
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = s->period_ms / 1000;
+	its.it_interval.tv_nsec = (s->period_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	return timerfd_settime(s->timerfd, 0, &its, NULL);
+}
+
+/** Builds the frame for this tick, lock held. Returns 0 if there is nothing to send. **/
+static int next_frame(struct adv_scheduler *s, struct mesh_adv *msg) {
+	int i, j;
+
+	memset(msg, 0, sizeof(*msg));
+
+	if (s->with_digest && s->digest_due) {
+		msg->type = MESH_ADV_DIGEST;
+		msg->digest = s->digest;
+		msg->generation = s->generation;
+		msg->total = s->count;
+		s->digest_due = 0;
+		return 1;
+	}
+
+	msg->type = MESH_ADV_NEIGHBOURS;
+	for (i = 0; i < s->count && msg->count < s->frame_addrs; i++) {
+		if (s->set[i].fresh) {
+			s->set[i].fresh = 0;
+			msg->addrs[msg->count++] = s->set[i].key;
+		}
+	}
+
+	for (i = 0; i < s->count && msg->count < s->frame_addrs; i++) {
+		uint64_t key = s->set[s->next].key;
+
+		for (j = 0; j < msg->count && msg->addrs[j] != key; j++);
+		if (j == msg->count)
+			msg->addrs[msg->count++] = key;
+		if (++s->next == s->count) {								// Wrapped, announce the set again
+			s->next = 0;
+			s->digest_due = 1;
+			break;
+		}
+	}
+
+	return msg->count > 0 || !s->with_digest;
+}
+
+static void* scheduler_main(void *arg) {
+	struct adv_scheduler *s = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = s->timerfd, .events = POLLIN },
+		{ .fd = s->stopfd, .events = POLLIN }
+	};
+	struct mesh_adv msg;
+	uint64_t expirations;
+	int send;
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Advertising scheduler");
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (read(s->timerfd, &expirations, sizeof(expirations)) < 0)
+			continue;
+
+		pthread_mutex_lock(&s->lock);
+		send = next_frame(s, &msg);
+		if (send)
+			s->frames_sent++;
+		pthread_mutex_unlock(&s->lock);
+
+		if (send)
+			s->send(&msg, s->arg);									// HCI I/O outside the lock
+	}
+	return NULL;
+}
+
+/**
+ Starts sending one frame every period_ms through send, which is called on
+ the scheduler thread. Returns 0 on success, -1 on failure.
+**/
+int adv_scheduler_start(struct adv_scheduler *s, unsigned int period_ms, int with_digest, adv_send_fn send, void *arg) {
+	memset(s, 0, sizeof(*s));
+	pthread_mutex_init(&s->lock, NULL);
+	s->period_ms = period_ms ? period_ms : 1;
+	s->with_digest = with_digest;
+	s->frame_addrs = MESH_ADV_MAX_ADDRS;
+	s->digest_due = 1;
+	s->send = send;
+	s->arg = arg;
+
+	s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	s->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (s->timerfd < 0 || s->stopfd < 0 || arm_timer(s) < 0) {
+		perror("Advertising scheduler timer");
+		goto failed;
+	}
+	if (pthread_create(&s->thread, NULL, scheduler_main, s) != 0) {
+		perror("pthread_create");
+		goto failed;
+	}
+	return 0;
+
+failed:
+	if (s->timerfd >= 0)
+		close(s->timerfd);
+	if (s->stopfd >= 0)
+		close(s->stopfd);
+	s->timerfd = s->stopfd = -1;
+	return -1;
+}
+
+/**
+ Replaces the advertised set with addrs[0..count). Addresses not in the
+ previous set are marked fresh, and any change gets a new digest
+ generation that is announced on the next tick. Returns 1 if the set
+ changed, 0 if not.
+**/
+int adv_scheduler_update(struct adv_scheduler *s, const uint64_t *addrs, int count) {
+	struct adv_entry set[ADV_SCHED_MAX];
+	uint32_t digest;
+	int i, j, n = 0;
+
+	if (count > ADV_SCHED_MAX)
+		count = ADV_SCHED_MAX;
+	digest = mesh_adv_digest(addrs, count);
+
+	pthread_mutex_lock(&s->lock);
+	if (digest == s->digest && count == s->count) {
+		pthread_mutex_unlock(&s->lock);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		set[n].key = addrs[i];
+		set[n].fresh = 1;
+		for (j = 0; j < s->count; j++) {
+			if (s->set[j].key == addrs[i]) {
+				set[n].fresh = s->set[j].fresh;
+				break;
+			}
+		}
+		n++;
+	}
+
+	memcpy(s->set, set, n * sizeof(set[0]));
+	s->count = n;
+	if (s->next >= n)
+		s->next = 0;
+	s->digest = digest;
+	s->generation++;
+	s->digest_due = 1;
+	pthread_mutex_unlock(&s->lock);
+	return 1;
+}
+
+/** Changes how often the payload rotates **/
+int adv_scheduler_set_rate(struct adv_scheduler *s, unsigned int period_ms) {
+	int ret;
+
+	pthread_mutex_lock(&s->lock);
+	s->period_ms = period_ms ? period_ms : 1;
+	ret = arm_timer(s);
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+/**
+ Sets how many addresses go in one NEIGHBOURS frame, MESH_ADV_MAX_ADDRS
+ for legacy advertising and up to MESH_ADV_EXT_MAX_ADDRS for extended.
+**/
+void adv_scheduler_set_frame_addrs(struct adv_scheduler *s, int frame_addrs) {
+	if (frame_addrs < 1)
+		frame_addrs = 1;
+	if (frame_addrs > MESH_ADV_EXT_MAX_ADDRS)
+		frame_addrs = MESH_ADV_EXT_MAX_ADDRS;
+	pthread_mutex_lock(&s->lock);
+	s->frame_addrs = frame_addrs;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void adv_scheduler_stop(struct adv_scheduler *s) {
+	uint64_t one = 1;
+
+	if (s->stopfd < 0)
+		return;
+	if (write(s->stopfd, &one, sizeof(one)) < 0)
+		perror("Advertising scheduler stop");
+	pthread_join(s->thread, NULL);
+	close(s->timerfd);
+	close(s->stopfd);
+	s->timerfd = s->stopfd = -1;
+	pthread_mutex_destroy(&s->lock);
+}
@@ -0,0 +1,52 @@
+#ifndef ADV_SCHEDULER_H_
+#define ADV_SCHEDULER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "mesh_adv.h"
+
+#define ADV_SCHED_MAX 32											// Neighbours in the advertised set
+
+typedef void (*adv_send_fn)(const struct mesh_adv *msg, void *arg);
+
+struct adv_entry {
+	uint64_t key;
+	uint8_t fresh;													// New or changed, goes out before the rotation
+};
+
+/**
+ Rotates the node's neighbour set through the advertising payload on its
+ own timer thread, independent of the scan windows. Every tick sends one
+ frame through send: a DIGEST frame at the start of each rotation and
+ after every change (when with_digest is set), otherwise up to
+ frame_addrs neighbours, fresh ones first and the rest in
+ rotation order.
+**/
+struct adv_scheduler {
+	pthread_mutex_t lock;
+	pthread_t thread;
+	int timerfd;
+	int stopfd;
+	unsigned int period_ms;
+	int with_digest;
+	int frame_addrs;												// Addresses per NEIGHBOURS frame
+	adv_send_fn send;
+	void *arg;
+
+	struct adv_entry set[ADV_SCHED_MAX];
+	int count;
+	int next;														// Rotation cursor into set
+	int digest_due;
+	uint32_t digest;
+	uint16_t generation;
+	unsigned long frames_sent;
+};
+
+int adv_scheduler_start(struct adv_scheduler *s, unsigned int period_ms, int with_digest, adv_send_fn send, void *arg);
+int adv_scheduler_update(struct adv_scheduler *s, const uint64_t *addrs, int count);
+int adv_scheduler_set_rate(struct adv_scheduler *s, unsigned int period_ms);
+void adv_scheduler_set_frame_addrs(struct adv_scheduler *s, int frame_addrs);
+void adv_scheduler_stop(struct adv_scheduler *s);
+
+#endif
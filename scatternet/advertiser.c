@@ -0,0 +1,409 @@
+/*
+Advertising through one long-lived HCI socket. advertise() used to reopen
+the adapter and send parameters, data and enable on every rotation, most of
+which the controller already had.
+*/
+#include <stdio.h>
+#include <string.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <bluetooth/hci_lib.h>
+
+#include "advertiser.h"
+
+#define HCI_TIMEOUT_MS 1000
+
+static struct hci_request ble_hci_request(uint16_t ocf, int clen, void * status, void * cparam)
+{
+	struct hci_request rq;
+	memset(&rq, 0, sizeof(rq));
+	rq.ogf = OGF_LE_CTL;
+	rq.ocf = ocf;
+	rq.cparam = cparam;
+	rq.clen = clen;
+	rq.rparam = status;
+	rq.rlen = 1;
+	return rq;
+}
+
+/** Default transport, arg is the advertiser owning the adapter **/
+static int hci_cmd(void *arg, uint16_t ocf, void *cparam, int clen, void *rparam, int rlen) {
+	struct advertiser *adv = arg;
+	struct hci_request rq = ble_hci_request(ocf, clen, rparam, cparam);
+
+	rq.rlen = rlen;
+	return hci_send_req(adv->dd, &rq, HCI_TIMEOUT_MS);
+}
+
+/** Sends one LE command and checks its status. Returns 0 or -1. **/
+static int send_cmd(struct advertiser *adv, uint16_t ocf, void *cparam, int clen, const char *what) {
+	uint8_t status = 0;
+
+	adv->commands_sent++;
+	if (adv->cmd(adv->cmd_arg, ocf, cparam, clen, &status, 1) < 0) {
+		perror(what);
+		return -1;
+	}
+	if (status != 0) {
+		fprintf(stderr, "%s: controller status 0x%02x\n", what, status);
+		return -1;
+	}
+	return 0;
+}
+
+/** Sends a command that returns more than a status, rparam[0] is the status **/
+static int read_cmd(struct advertiser *adv, uint16_t ocf, uint8_t *rparam, int rlen) {
+	memset(rparam, 0, rlen);
+	adv->commands_sent++;
+	if (adv->cmd(adv->cmd_arg, ocf, NULL, 0, rparam, rlen) < 0)
+		return -1;
+	return rparam[0] == 0 ? 0 : -1;
+}
+
+/**
+ Asks the controller whether it supports extended advertising and, if so,
+ how many sets and how much data. Returns 1 if it does, 0 if not.
+**/
+static int probe_extended(struct advertiser *adv) {
+	uint8_t features[1 + 8], sets[1 + 1], max_data[1 + 2];
+
+	if (read_cmd(adv, EXT_ADV_READ_FEATURES, features, sizeof(features)) < 0)
+		return 0;
+	if (!(features[1 + EXT_ADV_FEATURE_BYTE] & EXT_ADV_FEATURE_MASK))
+		return 0;
+	if (read_cmd(adv, EXT_ADV_READ_NUM_SETS, sets, sizeof(sets)) < 0 || sets[1] == 0)
+		return 0;
+	if (read_cmd(adv, EXT_ADV_READ_MAX_DATA, max_data, sizeof(max_data)) < 0)
+		return 0;
+
+	adv->max_sets = sets[1] < ADV_MAX_SETS ? sets[1] : ADV_MAX_SETS;
+	adv->max_data = max_data[1] | max_data[2] << 8;
+	if (adv->max_data > EXT_ADV_MAX_DATA)
+		adv->max_data = EXT_ADV_MAX_DATA;
+	return 1;
+}
+
+/**
+ Opens the default adapter and attaches to it, see advertiser_attach().
+ Returns 0 on success, -1 on failure.
+**/
+int advertiser_open(struct advertiser *adv, int want_extended) {
+	adv->dev_id = hci_get_route(NULL);
+	adv->dd = hci_open_dev(adv->dev_id);
+	if (adv->dd < 0) {
+		perror("Failed to open HCI device");
+		return -1;
+	}
+	return advertiser_attach(adv, hci_cmd, adv, want_extended);
+}
+
+/**
+ Starts advertising through cmd. With want_extended, extended advertising
+ is used if the controller has it, adv->extended tells which mode was
+ chosen. Any advertising still on from a previous run is turned off with
+ the commands of that mode only, the controller does not accept a mix.
+ adv->dd is kept, it belongs to whoever opened the adapter. Returns 0.
+**/
+int advertiser_attach(struct advertiser *adv, adv_cmd_fn cmd, void *arg, int want_extended) {
+	ext_adv_enable_cp ext;
+	le_set_advertise_enable_cp cp;
+	uint8_t status;
+	int dev_id = adv->dev_id, dd = adv->dd;
+
+	memset(adv, 0, sizeof(*adv));
+	adv->dev_id = dev_id;
+	adv->dd = dd;
+	adv->cmd = cmd;
+	adv->cmd_arg = arg;
+	adv->max_sets = 1;
+	adv->max_data = ADV_LEGACY_MAX_DATA;
+
+	if (want_extended && probe_extended(adv)) {
+		adv->extended = 1;
+		memset(&ext, 0, sizeof(ext));								// num_sets 0 disables all sets
+		cmd(arg, EXT_ADV_SET_ENABLE, &ext, 2, &status, 1);
+		cmd(arg, EXT_ADV_CLEAR_SETS, NULL, 0, &status, 1);
+		return 0;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cmd(arg, OCF_LE_SET_ADVERTISE_ENABLE, &cp, LE_SET_ADVERTISE_ENABLE_CP_SIZE, &status, 1);	// Fails harmlessly if already off
+	return 0;
+}
+
+/**
+ Sets the advertising interval range in 0.625 ms units. The controller only
+ accepts new parameters while advertising is off, so an enabled advertiser
+ is briefly disabled around the change.
+**/
+int advertiser_set_params(struct advertiser *adv, uint16_t min_interval, uint16_t max_interval) {
+	le_set_advertising_parameters_cp cp;
+	int was_enabled = adv->enabled;
+
+	if (adv->extended)
+		return adv_set_params(adv, 0, min_interval, max_interval);
+
+	memset(&cp, 0, sizeof(cp));
+	cp.min_interval = htobs(min_interval);
+	cp.max_interval = htobs(max_interval);
+	cp.chan_map = 7;
+
+	if (adv->have_params && memcmp(&cp, &adv->params, sizeof(cp)) == 0) {
+		adv->commands_skipped++;
+		return 0;
+	}
+
+	if (was_enabled && advertiser_enable(adv, 0) < 0)
+		return -1;
+	if (send_cmd(adv, OCF_LE_SET_ADVERTISING_PARAMETERS, &cp,
+			LE_SET_ADVERTISING_PARAMETERS_CP_SIZE, "Failed to set advertisement parameters") < 0)
+		return -1;
+	adv->params = cp;
+	adv->have_params = 1;
+	return was_enabled ? advertiser_enable(adv, 1) : 0;
+}
+
+/** Sets the advertising data, which may change while advertising **/
+int advertiser_set_data(struct advertiser *adv, const le_set_advertising_data_cp *data) {
+	le_set_advertising_data_cp cp = *data;
+
+	if (adv->extended)
+		return adv_set_data(adv, 0, data->data, data->length);
+
+	if (adv->have_data && memcmp(&cp, &adv->data, sizeof(cp)) == 0) {
+		adv->commands_skipped++;
+		return 0;
+	}
+	if (send_cmd(adv, OCF_LE_SET_ADVERTISING_DATA, &cp,
+			LE_SET_ADVERTISING_DATA_CP_SIZE, "Failed to set advertising data") < 0) {
+		adv->have_data = 0;
+		return -1;
+	}
+	adv->data = cp;
+	adv->have_data = 1;
+	return 0;
+}
+
+int advertiser_enable(struct advertiser *adv, int enable) {
+	le_set_advertise_enable_cp cp;
+
+	if (adv->extended)
+		return adv_set_enable(adv, 0, enable, 0);
+
+	enable = !!enable;
+	if (adv->enabled == enable) {
+		adv->commands_skipped++;
+		return 0;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+	if (send_cmd(adv, OCF_LE_SET_ADVERTISE_ENABLE, &cp,
+			LE_SET_ADVERTISE_ENABLE_CP_SIZE, enable ? "Failed to enable advertising" : "Failed to disable advertising") < 0)
+		return -1;
+	adv->enabled = enable;
+	return 0;
+}
+
+static void put_interval(uint8_t *p, uint32_t interval) {
+	p[0] = interval & 0xff;
+	p[1] = (interval >> 8) & 0xff;
+	p[2] = (interval >> 16) & 0xff;
+}
+
+/**
+ Sends the parameters of set handle, disabling it around the change. Sets
+ whose data fits in a legacy advertisement use legacy PDUs, so scanners
+ that only know legacy advertising still hear them. Every set is
+ connectable like the legacy ADV_IND, neighbours open their links to
+ whichever frame of ours they heard.
+**/
+static int send_set_params(struct advertiser *adv, uint8_t handle, ext_adv_params_cp *cp) {
+	struct adv_instance *set = &adv->sets[handle];
+	int was_enabled = set->enabled;
+	uint8_t rparam[2];
+
+	if (set->have_params && memcmp(cp, &set->params, sizeof(*cp)) == 0) {
+		adv->commands_skipped++;
+		return 0;
+	}
+
+	if (was_enabled && adv_set_enable(adv, handle, 0, 0) < 0)
+		return -1;
+	adv->commands_sent++;
+	if (adv->cmd(adv->cmd_arg, EXT_ADV_SET_PARAMS, cp, EXT_ADV_PARAMS_CP_SIZE, rparam, sizeof(rparam)) < 0) {
+		perror("Failed to set extended advertising parameters");
+		return -1;
+	}
+	if (rparam[0] != 0) {
+		fprintf(stderr, "Failed to set extended advertising parameters: controller status 0x%02x\n", rparam[0]);
+		return -1;
+	}
+	set->params = *cp;
+	set->have_params = 1;
+	return was_enabled ? adv_set_enable(adv, handle, 1, 0) : 0;
+}
+
+/**
+ Sets the interval range of set handle in 0.625 ms units. Without extended
+ advertising only handle 0 exists and the legacy command is used. Returns
+ 0 on success, -1 on failure or an unknown handle.
+**/
+int adv_set_params(struct advertiser *adv, uint8_t handle, uint32_t min_interval, uint32_t max_interval) {
+	ext_adv_params_cp cp;
+	struct adv_instance *set;
+
+	if (!adv->extended)
+		return handle == 0 ? advertiser_set_params(adv, min_interval, max_interval) : -1;
+	if (handle >= adv->max_sets)
+		return -1;
+
+	set = &adv->sets[handle];
+	if (set->have_params)
+		cp = set->params;
+	else {
+		memset(&cp, 0, sizeof(cp));
+		cp.handle = handle;
+		cp.properties = htobs(EXT_ADV_PROP_LEGACY_IND);
+		cp.chan_map = 7;
+		cp.tx_power = 0x7f;											// No preference
+		cp.primary_phy = 0x01;										// LE 1M
+		cp.secondary_phy = 0x01;
+		cp.sid = handle;
+	}
+	put_interval(cp.min_interval, min_interval);
+	put_interval(cp.max_interval, max_interval);
+	return send_set_params(adv, handle, &cp);
+}
+
+/** Removes set handle from the controller, which then takes any parameters for it **/
+static int remove_set(struct advertiser *adv, uint8_t handle) {
+	struct adv_instance *set = &adv->sets[handle];
+
+	if (set->enabled && adv_set_enable(adv, handle, 0, 0) < 0)
+		return -1;
+	if (send_cmd(adv, EXT_ADV_REMOVE_SET, &handle, 1, "Failed to remove advertising set") < 0)
+		return -1;
+	set->have_params = 0;
+	set->have_data = 0;
+	return 0;
+}
+
+/**
+ Sets the payload of set handle, up to adv->max_data bytes of AD data. The
+ set needs its parameters first. A payload longer than a legacy
+ advertisement switches the set to extended PDUs, which only scanners
+ using extended scanning receive. Going back to legacy PDUs, the set is
+ removed first: a controller refuses legacy parameters for a set that
+ holds more data than they allow. Returns 0 on success, -1 on failure.
+**/
+int adv_set_data(struct advertiser *adv, uint8_t handle, const uint8_t *data, int len) {
+	ext_adv_data_cp cp;
+	ext_adv_params_cp params;
+	struct adv_instance *set;
+	uint16_t props;
+	int reenable = 0;
+
+	if (len < 0 || len > adv->max_data)
+		return -1;
+	if (!adv->extended) {
+		le_set_advertising_data_cp legacy;
+
+		if (handle != 0)
+			return -1;
+		memset(&legacy, 0, sizeof(legacy));
+		memcpy(legacy.data, data, len);
+		legacy.length = len;
+		return advertiser_set_data(adv, &legacy);
+	}
+	if (handle >= adv->max_sets || !adv->sets[handle].have_params)
+		return -1;
+
+	set = &adv->sets[handle];
+	if (set->have_data && set->len == len && memcmp(set->data, data, len) == 0) {
+		adv->commands_skipped++;
+		return 0;
+	}
+
+	props = len > ADV_LEGACY_MAX_DATA ? EXT_ADV_PROP_CONNECTABLE : EXT_ADV_PROP_LEGACY_IND;
+	if (btohs(set->params.properties) != props) {				// The old data may not fit the new PDU type
+		reenable = set->enabled;
+		params = set->params;
+		params.properties = htobs(props);
+		if (props & EXT_ADV_PROP_LEGACY) {
+			if (remove_set(adv, handle) < 0)
+				return -1;
+		} else if (reenable && adv_set_enable(adv, handle, 0, 0) < 0)
+			return -1;
+		if (send_set_params(adv, handle, &params) < 0)
+			return -1;
+		set->have_data = 0;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = handle;
+	cp.operation = EXT_ADV_OP_COMPLETE;
+	cp.frag_pref = EXT_ADV_NO_FRAGMENT;
+	cp.length = len;
+	memcpy(cp.data, data, len);
+	if (send_cmd(adv, EXT_ADV_SET_DATA, &cp, 4 + len, "Failed to set extended advertising data") < 0) {
+		set->have_data = 0;
+		return -1;
+	}
+	memcpy(set->data, data, len);
+	set->len = len;
+	set->have_data = 1;
+	return reenable ? adv_set_enable(adv, handle, 1, 0) : 0;
+}
+
+/**
+ Enables or disables set handle. With duration_ms the controller stops the
+ set by itself after that long, so such an enable is always sent. Legacy
+ advertising has no duration and keeps going. Returns 0 or -1.
+**/
+int adv_set_enable(struct advertiser *adv, uint8_t handle, int enable, unsigned int duration_ms) {
+	ext_adv_enable_cp cp;
+	struct adv_instance *set;
+
+	if (!adv->extended)
+		return handle == 0 ? advertiser_enable(adv, enable) : -1;
+	if (handle >= adv->max_sets)
+		return -1;
+
+	set = &adv->sets[handle];
+	enable = !!enable;
+	if (set->enabled == enable && !(enable && duration_ms)) {
+		adv->commands_skipped++;
+		return 0;
+	}
+
+	memset(&cp, 0, sizeof(cp));
+	cp.enable = enable;
+	cp.num_sets = 1;
+	cp.handle = handle;
+	cp.duration = htobs(duration_ms ? (duration_ms + 9) / 10 : 0);
+	if (send_cmd(adv, EXT_ADV_SET_ENABLE, &cp, sizeof(cp),
+			enable ? "Failed to enable advertising set" : "Failed to disable advertising set") < 0)
+		return -1;
+	set->enabled = enable && !duration_ms;							// A timed set ends on its own
+	return 0;
+}
+
+/** Stops advertising and closes the adapter **/
+void advertiser_close(struct advertiser *adv) {
+	ext_adv_enable_cp cp;
+
+	if (!adv->cmd)
+		return;
+	if (adv->extended) {
+		memset(&cp, 0, sizeof(cp));
+		send_cmd(adv, EXT_ADV_SET_ENABLE, &cp, 2, "Failed to disable advertising sets");
+		send_cmd(adv, EXT_ADV_CLEAR_SETS, NULL, 0, "Failed to clear advertising sets");
+	} else
+		advertiser_enable(adv, 0);
+	if (adv->dd >= 0)
+		hci_close_dev(adv->dd);
+	adv->dd = -1;
+	adv->cmd = NULL;
+}
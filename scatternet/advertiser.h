@@ -0,0 +1,129 @@
+#ifndef ADVERTISER_H_
+#define ADVERTISER_H_
+
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+/*
+LE Extended Advertising commands (Bluetooth 5.0), not in every BlueZ hci.h.
+*/
+#define EXT_ADV_READ_FEATURES 0x0003								// LE Read Local Supported Features
+#define EXT_ADV_SET_PARAMS 0x0036
+#define EXT_ADV_SET_DATA 0x0037
+#define EXT_ADV_SET_ENABLE 0x0039
+#define EXT_ADV_READ_MAX_DATA 0x003A
+#define EXT_ADV_READ_NUM_SETS 0x003B
+#define EXT_ADV_REMOVE_SET 0x003C
+#define EXT_ADV_CLEAR_SETS 0x003D
+
+#define EXT_ADV_FEATURE_BYTE 1										// Feature bit 12, LE Extended Advertising
+#define EXT_ADV_FEATURE_MASK 0x10
+#define EXT_ADV_PROP_CONNECTABLE 0x0001								// Peers may connect, formation links need it
+#define EXT_ADV_PROP_SCANNABLE 0x0002
+#define EXT_ADV_PROP_LEGACY 0x0010									// Legacy PDU, heard by legacy scanners
+#define EXT_ADV_PROP_LEGACY_IND 0x0013								// ADV_IND, what the legacy command sends
+#define EXT_ADV_OP_COMPLETE 0x03
+#define EXT_ADV_NO_FRAGMENT 0x01
+#define EXT_ADV_PARAMS_CP_SIZE 25
+#define EXT_ADV_MAX_DATA 251										// Largest payload one command carries
+
+#define ADV_LEGACY_MAX_DATA 31
+#define ADV_MAX_SETS 4
+
+typedef struct {
+	uint8_t handle;
+	uint16_t properties;
+	uint8_t min_interval[3];
+	uint8_t max_interval[3];
+	uint8_t chan_map;
+	uint8_t own_addr_type;
+	uint8_t peer_addr_type;
+	bdaddr_t peer_addr;
+	uint8_t filter_policy;
+	int8_t tx_power;
+	uint8_t primary_phy;
+	uint8_t secondary_max_skip;
+	uint8_t secondary_phy;
+	uint8_t sid;
+	uint8_t scan_req_notify;
+} __attribute__ ((packed)) ext_adv_params_cp;
+
+typedef struct {
+	uint8_t handle;
+	uint8_t operation;
+	uint8_t frag_pref;
+	uint8_t length;
+	uint8_t data[EXT_ADV_MAX_DATA];
+} __attribute__ ((packed)) ext_adv_data_cp;
+
+typedef struct {
+	uint8_t enable;
+	uint8_t num_sets;
+	uint8_t handle;
+	uint16_t duration;												// 10 ms units, 0 until disabled
+	uint8_t max_events;
+} __attribute__ ((packed)) ext_adv_enable_cp;
+
+/**
+ Sends one LE controller command with clen parameter bytes and reads rlen
+ return bytes into rparam, the first being the command status. Returns 0 if
+ the command completed (whatever its status), -1 on a transport error.
+**/
+typedef int (*adv_cmd_fn)(void *arg, uint16_t ocf, void *cparam, int clen, void *rparam, int rlen);
+
+/** One advertising set as last sent to the controller **/
+struct adv_instance {
+	int enabled;
+	int have_params;
+	int have_data;
+	ext_adv_params_cp params;
+	uint8_t data[EXT_ADV_MAX_DATA];
+	uint8_t len;
+};
+
+/**
+ Persistent advertiser. The adapter stays open and the last parameters,
+ data and enable state sent to the controller are remembered, so each call
+ only issues the HCI commands whose inputs changed.
+
+ Commands go through cmd, hci_send_req() on the adapter unless another
+ transport (such as a simulated controller) was attached. If extended
+ advertising was asked for and the controller supports it, every set
+ handle below max_sets is an independent advertising instance with its
+ own interval and up to max_data bytes of payload. Otherwise the
+ advertiser falls back to the one legacy instance, handle 0, with 31.
+ A controller rejects legacy advertising and scanning commands once it
+ has seen extended ones and the other way round, so the scan session has
+ to follow the mode chosen here.
+**/
+struct advertiser {
+	int dev_id;
+	int dd;
+	adv_cmd_fn cmd;
+	void *cmd_arg;
+	int extended;
+	int max_sets;
+	int max_data;
+	int enabled;
+	int have_params;
+	int have_data;
+	le_set_advertising_parameters_cp params;
+	le_set_advertising_data_cp data;
+	struct adv_instance sets[ADV_MAX_SETS];
+	unsigned long commands_sent;
+	unsigned long commands_skipped;
+};
+
+int advertiser_open(struct advertiser *adv, int want_extended);
+int advertiser_attach(struct advertiser *adv, adv_cmd_fn cmd, void *arg, int want_extended);
+int advertiser_set_params(struct advertiser *adv, uint16_t min_interval, uint16_t max_interval);
+int advertiser_set_data(struct advertiser *adv, const le_set_advertising_data_cp *data);
+int advertiser_enable(struct advertiser *adv, int enable);
+int adv_set_params(struct advertiser *adv, uint8_t handle, uint32_t min_interval, uint32_t max_interval);
+int adv_set_data(struct advertiser *adv, uint8_t handle, const uint8_t *data, int len);
+int adv_set_enable(struct advertiser *adv, uint8_t handle, int enable, unsigned int duration_ms);
+void advertiser_close(struct advertiser *adv);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -36,11 +37,22 @@ typedef enum {false, true} bool;
 
 static struct hci_dev_info di;
 //static void print_dev_hdr(struct hci_dev_info *di);
+static int (*peer_alive)(const char *addr) = NULL;					// Stops retries to peers that have gone
+
+/**
+ Sets a check socket_creator() asks after each failed attempt, so it stops
+ retrying once the peer is no longer a neighbour. scan_peer_alive() in
+ scan_adv.c answers from the aged neighbour graph. NULL retries forever.
+**/
+void set_peer_check(int (*alive)(const char *addr)){
+	peer_alive = alive;
+}
 
 /** 
  Takes in an array of bluetooth addresses, which are slaves to
  connect to. Creates a new socket for each connection. Returns a
- connection socket for each connection.
+ connection socket for each connection, or -1 if the peer went away
+ while retrying, see set_peer_check().
 **/
 int socket_creator(char *arr, struct sockaddr_l2 loc_addr, struct sockaddr_l2 rem_addr){
 	
@@ -73,6 +85,10 @@ int socket_creator(char *arr, struct sockaddr_l2 loc_addr, struct sockaddr_l2 re
 			printf(KRED "-----Pi %s failed to connect-----\n" KNRM, arr);
 			perror(KRED "status" KNRM);
 			close(connection_socket);
+			if (peer_alive != NULL && !peer_alive(arr)) {
+				printf(KRED "Pi %s is no longer a neighbour, giving up\n" KNRM, arr);
+				return -1;
+			}
 		}
 		if (0 == status) {
 			printf(KGRN "Connection socket value: %d\n" KNRM, connection_socket);
@@ -84,6 +100,111 @@ int socket_creator(char *arr, struct sockaddr_l2 loc_addr, struct sockaddr_l2 re
 }
 
 
+/**
+ Starts connecting to addr without waiting for the connection. Returns the
+ socket, which becomes writable once the attempt ended, see
+ connect_finish(), or -1 if it could not even be started.
+**/
+int connect_start(const char *addr){
+	struct sockaddr_l2 loc_addr = {0};
+	struct sockaddr_l2 rem_addr = {0};
+	int connection_socket;
+
+	loc_addr.l2_family = AF_BLUETOOTH;
+	loc_addr.l2_bdaddr = *BDADDR_ANY;
+	loc_addr.l2_cid = htobs(ATT_CID);
+	loc_addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+
+	rem_addr.l2_family = AF_BLUETOOTH;
+	rem_addr.l2_cid = htobs(ATT_CID);
+	rem_addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+	str2ba(addr, &rem_addr.l2_bdaddr);
+
+	connection_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+	if (-1 == connection_socket) {
+		perror("connection_socket");
+		return -1;
+	}
+	if (-1 == bind(connection_socket, (struct sockaddr *)&loc_addr, sizeof(loc_addr))) {
+		perror("bind_status");
+		close(connection_socket);
+		return -1;
+	}
+	if (-1 == connect(connection_socket, (struct sockaddr *)&rem_addr, sizeof(rem_addr)) && errno != EINPROGRESS) {
+		printf(KRED "-----Pi %s failed to connect-----\n" KNRM, addr);
+		close(connection_socket);
+		return -1;
+	}
+	return connection_socket;
+}
+
+/**
+ Result of a connect_start() attempt once its socket is writable: 0 if
+ connected, -1 if not, in which case the socket is closed.
+**/
+int connect_finish(int connection_socket, const char *addr){
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(connection_socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+		printf(KRED "-----Pi %s failed to connect: %s-----\n" KNRM, addr, strerror(error));
+		close(connection_socket);
+		return -1;
+	}
+	printf(KGRN "Pi %s connected\n" KNRM, addr);
+	return 0;
+}
+
+/**
+ Opens a listening socket that never blocks, readable whenever a
+ neighbour connected, see accept_ready(). -1 on failure.
+**/
+int listen_start(void){
+	struct sockaddr_l2 loc_addr = { 0 };
+	int connection_socket;
+
+	loc_addr.l2_family = AF_BLUETOOTH;
+	loc_addr.l2_bdaddr = *BDADDR_ANY;
+	loc_addr.l2_cid = htobs(ATT_CID);
+	loc_addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+
+	connection_socket = socket(AF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+	if (-1 == connection_socket) {
+		perror("connection_socket");
+		return -1;
+	}
+	if (bind(connection_socket, (struct sockaddr *)&loc_addr, sizeof(loc_addr)) < 0 ||
+	    listen(connection_socket, 10) < 0) {
+		perror("listen");
+		close(connection_socket);
+		return -1;
+	}
+	return connection_socket;
+}
+
+/**
+ Accepts one pending connection on a listen_start() socket and writes the
+ peer's address into addr (18 bytes). Returns the connection, or -1 if
+ there was none.
+**/
+int accept_ready(int listen_socket, char *addr){
+	struct sockaddr_l2 rem_addr = { 0 };
+	socklen_t opt = sizeof(rem_addr);
+	int connection_fd;
+
+	connection_fd = accept(listen_socket, (struct sockaddr *)&rem_addr, &opt);
+	if (connection_fd < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			perror("accept");
+		return -1;
+	}
+	fcntl(connection_fd, F_SETFL, fcntl(connection_fd, F_GETFL) | O_NONBLOCK);
+	ba2str(&rem_addr.l2_bdaddr, addr);
+	fprintf(stderr, "accepted connection from %s\n", addr);
+	return connection_fd;
+}
+
+
 /**
 	This method sets up its local bluetooth adapter and the type of the
 	remote bluetooth adapter it will connect to. It then connects 
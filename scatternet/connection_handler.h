@@ -1,10 +1,19 @@
 #ifndef CONNECTION_HANDLER_H_
 #define CONNECTION_HANDLER_H_
 
-int socket_creator(char *arr, struct sockaddr_l2 loc_addr, struct sockaddr_l2 rem_addr)
-int* connect_to_neighbour(char (*array)[18])
-int accept_a_neighbour()
-char* print_own_bd_addr()
-char* print_dev_hdr(struct hci_dev_info *di)
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/l2cap.h>
+#include <bluetooth/hci.h>
+
+void set_peer_check(int (*alive)(const char *addr));
+int socket_creator(char *arr, struct sockaddr_l2 loc_addr, struct sockaddr_l2 rem_addr);
+int connect_start(const char *addr);
+int connect_finish(int connection_socket, const char *addr);
+int listen_start(void);
+int accept_ready(int listen_socket, char *addr);
+int* connect_to_neighbour(char (*array)[18]);
+int accept_a_neighbour();
+char* print_own_bd_addr();
+char* print_dev_hdr(struct hci_dev_info *di);
 
 #endif
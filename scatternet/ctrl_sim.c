@@ -0,0 +1,238 @@
+/*
+A controller in software, so the advertiser can be exercised in legacy and
+extended mode without an adapter that supports either.
+*/
+#include <string.h>
+#include <time.h>
+
+#include "ctrl_sim.h"
+
+#define STATUS_UNKNOWN_COMMAND 0x01
+#define STATUS_DISALLOWED 0x0C
+#define STATUS_INVALID_PARAMS 0x12
+#define STATUS_UNKNOWN_ADV_ID 0x42
+
+static const char* cmd_name(uint16_t ocf) {
+	switch (ocf) {
+	case EXT_ADV_READ_FEATURES: return "read features";
+	case OCF_LE_SET_ADVERTISING_PARAMETERS: return "set params";
+	case OCF_LE_SET_ADVERTISING_DATA: return "set data";
+	case OCF_LE_SET_ADVERTISE_ENABLE: return "set enable";
+	case EXT_ADV_SET_PARAMS: return "ext set params";
+	case EXT_ADV_SET_DATA: return "ext set data";
+	case EXT_ADV_SET_ENABLE: return "ext set enable";
+	case EXT_ADV_READ_MAX_DATA: return "ext read max data";
+	case EXT_ADV_READ_NUM_SETS: return "ext read sets";
+	case EXT_ADV_REMOVE_SET: return "ext remove set";
+	case EXT_ADV_CLEAR_SETS: return "ext clear sets";
+	default: return "unknown";
+	}
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Sets enabled with a duration stop by themselves, as on a real controller **/
+static void expire_sets(struct ctrl_sim *sim) {
+	uint64_t now = now_ms();
+
+	for (int i = 0; i < sim->num_sets; i++) {
+		if (sim->sets[i].enabled && sim->sets[i].ends_ms && now >= sim->sets[i].ends_ms) {
+			sim->sets[i].enabled = 0;
+			sim->sets[i].ends_ms = 0;
+		}
+	}
+}
+
+/** Legacy and extended advertising commands may not be mixed **/
+static int check_mode(struct ctrl_sim *sim, enum ctrl_sim_mode mode) {
+	if (sim->mode == CTRL_SIM_UNUSED)
+		sim->mode = mode;
+	return sim->mode == mode ? 0 : STATUS_DISALLOWED;
+}
+
+static uint32_t get_interval(const uint8_t *p) {
+	return p[0] | p[1] << 8 | (uint32_t) p[2] << 16;
+}
+
+static int legacy_cmd(struct ctrl_sim *sim, uint16_t ocf, const uint8_t *cp, int clen) {
+	int status = check_mode(sim, CTRL_SIM_LEGACY);
+
+	if (status)
+		return status;
+	switch (ocf) {
+	case OCF_LE_SET_ADVERTISING_PARAMETERS:
+		if (clen != LE_SET_ADVERTISING_PARAMETERS_CP_SIZE)
+			return STATUS_INVALID_PARAMS;
+		return sim->legacy_enabled ? STATUS_DISALLOWED : 0;
+	case OCF_LE_SET_ADVERTISING_DATA:
+		if (clen != LE_SET_ADVERTISING_DATA_CP_SIZE || cp[0] > ADV_LEGACY_MAX_DATA)
+			return STATUS_INVALID_PARAMS;
+		sim->legacy_len = cp[0];
+		return 0;
+	case OCF_LE_SET_ADVERTISE_ENABLE:
+		if (clen != LE_SET_ADVERTISE_ENABLE_CP_SIZE)
+			return STATUS_INVALID_PARAMS;
+		sim->legacy_enabled = cp[0];
+		return 0;
+	}
+	return STATUS_UNKNOWN_COMMAND;
+}
+
+static int ext_set_params(struct ctrl_sim *sim, const ext_adv_params_cp *cp, int clen) {
+	uint16_t props;
+
+	if (clen != EXT_ADV_PARAMS_CP_SIZE || cp->handle >= sim->num_sets)
+		return STATUS_INVALID_PARAMS;
+	if (sim->sets[cp->handle].enabled)
+		return STATUS_DISALLOWED;
+	props = btohs(cp->properties);
+	if ((props & EXT_ADV_PROP_LEGACY) && sim->sets[cp->handle].len > ADV_LEGACY_MAX_DATA)
+		return STATUS_INVALID_PARAMS;								// The data it holds would not fit
+	if (!(props & EXT_ADV_PROP_LEGACY) && (props & EXT_ADV_PROP_CONNECTABLE) && (props & EXT_ADV_PROP_SCANNABLE))
+		return STATUS_INVALID_PARAMS;								// Extended PDUs are one or the other
+	sim->sets[cp->handle].have_params = 1;
+	sim->sets[cp->handle].properties = props;
+	sim->sets[cp->handle].interval = get_interval(cp->min_interval);
+	return 0;
+}
+
+static int ext_set_data(struct ctrl_sim *sim, const ext_adv_data_cp *cp, int clen) {
+	int max;
+
+	if (clen < 4 || clen != 4 + cp->length)
+		return STATUS_INVALID_PARAMS;
+	if (cp->handle >= sim->num_sets || !sim->sets[cp->handle].have_params)
+		return STATUS_UNKNOWN_ADV_ID;
+	max = (sim->sets[cp->handle].properties & EXT_ADV_PROP_LEGACY) ? ADV_LEGACY_MAX_DATA : sim->max_data;
+	if (cp->operation != EXT_ADV_OP_COMPLETE || cp->length > max)
+		return STATUS_INVALID_PARAMS;
+	sim->sets[cp->handle].len = cp->length;
+	return 0;
+}
+
+static int ext_set_enable(struct ctrl_sim *sim, const ext_adv_enable_cp *cp, int clen) {
+	int i;
+
+	if (clen < 2)
+		return STATUS_INVALID_PARAMS;
+	if (cp->num_sets == 0) {
+		if (cp->enable)
+			return STATUS_INVALID_PARAMS;
+		for (i = 0; i < sim->num_sets; i++)
+			sim->sets[i].enabled = 0;
+		return 0;
+	}
+	if (cp->num_sets != 1 || clen != sizeof(*cp))
+		return STATUS_INVALID_PARAMS;								// The advertiser only ever sends one
+	if (cp->handle >= sim->num_sets || !sim->sets[cp->handle].have_params)
+		return STATUS_UNKNOWN_ADV_ID;
+	sim->sets[cp->handle].enabled = cp->enable;
+	sim->sets[cp->handle].ends_ms = cp->enable && cp->duration ? now_ms() + btohs(cp->duration) * 10 : 0;
+	return 0;
+}
+
+static int ext_cmd(struct ctrl_sim *sim, uint16_t ocf, const void *cp, int clen, uint8_t *rparam, int rlen) {
+	int status, i;
+
+	if (!sim->extended)
+		return STATUS_UNKNOWN_COMMAND;
+	if ((status = check_mode(sim, CTRL_SIM_EXTENDED)) != 0)
+		return status;
+
+	switch (ocf) {
+	case EXT_ADV_SET_PARAMS:
+		if (rlen > 1)
+			rparam[1] = 0;											// Selected TX power, 0 dBm
+		return ext_set_params(sim, cp, clen);
+	case EXT_ADV_SET_DATA:
+		return ext_set_data(sim, cp, clen);
+	case EXT_ADV_SET_ENABLE:
+		return ext_set_enable(sim, cp, clen);
+	case EXT_ADV_READ_MAX_DATA:
+		if (rlen > 2) {
+			rparam[1] = sim->max_data & 0xff;
+			rparam[2] = sim->max_data >> 8;
+		}
+		return 0;
+	case EXT_ADV_READ_NUM_SETS:
+		if (rlen > 1)
+			rparam[1] = sim->num_sets;
+		return 0;
+	case EXT_ADV_REMOVE_SET:
+		if (clen != 1 || ((const uint8_t *) cp)[0] >= sim->num_sets)
+			return STATUS_UNKNOWN_ADV_ID;
+		i = ((const uint8_t *) cp)[0];
+		if (sim->sets[i].enabled)
+			return STATUS_DISALLOWED;
+		memset(&sim->sets[i], 0, sizeof(sim->sets[i]));
+		return 0;
+	case EXT_ADV_CLEAR_SETS:
+		for (i = 0; i < sim->num_sets; i++) {
+			if (sim->sets[i].enabled)
+				return STATUS_DISALLOWED;
+		}
+		memset(sim->sets, 0, sizeof(sim->sets));
+		return 0;
+	}
+	return STATUS_UNKNOWN_COMMAND;
+}
+
+/**
+ Sets up a controller with extended advertising support and num_sets
+ sets if extended is set, a legacy only controller otherwise.
+**/
+void ctrl_sim_init(struct ctrl_sim *sim, int extended, int num_sets, FILE *log) {
+	memset(sim, 0, sizeof(*sim));
+	sim->extended = extended;
+	sim->num_sets = num_sets < CTRL_SIM_MAX_SETS ? num_sets : CTRL_SIM_MAX_SETS;
+	sim->max_data = EXT_ADV_MAX_DATA;
+	sim->log = log;
+}
+
+/** adv_cmd_fn for a struct ctrl_sim in arg **/
+int ctrl_sim_cmd(void *arg, uint16_t ocf, void *cparam, int clen, void *rparam, int rlen) {
+	struct ctrl_sim *sim = arg;
+	uint8_t *r = rparam;
+	int status;
+
+	memset(r, 0, rlen);
+	sim->commands++;
+	expire_sets(sim);
+
+	switch (ocf) {
+	case EXT_ADV_READ_FEATURES:
+		if (sim->extended && rlen > 1 + EXT_ADV_FEATURE_BYTE)
+			r[1 + EXT_ADV_FEATURE_BYTE] = EXT_ADV_FEATURE_MASK;
+		status = 0;
+		break;
+	case OCF_LE_SET_ADVERTISING_PARAMETERS:
+	case OCF_LE_SET_ADVERTISING_DATA:
+	case OCF_LE_SET_ADVERTISE_ENABLE:
+		status = legacy_cmd(sim, ocf, cparam, clen);
+		break;
+	default:
+		status = ext_cmd(sim, ocf, cparam, clen, r, rlen);
+		break;
+	}
+
+	r[0] = status;
+	if (status)
+		sim->rejected++;
+	if (sim->log)
+		fprintf(sim->log, "ctrl: %-18s %3d bytes  status 0x%02x\n", cmd_name(ocf), clen, status);
+	return 0;
+}
+
+/** Number of sets advertising right now, the legacy instance counts as one **/
+int ctrl_sim_enabled_sets(const struct ctrl_sim *sim) {
+	int n = sim->legacy_enabled;
+
+	for (int i = 0; i < sim->num_sets; i++)
+		n += sim->sets[i].enabled;
+	return n;
+}
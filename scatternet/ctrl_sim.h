@@ -0,0 +1,51 @@
+#ifndef CTRL_SIM_H_
+#define CTRL_SIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "advertiser.h"
+
+#define CTRL_SIM_MAX_SETS 16
+
+enum ctrl_sim_mode {
+	CTRL_SIM_UNUSED,											// No advertising command yet
+	CTRL_SIM_LEGACY,
+	CTRL_SIM_EXTENDED
+};
+
+/**
+ Simulated controller for the advertiser, an adv_cmd_fn transport that
+ keeps the advertising state a real controller would and answers with the
+ status codes it would give: unknown command for extended commands when
+ extended is off, command disallowed for mixing legacy and extended
+ commands or changing parameters of an enabled set, invalid parameters for
+ payloads that do not fit, including legacy parameters for a set that
+ still holds more data than a legacy PDU carries. Every command and its status is written to log
+ if it is not NULL.
+**/
+struct ctrl_sim {
+	int extended;
+	int num_sets;
+	int max_data;
+	enum ctrl_sim_mode mode;
+	int legacy_enabled;
+	uint8_t legacy_len;
+	struct {
+		int have_params;
+		int enabled;
+		uint16_t properties;
+		uint32_t interval;
+		uint8_t len;
+		uint64_t ends_ms;											// A timed enable ends here, 0 if not timed
+	} sets[CTRL_SIM_MAX_SETS];
+	unsigned long commands;
+	unsigned long rejected;
+	FILE *log;
+};
+
+void ctrl_sim_init(struct ctrl_sim *sim, int extended, int num_sets, FILE *log);
+int ctrl_sim_cmd(void *arg, uint16_t ocf, void *cparam, int clen, void *rparam, int rlen);
+int ctrl_sim_enabled_sets(const struct ctrl_sim *sim);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+TTL duplicate-suppression cache for advertising reports. Scanning with the
+controller's duplicate filter off delivers every advertisement several times
+a second, this keeps only the reports that are new or carry new data.
+*/
+#include <string.h>
+
+#include "dup_cache.h"
+
+#define SLOT_MASK (DUP_CACHE_SLOTS - 1)
+
+void dup_cache_init(struct dup_cache *cache, unsigned int ttl_ms) {
+	memset(cache, 0, sizeof(*cache));
+	cache->ttl_ms = ttl_ms;
+}
+
+/** FNV-1a hash of the AD data **/
+uint32_t dup_payload_hash(const uint8_t *data, size_t len) {
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static size_t slot_of(uint64_t key, uint32_t payload_hash) {
+	uint64_t h = (key ^ ((uint64_t) payload_hash << 16)) * 0x9E3779B97F4A7C15ULL;
+
+	return (h >> 40) & SLOT_MASK;
+}
+
+/**
+ Returns 1 if the report from key with payload_hash should be forwarded
+ (first time seen, or its entry has expired), 0 if it is a duplicate.
+**/
+int dup_cache_check(struct dup_cache *cache, uint64_t key, uint32_t payload_hash, uint64_t now_ms) {
+	size_t start = slot_of(key, payload_hash);
+	struct dup_entry *e, *victim = NULL;
+
+	for (size_t i = 0; i < DUP_CACHE_PROBE; i++) {
+		e = &cache->slots[(start + i) & SLOT_MASK];
+		if (e->key == key && e->payload_hash == payload_hash && e->expires_ms > now_ms) {
+			cache->suppressed++;
+			return 0;
+		}
+		if (e->expires_ms <= now_ms) {								// Empty or expired, reusable
+			if (victim == NULL || victim->expires_ms > now_ms)
+				victim = e;
+		} else if (victim == NULL || (victim->expires_ms > now_ms && e->expires_ms < victim->expires_ms)) {
+			victim = e;
+		}
+	}
+
+	if (victim->expires_ms > now_ms)
+		cache->evictions++;
+	victim->key = key;
+	victim->payload_hash = payload_hash;
+	victim->expires_ms = now_ms + cache->ttl_ms;
+	cache->forwarded++;
+	return 1;
+}
@@ -0,0 +1,581 @@
+/*
+The scatternet formation state machine of lealogorithm.c, kept free of any
+I/O so the same code runs on a node and in a simulator. See formation.h.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+
+#include "formation.h"
+#include "nb_snapshot.h"
+#include "link_quality.h"
+#include "bdaddr_key.h"
+
+typedef struct {
+	StateType state;
+	void (*func)(struct formation *f, const struct formation_event *ev);
+} StateMachineType;
+
+static void adv_neighbour(struct formation *f, const struct formation_event *ev);
+static void delegate(struct formation *f, const struct formation_event *ev);
+static void delegated(struct formation *f, const struct formation_event *ev);
+static void ble_connect(struct formation *f, const struct formation_event *ev);
+static void done(struct formation *f, const struct formation_event *ev);
+
+static const StateMachineType state_machine[] = {
+	{ADV_NEIGHBOUR_ADDR, adv_neighbour},
+	{DELEGATE, delegate},
+	{DELEGATED, delegated},
+	{CONNECT, ble_connect},
+	{DONE, done}
+};
+
+static const char *state_names[] = { "ADV_NEIGHBOUR_ADDR", "DELEGATE", "DELEGATED", "CONNECT", "DONE" };
+
+void formation_config_default(struct formation_config *config) {
+	config->capacity = FORMATION_CAPACITY;
+	config->settle_ms = FORMATION_SETTLE_MS;
+	config->max_wait_ms = FORMATION_MAX_WAIT_MS;
+	config->repeat_ms = FORMATION_REPEAT_MS;
+	config->connect_tries = FORMATION_CONNECT_TRIES;
+	config->confirm_ms = FORMATION_CONFIRM_MS;
+}
+
+void formation_init(struct formation *f, uint64_t self, const struct formation_config *config,
+                    const struct formation_ops *ops, void *ctx) {
+	memset(f, 0, sizeof(*f));
+	f->self = self;
+	f->state = ADV_NEIGHBOUR_ADDR;
+	f->config = *config;
+	f->ops = ops;
+	f->ctx = ctx;
+	f->capacity = config->capacity;
+	nb_data_init(&f->graph);
+	f->graph.quiet = 1;
+	nb_data_init(&f->done);
+	f->done.quiet = 1;
+	nb_bitset_init(&f->bits);
+	f->bits_stale = 1;
+}
+
+void formation_free(struct formation *f) {
+	nb_data_free(&f->graph);
+	nb_data_free(&f->done);
+	nb_bitset_free(&f->bits);
+}
+
+const char* formation_state_name(StateType state) {
+	return state < NUM_STATES ? state_names[state] : "INVALID";
+}
+
+/** This node and the peers it connected to **/
+int formation_piconet_size(const struct formation *f) {
+	int size = 1;
+
+	for (int i = 0; i < f->nmb_of_links; i++)
+		size += f->link_master[i];
+	return size;
+}
+
+static int linked(const struct formation *f, uint64_t key) {
+	for (int i = 0; i < f->nmb_of_links; i++) {
+		if (f->links[i] == key)
+			return 1;
+	}
+	return 0;
+}
+
+static void add_link(struct formation *f, uint64_t key, int master) {
+	if (linked(f, key) || f->nmb_of_links == FORMATION_MAX_LINKS)
+		return;
+	f->links[f->nmb_of_links] = key;
+	f->link_master[f->nmb_of_links] = master;
+	f->nmb_of_links++;
+}
+
+static int is_done(const struct formation *f, uint64_t key) {
+	return nb_find(&f->done, key) != NULL;
+}
+
+/**
+ Inserts key into prey, which is kept ordered strongest link first by
+ lq_score(). When prey is full the weakest entry makes room for a
+ stronger one.
+**/
+static void add_prey(struct formation *f, uint64_t key, float score) {
+	int i;
+
+	if (f->nmb_of_prey == FORMATION_MAX_LINKS) {
+		if (score <= f->prey_score[f->nmb_of_prey - 1])
+			return;
+		f->nmb_of_prey--;
+	}
+	for (i = f->nmb_of_prey; i > 0 && f->prey_score[i - 1] < score; i--) {
+		f->prey[i] = f->prey[i - 1];
+		f->prey_score[i] = f->prey_score[i - 1];
+	}
+	f->prey[i] = key;
+	f->prey_score[i] = score;
+	f->nmb_of_prey++;
+}
+
+static void remove_prey(struct formation *f, uint64_t key) {
+	for (int i = 0; i < f->nmb_of_prey; i++) {
+		if (f->prey[i] == key) {
+			memmove(&f->prey[i], &f->prey[i + 1], (f->nmb_of_prey - i - 1) * sizeof(*f->prey));
+			memmove(&f->prey_score[i], &f->prey_score[i + 1], (f->nmb_of_prey - i - 1) * sizeof(*f->prey_score));
+			f->nmb_of_prey--;
+			return;
+		}
+	}
+}
+
+static void send_frame(struct formation *f, uint8_t type, const uint64_t *addrs, int count) {
+	f->ops->advertise(f->ctx, type, addrs, count);
+	f->frames_sent++;
+}
+
+/** Sends FORM_EV_START to state, which is how a state learns it was entered **/
+static void enter(struct formation *f, StateType state) {
+	struct formation_event start = { .type = FORM_EV_START };
+	StateType from = f->state;
+
+	f->state = state;
+	if (f->ops->state_changed != NULL)
+		f->ops->state_changed(f->ctx, from, state);
+	state_machine[state].func(f, &start);
+}
+
+static void start_connect(struct formation *f, uint64_t peer) {
+	f->connecting = peer;
+	f->connects++;
+	f->ops->connect(f->ctx, peer);
+}
+
+/**
+ Starts the connection to the next prey, strongest link first, while there
+ is more capacity left than keep. Goes to next once nothing is left to
+ connect.
+**/
+static void connect_next(struct formation *f, StateType next, int keep) {
+	uint64_t peer;
+
+	while (f->nmb_of_prey > 0 && f->capacity > keep) {
+		peer = f->prey[0];
+		remove_prey(f, peer);
+		if (linked(f, peer))										// It connected to us meanwhile
+			continue;
+		f->capacity--;
+		f->tries = 0;
+		start_connect(f, peer);
+		return;
+	}
+	enter(f, next);
+}
+
+/** Retries a failed connection. Returns 1 if retrying, 0 once it gave up and freed the slot. **/
+static int retry_connect(struct formation *f, uint64_t peer) {
+	f->connect_failures++;
+	if (++f->tries < f->config.connect_tries) {
+		start_connect(f, peer);
+		return 1;
+	}
+	f->capacity++;
+	return 0;
+}
+
+/**
+ Whether a neighbour with a greater address has yet to finish. Neighbours
+ only known from the snapshot don't count, they may be gone for good.
+**/
+static int higher_active_neighbour(const struct formation *f) {
+	nb_data_foreach(&f->graph, entry) {
+		if (entry->nb_bdaddr > f->self && !entry->provisional && !is_done(f, entry->nb_bdaddr))
+			return 1;
+	}
+	return 0;
+}
+
+static int has_key(const uint64_t *keys, int n, uint64_t key) {
+	for (int i = 0; i < n; i++) {
+		if (keys[i] == key)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ Collects into reach the nodes we know to be connected to us: the peers
+ we linked with, and through the links done neighbours listed in their
+ DONE frames whatever those reach in turn. Returns how many there are.
+**/
+static int collect_reach(const struct formation *f, uint64_t *reach) {
+	int n = 0, grew = 1, joined;
+	uint64_t key;
+	uint32_t pos;
+
+	reach[n++] = f->self;
+	for (int i = 0; i < f->nmb_of_links; i++)
+		reach[n++] = f->links[i];
+	while (grew) {
+		grew = 0;
+		nb_data_foreach(&f->done, entry) {
+			joined = has_key(reach, n, entry->nb_bdaddr);
+			for (int i = 0; i < n && !joined; i++)
+				joined = nb_has_nb_nb(entry, reach[i]);
+			if (!joined)
+				continue;
+			pos = 0;
+			for (key = entry->nb_bdaddr; key != BDADDR_KEY_NONE && n < FORMATION_MAX_REACH; key = nb_nb_next(entry, &pos)) {
+				if (!has_key(reach, n, key)) {
+					reach[n++] = key;
+					grew = 1;
+				}
+			}
+		}
+	}
+	return n;
+}
+
+/**
+ Prey are the lower neighbours still to link, and ahead of them the
+ neighbours above we do not know to be connected to us. Those are all
+ done by now and may have run out of capacity before reaching us, so we
+ connect up ourselves or our piconet would be cut off from theirs.
+**/
+static void collect_prey(struct formation *f) {
+	uint64_t reach[FORMATION_MAX_REACH];
+	int n = collect_reach(f, reach);
+
+	f->nmb_of_prey = 0;
+	nb_data_foreach(&f->graph, entry) {
+		if (entry->provisional)
+			continue;
+		if (entry->nb_bdaddr < f->self && !is_done(f, entry->nb_bdaddr) && !linked(f, entry->nb_bdaddr))
+			add_prey(f, entry->nb_bdaddr, lq_score(entry->rssi_mean, entry->rssi_var));
+		else if (entry->nb_bdaddr > f->self && !has_key(reach, n, entry->nb_bdaddr))
+			add_prey(f, entry->nb_bdaddr, FLT_MAX);
+	}
+}
+
+/**
+ Whether to delegate rather than connect: only if the prey are more than
+ the capacity left and there is capacity beyond the prey above us, which
+ come first. Prey below us we do not reach connect up to us themselves.
+**/
+static int must_delegate(const struct formation *f) {
+	int up = 0;
+
+	for (int i = 0; i < f->nmb_of_prey; i++)
+		up += f->prey[i] > f->self;
+	return f->nmb_of_prey > f->capacity && f->capacity > up;
+}
+
+static int is_prey(const struct formation *f, uint64_t key) {
+	for (int i = 0; i < f->nmb_of_prey; i++) {
+		if (f->prey[i] == key)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ Capacity the prey leave over goes to the strongest neighbours above us
+ that did not connect to us: it costs nothing and shortens the paths
+ between piconets that only met further away.
+**/
+static void add_spare_links(struct formation *f) {
+	uint64_t best;
+	float best_score, score;
+
+	while (f->nmb_of_prey < f->capacity && f->nmb_of_prey < FORMATION_MAX_LINKS) {
+		best = BDADDR_KEY_NONE;
+		best_score = -FLT_MAX;
+		nb_data_foreach(&f->graph, entry) {
+			if (entry->nb_bdaddr <= f->self || entry->provisional || linked(f, entry->nb_bdaddr) ||
+			    is_prey(f, entry->nb_bdaddr))
+				continue;
+			score = lq_score(entry->rssi_mean, entry->rssi_var);
+			if (best == BDADDR_KEY_NONE || score > best_score) {
+				best = entry->nb_bdaddr;
+				best_score = score;
+			}
+		}
+		if (best == BDADDR_KEY_NONE)
+			return;
+		add_prey(f, best, best_score);
+	}
+}
+
+static void advertise_neighbours(struct formation *f) {
+	uint64_t addrs[FORMATION_MAX_LINKS];
+	int count = 0;
+
+	nb_data_foreach(&f->graph, entry) {
+		if (count == FORMATION_MAX_LINKS)
+			break;
+		addrs[count++] = entry->nb_bdaddr;
+	}
+	f->ops->advertise(f->ctx, MESH_ADV_NEIGHBOURS, addrs, count);
+}
+
+/** Tells the delegator we took its prey over, again whenever it repeats the delegation **/
+static void confirm_delegation(struct formation *f) {
+	send_frame(f, MESH_ADV_CONNECT, &f->delegator, 1);
+}
+
+//If the graph settled and no neighbour with a higher address is still busy,
+//the prey decide between CONNECT and DELEGATE
+static void adv_neighbour(struct formation *f, const struct formation_event *ev) {
+	const struct mesh_adv *msg = ev->msg;
+
+	if (ev->type == FORM_EV_FRAME && msg->type == MESH_ADV_DELEGATE && msg->addrs[0] == f->self &&
+	    ev->peer != f->delegator) {
+		f->delegator = ev->peer;
+		f->nmb_handed = 0;
+		for (int i = 1; i < msg->count && f->nmb_handed < MESH_ADV_MAX_ADDRS; i++)
+			f->handed[f->nmb_handed++] = msg->addrs[i];
+		confirm_delegation(f);
+		enter(f, DELEGATED);
+		return;
+	}
+
+	if (f->now_ms - f->graph_changed_ms < f->config.settle_ms &&
+	    f->now_ms - f->started_ms < f->config.max_wait_ms)
+		return;														// Still discovering
+	if (higher_active_neighbour(f))
+		return;														// Prey, wait for the nodes above
+	collect_prey(f);
+	add_spare_links(f);
+	if (f->nmb_of_prey == 0 || f->capacity <= 0)					// A node delegated to may have used it all up
+		enter(f, DONE);
+	else if (must_delegate(f))
+		enter(f, DELEGATE);
+	else
+		enter(f, CONNECT);
+}
+
+//Hand neighbour_max and the neighbours we share with it over to neighbour_max
+//and connect to it. Once it answered, or never will, look at the prey left.
+static void delegate(struct formation *f, const struct formation_event *ev) {
+	uint64_t frame[MESH_ADV_MAX_ADDRS], common[FORMATION_MAX_LINKS];
+	int n;
+
+	switch (ev->type) {
+	case FORM_EV_START:
+		if (f->capacity <= 0) {										// No connection left for the delegate
+			enter(f, DONE);
+			return;
+		}
+		f->delegate_to = BDADDR_KEY_NONE;
+		for (int i = 0; i < f->nmb_of_prey; i++) {
+			if (f->prey[i] > f->delegate_to && f->prey[i] < f->self)	// Not the one we join, it is done
+				f->delegate_to = f->prey[i];
+		}
+		if (f->bits_stale && nb_bitset_build(&f->bits, &f->graph, f->self) == 0)
+			f->bits_stale = 0;
+		n = f->bits_stale ? 0 : common_neighbours(&f->bits, f->self, f->delegate_to, common, FORMATION_MAX_LINKS);
+		if (n > FORMATION_MAX_LINKS)
+			n = FORMATION_MAX_LINKS;
+		f->nmb_handed = 0;
+		for (int i = 0; i < n && f->nmb_handed < MESH_ADV_MAX_ADDRS - 1; i++) {
+			for (int j = 0; j < f->nmb_of_prey; j++) {
+				if (f->prey[j] == common[i] && common[i] != f->delegate_to && common[i] < f->self) {
+					f->handed[f->nmb_handed++] = common[i];
+					break;
+				}
+			}
+		}
+		remove_prey(f, f->delegate_to);
+		for (int i = 0; i < f->nmb_handed; i++)
+			remove_prey(f, f->handed[i]);
+		f->delegations++;
+		f->capacity--;
+		f->tries = 0;
+		f->delegate_confirmed = 0;
+		f->delegate_until_ms = f->now_ms + f->config.confirm_ms;
+		f->next_repeat_ms = f->now_ms;
+		start_connect(f, f->delegate_to);
+		break;
+	case FORM_EV_FRAME:
+		if (ev->peer == f->delegate_to && (ev->msg->type == MESH_ADV_DONE ||
+		    (ev->msg->type == MESH_ADV_CONNECT && ev->msg->count > 0 && ev->msg->addrs[0] == f->self)))
+			f->delegate_confirmed = 1;
+		break;
+	case FORM_EV_CONNECT_FAILED:
+		if (ev->peer == f->delegate_to && retry_connect(f, ev->peer))
+			return;
+		break;														// retry_connect() gave the slot back, the delegation stays made
+	default:
+		break;
+	}
+
+	// The link coming up says nothing of whether the delegate heard us, on a
+	// legacy controller the next neighbour frame may have replaced ours
+	if (f->connecting == BDADDR_KEY_NONE && (f->delegate_confirmed || f->now_ms >= f->delegate_until_ms)) {
+		f->delegate_to = BDADDR_KEY_NONE;
+		if (f->capacity > 0 && must_delegate(f))
+			enter(f, DELEGATE);
+		else
+			enter(f, CONNECT);
+		return;
+	}
+	if (!f->delegate_confirmed && f->now_ms >= f->next_repeat_ms) {
+		frame[0] = f->delegate_to;
+		memcpy(&frame[1], f->handed, f->nmb_handed * sizeof(*frame));
+		send_frame(f, MESH_ADV_DELEGATE, frame, f->nmb_handed + 1);
+		f->next_repeat_ms = f->now_ms + f->config.repeat_ms;
+	}
+}
+
+//Connect to the prey we were handed but one, which our own turn may need
+//for the neighbours above. Unlike CONNECT this goes back to discovering,
+//the node may still be prey or predator of others.
+static void delegated(struct formation *f, const struct formation_event *ev) {
+	switch (ev->type) {
+	case FORM_EV_START:
+		f->nmb_of_prey = 0;
+		for (int i = 0; i < f->nmb_handed; i++) {
+			struct nb_entry *entry = nb_find(&f->graph, f->handed[i]);
+			if (f->handed[i] != f->self && !linked(f, f->handed[i]))
+				add_prey(f, f->handed[i], entry ? lq_score(entry->rssi_mean, entry->rssi_var) : LQ_RSSI_FLOOR);
+		}
+		connect_next(f, ADV_NEIGHBOUR_ADDR, 1);
+		break;
+	case FORM_EV_CONNECT_FAILED:
+		if (!retry_connect(f, ev->peer))
+			connect_next(f, ADV_NEIGHBOUR_ADDR, 1);
+		break;
+	case FORM_EV_CONNECTED:
+		connect_next(f, ADV_NEIGHBOUR_ADDR, 1);
+		break;
+	default:
+		break;
+	}
+}
+
+//Connect to every prey, then done
+static void ble_connect(struct formation *f, const struct formation_event *ev) {
+	switch (ev->type) {
+	case FORM_EV_START:
+	case FORM_EV_CONNECTED:
+		connect_next(f, DONE, 0);
+		break;
+	case FORM_EV_CONNECT_FAILED:
+		if (!retry_connect(f, ev->peer))
+			connect_next(f, DONE, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+//Tell the neighbours, again and again for the ones that missed it
+static void done(struct formation *f, const struct formation_event *ev) {
+	if (ev->type == FORM_EV_START) {
+		f->done_ms = f->now_ms;
+		f->next_repeat_ms = f->now_ms;
+	} else if (ev->type == FORM_EV_ACCEPTED) {
+		f->next_repeat_ms = f->now_ms;								// Our links changed
+	}
+	if (f->now_ms >= f->next_repeat_ms) {
+		send_frame(f, MESH_ADV_DONE, f->links, f->nmb_of_links < MESH_ADV_MAX_ADDRS ? f->nmb_of_links : MESH_ADV_MAX_ADDRS);
+		f->next_repeat_ms = f->now_ms + f->config.repeat_ms;
+	}
+}
+
+/** Takes in a new graph, returns 1 if it differs from the last one **/
+static int update_graph(struct formation *f, const struct nb_data *graph) {
+	uint64_t digest = nb_snapshot_digest(graph);
+
+	if (digest == f->graph_digest && graph->count == f->graph.count)
+		return 0;
+	if (nb_data_copy(&f->graph, graph) < 0)
+		return 0;													// Keep the last one, the next graph may fit
+	f->graph_digest = digest;
+	f->graph_changed_ms = f->now_ms;
+	f->bits_stale = 1;
+	return 1;
+}
+
+static void arm_timer(struct formation *f) {
+	uint64_t at = 0;
+
+	switch (f->state) {
+	case ADV_NEIGHBOUR_ADDR:
+		at = f->graph_changed_ms + f->config.settle_ms;
+		if (f->started_ms + f->config.max_wait_ms < at)
+			at = f->started_ms + f->config.max_wait_ms;
+		if (at <= f->now_ms)
+			at = 0;													// Settled, the next change comes as an event
+		break;
+	case DELEGATE:
+		if (!f->delegate_confirmed)
+			at = f->next_repeat_ms < f->delegate_until_ms ? f->next_repeat_ms : f->delegate_until_ms;
+		break;
+	case DONE:
+		at = f->next_repeat_ms;
+		break;
+	default:
+		break;
+	}
+	if (at != f->timer_ms) {
+		f->timer_ms = at;
+		f->ops->set_timer(f->ctx, at);
+	}
+}
+
+/**
+ Handles one event at now_ms. Whatever every state needs to know (the
+ graph, who is done, who connected) is taken in first, then the current
+ state decides.
+**/
+void formation_handle(struct formation *f, uint64_t now_ms, const struct formation_event *ev) {
+	f->now_ms = now_ms;
+	switch (ev->type) {
+	case FORM_EV_START:
+		f->started_ms = f->graph_changed_ms = now_ms;
+		advertise_neighbours(f);
+		break;
+	case FORM_EV_GRAPH:
+		if (!update_graph(f, ev->graph))
+			break;
+		advertise_neighbours(f);
+		break;
+	case FORM_EV_FRAME:
+		if (ev->msg->type == MESH_ADV_DONE) {
+			if (add_nb(&f->done, ev->peer) == NULL)
+				return;
+			for (int i = 0; i < ev->msg->count; i++)
+				add_nb_nb(&f->done, ev->peer, ev->msg->addrs[i]);
+		}
+		if (ev->msg->type == MESH_ADV_DELEGATE && ev->msg->count > 0 && ev->msg->addrs[0] == f->self &&
+		    ev->peer == f->delegator)
+			confirm_delegation(f);									// It did not hear our answer
+		break;
+	case FORM_EV_TIMER:
+		if (f->timer_ms != 0 && now_ms >= f->timer_ms)
+			f->timer_ms = 0;
+		break;
+	case FORM_EV_CONNECTED:
+		if (ev->peer != f->connecting)
+			return;
+		f->connecting = BDADDR_KEY_NONE;
+		add_link(f, ev->peer, 1);
+		break;
+	case FORM_EV_CONNECT_FAILED:
+		if (ev->peer != f->connecting)
+			return;
+		f->connecting = BDADDR_KEY_NONE;
+		break;
+	case FORM_EV_ACCEPTED:
+		add_link(f, ev->peer, 0);
+		remove_prey(f, ev->peer);
+		break;
+	}
+	if (f->state < NUM_STATES)
+		state_machine[f->state].func(f, ev);
+	else
+		fprintf(stderr, "Invalid state %d\n", f->state);
+	arm_timer(f);
+}
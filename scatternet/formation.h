@@ -0,0 +1,150 @@
+#ifndef FORMATION_H_
+#define FORMATION_H_
+
+#include <stdint.h>
+
+#include "nb_data.h"
+#include "nb_bitset.h"
+#include "mesh_adv.h"
+
+#define FORMATION_MAX_LINKS 32										// Prey, links and advertised neighbours per node
+#define FORMATION_MAX_REACH 512									// Nodes a node can know to be connected to it
+#define FORMATION_CAPACITY 2										// Connections a node makes itself
+#define FORMATION_SETTLE_MS 1500									// Graph unchanged this long counts as discovered
+#define FORMATION_MAX_WAIT_MS 20000									// Decide by then even if the graph keeps changing
+#define FORMATION_REPEAT_MS 500										// Delegation and done frames go out again this often
+#define FORMATION_CONNECT_TRIES 3
+#define FORMATION_CONFIRM_MS 5000									// Stop repeating a delegation nobody answers
+
+typedef enum {
+	ADV_NEIGHBOUR_ADDR,
+	DELEGATE,
+	DELEGATED,
+	CONNECT,
+	DONE,
+	NUM_STATES
+} StateType;
+
+enum formation_event_type {
+	FORM_EV_START,													// Begin, also sent to every state entered
+	FORM_EV_GRAPH,													// graph is the neighbour graph as heard now
+	FORM_EV_FRAME,													// peer sent msg, a delegation, its answer or a done frame
+	FORM_EV_TIMER,													// The time asked for with set_timer() came
+	FORM_EV_CONNECTED,												// Our connection to peer is up
+	FORM_EV_CONNECT_FAILED,
+	FORM_EV_ACCEPTED												// peer connected to us
+};
+
+struct formation_event {
+	enum formation_event_type type;
+	uint64_t peer;
+	const struct nb_data *graph;									// FORM_EV_GRAPH, only valid during the call
+	const struct mesh_adv *msg;										// FORM_EV_FRAME
+};
+
+/**
+ What the engine asks of the node it runs on. None of them may block or
+ call back into formation_handle(), results come back as later events.
+ advertise() with MESH_ADV_NEIGHBOURS replaces the neighbour set the node
+ keeps advertising, any other type is a single frame. connect() starts a
+ connection that ends in FORM_EV_CONNECTED or FORM_EV_CONNECT_FAILED.
+ set_timer() asks for one FORM_EV_TIMER at at_ms, replacing the last
+ request, 0 cancels it. A timer event that comes early or late does no
+ harm.
+**/
+struct formation_ops {
+	void (*advertise)(void *ctx, uint8_t type, const uint64_t *addrs, int count);
+	void (*connect)(void *ctx, uint64_t peer);
+	void (*set_timer)(void *ctx, uint64_t at_ms);
+	void (*state_changed)(void *ctx, StateType from, StateType to);	// NULL for none
+};
+
+struct formation_config {
+	int capacity;
+	unsigned int settle_ms;
+	unsigned int max_wait_ms;
+	unsigned int repeat_ms;
+	int connect_tries;
+	unsigned int confirm_ms;
+};
+
+/**
+ Scatternet formation as an event driven state machine. The node feeds it
+ scan, timer and connection events through formation_handle() from one
+ loop, and the engine answers through the ops, so nothing in it ever
+ waits: how long formation takes depends on what is heard and when.
+
+ A node discovers until its graph settles. If it has a neighbour with a
+ higher address that is not done yet it is prey and keeps waiting.
+ Otherwise its lower neighbours that are not done are its prey, and ahead
+ of them the neighbours above it does not know to be connected to it,
+ going by its own links and the links listed in DONE frames. With no more
+ prey than capacity it connects to them all (CONNECT), else it hands the
+ greatest lower prey and the neighbours the two share over to that prey
+ (DELEGATE), connects to it and looks again once the prey answered with
+ a CONNECT frame. Capacity for the prey above is never delegated away,
+ and lower prey left over connect up themselves when their turn comes. A
+ node delegated to connects to what it was handed (DELEGATED), keeping a
+ connection back for its own turn, and carries on discovering. Capacity
+ no prey needs goes to the strongest neighbours above. A node done says
+ so with DONE frames, which releases the prey waiting on it. Neighbours
+ only known from a snapshot are never waited on or connected to.
+
+ Connectivity is not guaranteed. A node only knows what its neighbours
+ told it, so two neighbours above it may be connected further away while
+ it connects up to both, and if it has more of them than capacity or a
+ connection to one keeps failing the scatternet splits. formation_sim
+ shows this on about 1 in 200 random topologies at capacity 2 without
+ loss, and more often at capacity 1 or when many frames and connections
+ are lost.
+**/
+struct formation {
+	uint64_t self;
+	StateType state;
+	struct formation_config config;
+	const struct formation_ops *ops;
+	void *ctx;
+	uint64_t now_ms;												// Of the event being handled
+
+	struct nb_data graph;											// Last graph heard
+	uint64_t graph_digest;
+	uint64_t graph_changed_ms;
+	uint64_t started_ms;
+	struct nb_bitset bits;											// Of graph, rebuilt when needed
+	int bits_stale;
+	struct nb_data done;											// Neighbours heard to be done, with the links they listed
+
+	uint64_t prey[FORMATION_MAX_LINKS];								// Still to connect, strongest link first
+	float prey_score[FORMATION_MAX_LINKS];
+	int nmb_of_prey;
+	uint64_t links[FORMATION_MAX_LINKS];							// Connections made or accepted
+	uint8_t link_master[FORMATION_MAX_LINKS];						// We made it, the peer is in our piconet
+	int nmb_of_links;
+	int capacity;													// Connections left to make
+	uint64_t connecting;											// BDADDR_KEY_NONE when not connecting
+	int tries;
+	uint64_t delegate_to;											// DELEGATE: the prey taking over
+	int delegate_confirmed;											// It answered
+	uint64_t delegate_until_ms;										// Give up waiting for the answer then
+	uint64_t handed[MESH_ADV_MAX_ADDRS];							// and what it was handed
+	int nmb_handed;
+	uint64_t delegator;												// Last node that delegated to us
+	uint64_t next_repeat_ms;
+	uint64_t timer_ms;												// Last wakeup asked for, 0 for none
+	uint64_t done_ms;
+
+	unsigned long frames_sent;
+	unsigned long connects;
+	unsigned long connect_failures;
+	unsigned long delegations;
+};
+
+void formation_config_default(struct formation_config *config);
+void formation_init(struct formation *f, uint64_t self, const struct formation_config *config,
+                    const struct formation_ops *ops, void *ctx);
+void formation_free(struct formation *f);
+void formation_handle(struct formation *f, uint64_t now_ms, const struct formation_event *ev);
+int formation_piconet_size(const struct formation *f);
+const char* formation_state_name(StateType state);
+
+#endif
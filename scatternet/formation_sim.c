@@ -0,0 +1,141 @@
+/*
+Runs the formation engine of formation.c on simulated topologies, see
+net_sim.h, and reports how the scatternet came out: convergence time,
+messages sent, piconet sizes and diameter. Exits with 2 if the scatternet
+has more components than the radio graph, which formation.h allows for.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "net_sim.h"
+
+static double wall_s(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s [-n nodes] [-g geometric|grid] [-d degree] [-l loss] [-L ms] [-j ms] [-c capacity] [-t seconds] [-s seed] [-w threads]\n"
+		"\t-n nodes    number of nodes, default 100\n"
+		"\t-g topology random geometric or square grid, default geometric\n"
+		"\t-d degree   mean radio degree of a geometric topology, default 8\n"
+		"\t-l loss     chance a frame or connection attempt is lost, default 0\n"
+		"\t-L ms       radio latency, at least 1, default 5\n"
+		"\t-j ms       extra random latency up to ms, default 5\n"
+		"\t-c capacity connections a node makes itself, default %d\n"
+		"\t-t seconds  simulated time limit, default 600\n"
+		"\t-s seed     random seed, default 1\n"
+		"\t-w threads  worker threads, the result is the same for any number, default 1\n", prog, FORMATION_CAPACITY);
+}
+
+static void report(const struct sim *sim, double wall) {
+	const struct sim_stats *st = &sim->stats;
+	const struct sim_config *c = &sim->config;
+	double sim_s = (st->converged_ms ? st->converged_ms : sim->now_ms) / 1000.0;
+	uint32_t in_piconets = 0;
+
+	printf("Topology: %s, %d nodes, %lu radio links, mean degree %.1f, seed %llu\n",
+		c->topology == SIM_GRID ? "grid" : "geometric", c->nodes, st->radio_links,
+		2.0 * st->radio_links / c->nodes, (unsigned long long) c->seed);
+	printf("Radio: %.0f%% loss, %u + %u ms latency, capacity %d\n",
+		c->loss * 100, c->latency_ms, c->jitter_ms, c->formation.capacity);
+	if (st->converged_ms)
+		printf("Converged in %.3f s simulated, %.3f s wall on %d threads, %.0fx real time\n",
+			sim_s, wall, sim->nmb_of_parts, wall > 0 ? sim_s / wall : 0);
+	else
+		printf("Not converged after %.3f s simulated (%.3f s wall on %d threads): %u of %d nodes done\n",
+			sim_s, wall, sim->nmb_of_parts, st->done, c->nodes);
+	printf("Events: %lu, %lu frames delivered, %lu lost\n", st->events, st->deliveries, st->lost);
+	printf("Messages: %lu beacons, %lu delegations, %lu confirmations, %lu done frames, %lu connection attempts (%lu failed)\n",
+		st->beacons, st->delegations, st->confirmations, st->done_frames, st->connects, st->connect_failures);
+
+	for (int s = 2; s <= SIM_MAX_PICONET; s++)
+		in_piconets += st->piconet_sizes[s] * s;
+	printf("Piconets: %u, mean size %.2f, largest %u, sizes", st->piconets,
+		st->piconets ? (double) in_piconets / st->piconets : 0, st->largest_piconet);
+	for (int s = 2; s <= SIM_MAX_PICONET; s++) {
+		if (st->piconet_sizes[s])
+			printf(" %d%s:%u", s, s == SIM_MAX_PICONET ? "+" : "", st->piconet_sizes[s]);
+	}
+	printf("\n");
+	printf("Scatternet: %u components (radio graph %u), largest %u nodes, diameter %u hops\n",
+		st->components, st->radio_components, st->largest_component, st->diameter);
+}
+
+int main(int argc, char *argv[]) {
+	struct sim_config config;
+	struct sim sim;
+	double start, wall;
+	int opt, status = 0;
+
+	sim_config_default(&config);
+	while ((opt = getopt(argc, argv, "n:g:d:l:L:j:c:t:s:w:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			config.nodes = atoi(optarg);
+			break;
+		case 'g':
+			if (strcmp(optarg, "grid") == 0)
+				config.topology = SIM_GRID;
+			else if (strcmp(optarg, "geometric") == 0)
+				config.topology = SIM_GEOMETRIC;
+			else {
+				fprintf(stderr, "Unknown topology %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			config.degree = atof(optarg);
+			break;
+		case 'l':
+			config.loss = atof(optarg);
+			break;
+		case 'L':
+			config.latency_ms = atoi(optarg);
+			break;
+		case 'j':
+			config.jitter_ms = atoi(optarg);
+			break;
+		case 'c':
+			config.formation.capacity = atoi(optarg);
+			break;
+		case 't':
+			config.limit_ms = atoi(optarg) * 1000U;
+			break;
+		case 's':
+			config.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			config.threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (config.nodes < 1 || config.degree <= 0 || config.loss < 0 || config.loss >= 1 ||
+	    config.latency_ms < 1 || config.formation.capacity < 1 || config.threads < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	start = wall_s();
+	if (sim_init(&sim, &config) < 0)
+		return 1;
+	sim_run(&sim);
+	wall = wall_s() - start;
+	sim_measure(&sim);
+	report(&sim, wall);
+	if (sim.stats.components > sim.stats.radio_components) {
+		fprintf(stderr, "Scatternet split into %u components where the radio graph has %u\n",
+			sim.stats.components, sim.stats.radio_components);
+		status = 2;
+	}
+	sim_free(&sim);
+	return status;
+}
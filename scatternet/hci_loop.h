@@ -0,0 +1,39 @@
+#ifndef HCI_LOOP_H_
+#define HCI_LOOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "hci_source.h"
+
+#define HCI_LOOP_MAX_SUBEVENT 0x20
+
+typedef void (*hci_subevent_fn)(const evt_le_meta_event *meta, size_t len, void *arg);
+
+/**
+ Event loop around an HCI event source (see hci_source.h). It waits with
+ epoll on the source and a CLOCK_MONOTONIC timerfd, drains every queued
+ event on each wakeup and dispatches LE meta events by subevent code.
+**/
+struct hci_loop {
+	int epfd;
+	int timerfd;
+	struct hci_source *src;
+	hci_subevent_fn handlers[HCI_LOOP_MAX_SUBEVENT];
+	void *args[HCI_LOOP_MAX_SUBEVENT];
+	unsigned long events;										// LE meta events read
+	unsigned long unhandled;									// Events with no handler set
+};
+
+uint64_t monotonic_ms(void);
+
+int hci_loop_init(struct hci_loop *loop, struct hci_source *src);
+void hci_loop_set_handler(struct hci_loop *loop, uint8_t subevent, hci_subevent_fn fn, void *arg);
+int hci_loop_run_until(struct hci_loop *loop, uint64_t deadline);
+int hci_loop_run(struct hci_loop *loop, unsigned int window_ms);
+void hci_loop_close(struct hci_loop *loop);
+
+#endif
@@ -0,0 +1,285 @@
+/*
+Pluggable source of HCI events: the live adapter, the live adapter with every
+event recorded to a btsnoop file, or a btsnoop file replayed through the same
+parsing path. Traces use the btsnoop format with the H4 datalink, so they can
+also be opened with Wireshark or btmon.
+*/
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "hci_source.h"
+
+#define BTSNOOP_VERSION 1
+#define BTSNOOP_DATALINK_H4 1002
+#define BTSNOOP_FLAG_RECEIVED 0x01
+#define BTSNOOP_FLAG_EVENT 0x02
+#define BTSNOOP_EPOCH_DELTA 0x00dcddb30f2f8000ULL					// Microseconds from year 0 to 1970
+#define MAX_PACKET_SIZE 1024
+
+struct btsnoop_hdr {
+	char id[8];
+	uint32_t version;
+	uint32_t datalink;
+} __attribute__((packed));
+
+struct btsnoop_pkt {
+	uint32_t orig_len;
+	uint32_t incl_len;
+	uint32_t flags;
+	uint32_t drops;
+	uint64_t ts;
+} __attribute__((packed));
+
+static uint64_t realtime_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t monotonic_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/** Creates path and writes the btsnoop file header. Returns the fd or -1. **/
+int btsnoop_create(const char *path) {
+	struct btsnoop_hdr hdr;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror("Could not create trace file");
+		return -1;
+	}
+
+	memcpy(hdr.id, "btsnoop\0", 8);
+	hdr.version = htonl(BTSNOOP_VERSION);
+	hdr.datalink = htonl(BTSNOOP_DATALINK_H4);
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0) {
+		perror("Could not write trace header");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ Appends one received event packet (H4 type byte included) stamped with
+ ts_us, microseconds since the Unix epoch.
+**/
+int btsnoop_write(int fd, const unsigned char *pkt, size_t len, uint64_t ts_us) {
+	struct btsnoop_pkt rec;
+
+	rec.orig_len = htonl(len);
+	rec.incl_len = htonl(len);
+	rec.flags = htonl(BTSNOOP_FLAG_RECEIVED | BTSNOOP_FLAG_EVENT);
+	rec.drops = 0;
+	rec.ts = htobe64(ts_us + BTSNOOP_EPOCH_DELTA);
+
+	if (write_all(fd, &rec, sizeof(rec)) < 0 || write_all(fd, pkt, len) < 0)
+		return -1;
+	return 0;
+}
+
+/** Reads the next record, returns its length, 0 at the end of the trace, -1 on error **/
+static int btsnoop_read(int fd, unsigned char *pkt, size_t size, uint64_t *ts_us) {
+	struct btsnoop_pkt rec;
+	uint32_t len;
+	ssize_t n;
+
+	n = read(fd, &rec, sizeof(rec));
+	if (n == 0)
+		return 0;
+	if (n != sizeof(rec))
+		return -1;
+
+	len = ntohl(rec.incl_len);
+	if (len > size)
+		return -1;
+	if (read_all(fd, pkt, len) < 0)
+		return -1;
+
+	*ts_us = be64toh(rec.ts) - BTSNOOP_EPOCH_DELTA;
+	return len;
+}
+
+/** Events straight from the non-blocking HCI socket dd **/
+int hci_source_live(struct hci_source *src, int dd) {
+	memset(src, 0, sizeof(*src));
+	src->mode = HCI_SOURCE_LIVE;
+	src->fd = dd;
+	src->trace_fd = src->peer_fd = -1;
+	return 0;
+}
+
+/** Events from the HCI socket dd, each one also written to the btsnoop file path **/
+int hci_source_record(struct hci_source *src, int dd, const char *path) {
+	hci_source_live(src, dd);
+	src->mode = HCI_SOURCE_RECORD;
+	src->trace_fd = btsnoop_create(path);
+	return src->trace_fd < 0 ? -1 : 0;
+}
+
+/**
+ Feeder thread for replay mode. Writes the trace packets into the socketpair,
+ sleeping between them when replaying in real time, and closes its end at
+ the end of the trace so the reader sees end-of-file.
+**/
+static void* replay_feeder(void *arg) {
+	struct hci_source *src = arg;
+	unsigned char pkt[MAX_PACKET_SIZE];
+	uint64_t ts, first_ts = 0, start = monotonic_us();
+	struct timespec delay;
+	int len;
+
+	while ((len = btsnoop_read(src->trace_fd, pkt, sizeof(pkt), &ts)) > 0) {
+		if (src->realtime) {
+			if (first_ts == 0)
+				first_ts = ts;
+			uint64_t due = start + (ts - first_ts), now = monotonic_us();
+			if (due > now) {
+				delay.tv_sec = (due - now) / 1000000;
+				delay.tv_nsec = ((due - now) % 1000000) * 1000;
+				nanosleep(&delay, NULL);
+			}
+		}
+		while (send(src->peer_fd, pkt, len, MSG_NOSIGNAL) < 0) {
+			if (errno != EINTR && errno != ENOBUFS && errno != EAGAIN)
+				goto done;
+		}
+	}
+	if (len < 0)
+		fprintf(stderr, "Trace file is truncated or corrupt\n");
+
+done:
+	shutdown(src->peer_fd, SHUT_WR);
+	return NULL;
+}
+
+/** Events read from the btsnoop file path, paced as recorded if realtime is set **/
+int hci_source_replay(struct hci_source *src, const char *path, int realtime) {
+	struct btsnoop_hdr hdr;
+	int sv[2];
+
+	memset(src, 0, sizeof(*src));
+	src->mode = HCI_SOURCE_REPLAY;
+	src->realtime = realtime;
+	src->fd = src->peer_fd = -1;
+
+	src->trace_fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (src->trace_fd < 0) {
+		perror("Could not open trace file");
+		return -1;
+	}
+	if (read_all(src->trace_fd, &hdr, sizeof(hdr)) < 0 || memcmp(hdr.id, "btsnoop\0", 8) != 0 ||
+	    ntohl(hdr.datalink) != BTSNOOP_DATALINK_H4) {
+		fprintf(stderr, "%s is not an H4 btsnoop trace\n", path);
+		goto failed;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		perror("socketpair");
+		goto failed;
+	}
+	src->fd = sv[0];
+	src->peer_fd = sv[1];
+	fcntl(src->fd, F_SETFL, fcntl(src->fd, F_GETFL, 0) | O_NONBLOCK);
+
+	if (pthread_create(&src->feeder, NULL, replay_feeder, src) != 0) {
+		perror("pthread_create");
+		goto failed;
+	}
+	src->feeding = 1;
+	return 0;
+
+failed:
+	hci_source_close(src);
+	return -1;
+}
+
+/**
+ Reads one event packet without blocking. Returns its length, 0 if nothing
+ is queued, -1 on error, and sets finished once a replay has been consumed.
+**/
+int hci_source_read(struct hci_source *src, unsigned char *buf, size_t size) {
+	int len = read(src->fd, buf, size);
+
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+		return -1;
+	}
+	if (len == 0) {
+		atomic_store(&src->finished, 1);
+		return 0;
+	}
+
+	atomic_fetch_add(&src->packets, 1);
+	if (src->mode == HCI_SOURCE_RECORD && btsnoop_write(src->trace_fd, buf, len, realtime_us()) < 0) {
+		perror("Could not write trace, recording stopped");
+		close(src->trace_fd);
+		src->trace_fd = -1;
+		src->mode = HCI_SOURCE_LIVE;
+	}
+	return len;
+}
+
+/** Stops a replay and closes the trace, the HCI socket itself is left open **/
+void hci_source_close(struct hci_source *src) {
+	if (src->mode == HCI_SOURCE_REPLAY) {
+		if (src->fd >= 0) {
+			close(src->fd);									// Unblocks the feeder with EPIPE
+			if (src->feeding)
+				pthread_join(src->feeder, NULL);
+			src->feeding = 0;
+		}
+		if (src->peer_fd >= 0)
+			close(src->peer_fd);
+		src->fd = src->peer_fd = -1;
+	}
+	if (src->trace_fd >= 0)
+		close(src->trace_fd);
+	src->trace_fd = -1;
+}
@@ -0,0 +1,42 @@
+#ifndef HCI_SOURCE_H_
+#define HCI_SOURCE_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum hci_source_mode {
+	HCI_SOURCE_LIVE,											// Events come from the HCI socket
+	HCI_SOURCE_RECORD,											// As live, and every event is written to a btsnoop file
+	HCI_SOURCE_REPLAY											// Events come from a btsnoop file
+};
+
+/**
+ Where the event loop gets its HCI event packets from. fd is always a
+ non-blocking descriptor that can be polled and delivers one packet per
+ read(): the HCI socket itself, or in replay mode one end of a socketpair
+ that a feeder thread fills from the trace file.
+**/
+struct hci_source {
+	enum hci_source_mode mode;
+	int fd;
+	int trace_fd;
+	int peer_fd;
+	int realtime;												// Replay at the recorded pace instead of flat out
+	pthread_t feeder;
+	int feeding;
+	atomic_int finished;
+	atomic_ulong packets;
+};
+
+int hci_source_live(struct hci_source *src, int dd);
+int hci_source_record(struct hci_source *src, int dd, const char *path);
+int hci_source_replay(struct hci_source *src, const char *path, int realtime);
+int hci_source_read(struct hci_source *src, unsigned char *buf, size_t size);
+void hci_source_close(struct hci_source *src);
+
+int btsnoop_create(const char *path);
+int btsnoop_write(int fd, const unsigned char *pkt, size_t len, uint64_t ts_us);
+
+#endif
@@ -1,208 +1,249 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <bluetooth/hci.h>
 #include <bluetooth/hci_lib.h>
 #include "scan_adv.h"
+#include "connection_handler.h"
+#include "formation.h"
+#include "nb_snapshot.h"
 
 #define MAX_CONNECTION_LIMIT 2
 #define BUFFER_SIZE 1024
-#define TIMEOUT_SECONDS 20
-//#define NUM_STATES 6
+#define CONNECT_TIMEOUT_MS 5000
+#define SNAPSHOT_PATH "nb_graph.snap"
 
-int NUM_STATE = 6;
+/*
+One loop drives the formation engine (formation.c): the scan pipeline's
+event fd brings new neighbour graphs and delegation or done frames, a
+timerfd the engine's wakeups, and the L2CAP sockets incoming connections
+and the end of our own connection attempts. Nothing in the loop blocks
+but poll().
+*/
 
+//------------------------Global variables
+static struct formation engine;
+static struct nb_data pass_graph; // Graph handed to the engine, its memory is kept between events
+static struct nb_data warm_graph; // Topology restored at startup, until the first decision confirms or drops it
+static struct nb_snapshot snapshot;
+static int table_reader = -1; // Our reader slot in the scan pipeline's neighbour table
+static uint64_t graph_version; // Of the view last copied
+static int timer_fd = -1; // Engine wakeups
+static int listen_fd = -1; // Neighbours connecting to us
+static int connect_fd = -1; // Our connection in progress, one at a time
+static uint64_t connect_peer;
+static uint64_t connect_deadline_ms;
+static uint64_t failed_peer; // Could not even start connecting, reported from the loop
+static int connections[FORMATION_MAX_LINKS]; // Sockets of our links, for phase 2
+static int nmb_of_connections;
+//------------------------
 
-//State function prototypes
-void adv_own(void);
-void adv_neighbour(void);
-void delegate(void);
-void delegated(void);
-void ble_connect(void);
-void done(void);
+static void deliver(enum formation_event_type type, uint64_t peer, const struct nb_data *graph, const struct mesh_adv *msg) {
+	struct formation_event ev = { .type = type, .peer = peer, .graph = graph, .msg = msg };
 
+	formation_handle(&engine, monotonic_ms(), &ev);
+}
 
-typedef enum {
-       	ADV_NEIGHBOUR_ADDR,
-	DELEGATE,
-	DELEGATED,
-	CONNECT,
-	DONE,
-	NUM_STATES
-}StateType;
+static void keep_connection(int fd) {
+	if (nmb_of_connections < FORMATION_MAX_LINKS)
+		connections[nmb_of_connections++] = fd;
+	else
+		close(fd);
+}
 
-typedef struct {
-	StateType state;
-	void (*func)(void);
-}StateMachineType;
+static void node_advertise(void *ctx, uint8_t type, const uint64_t *addrs, int count) {
+	if (type == MESH_ADV_NEIGHBOURS)
+		advertise_set(addrs, count); // Rotated on the advertising thread
+	else
+		advertise(type, addrs, count);
+}
 
-void (*statefunc)() = adv_neighbour;
+static void node_connect(void *ctx, uint64_t peer) {
+	char addr[18];
 
+	connect_peer = peer;
+	connect_fd = connect_start(key_to_str(peer, addr));
+	if (connect_fd < 0)
+		failed_peer = peer; // Can't call back into the engine from here
+	else
+		connect_deadline_ms = monotonic_ms() + CONNECT_TIMEOUT_MS;
+}
+
+static void node_set_timer(void *ctx, uint64_t at_ms) {
+	struct itimerspec its = { 0 };
+
+	its.it_value.tv_sec = at_ms / 1000;
+	its.it_value.tv_nsec = (at_ms % 1000) * 1000000;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime");
+}
 
-StateMachineType state_machine[] = 
-{
-	{ADV_NEIGHBOUR_ADDR, adv_neighbour},
-	{DELEGATE, delegate},
-	{DELEGATED, delegated},
-	{CONNECT, ble_connect},
-	{DONE, done}
+static void node_state_changed(void *ctx, StateType from, StateType to) {
+	printf("Now in %s\n", formation_state_name(to));
+	if (from == ADV_NEIGHBOUR_ADDR && warm_graph.count > 0) {
+		printf("Dropping %u neighbours from the snapshot that were not heard again\n", warm_graph.count);
+		nb_data_clear(&warm_graph);
+	}
+	if (to == DONE)
+		printf("Formation done, %d links, piconet of %d\n", engine.nmb_of_links, formation_piconet_size(&engine));
+}
+
+static const struct formation_ops node_ops = {
+	.advertise = node_advertise,
+	.connect = node_connect,
+	.set_timer = node_set_timer,
+	.state_changed = node_state_changed
 };
 
-//Function prototypes
-//void advertise(void);
-//void scan(void);
-void common_neighbours(void);	//Calculate common neighbours
-void max_neighbour(void);		//Calculate the greatest neighbour
+/** Hands the engine the frames and the graph the scan pipeline has for us **/
+static void scan_event(int scan_fd) {
+	struct scan_frame frames[SCAN_FRAME_QUEUE];
+	const struct nb_view *view;
+	uint64_t count;
+	int n, changed = 0;
+
+	if (read(scan_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("scan event");
+
+	// Copy of the graph the scan pipeline last published, it keeps scanning meanwhile
+	if (table_reader < 0 && (table_reader = nb_table_register(scan_neighbour_table())) < 0)
+		exit(1);
+	view = nb_table_enter(scan_neighbour_table(), table_reader);
+	if (view != NULL && view->version != graph_version) {
+		if (nb_data_copy(&pass_graph, &view->graph) < 0)
+			exit(1);
+		graph_version = view->version;
+		changed = 1;
+	}
+	nb_table_exit(scan_neighbour_table(), table_reader);
 
-StateType state = ADV_NEIGHBOUR_ADDR;
-//------------------------Global variables
-int i_am_prey = 0; // if 1 then this device is a prey
-//------------------------
-void adv_neighbour(void) {
-	//Advertise our neighbours
-	//Scan for neighbours and if a new neighbour is found add it to memory and prey_list
-	
-	//If timer times out and if neighbour_max > own_addr then reset timer and keep to same state
-	//If (timer times out and neigbour_max < own_addr) and prey_length <= connection_capacity go to the CONNECT state
-	//If (timer times out and neigbour_max < own_addr) and prey_length > connection_capacity go to the DELEGATE state
-	//If we receive prey msg we go to the DELEGATED state
-	
-	//~ printf("hej\n");
-  
-  time_t start = time(0);
-  char arr[10][18];
-  int counter = 0;
-  int current = 0;
-  struct nb_object *nb_list = NULL;
-  
-  while (1) {
-    char neighbour [] = "";
-    if ((nb_list != NULL)) {
-      printf("this is being advertised %s\n", arr[current]);
-      advertise(arr[current]);
-      current++;
-      if(current > counter){
-	current = 0;
-      }
-    } else {
-      advertise(neighbour);
-    }
-    printf("%d\n", &nb_list);
-    nb_list = scan(nb_list);
-    printf("%d\n", &nb_list);
-    
-    char *my_bdaddr = "placeholder";//print_own_bd_addr(); // This function is in connect handler
-    printf("Test1\n");
-	char my_bd[18];
-	printf("Test2\n");
-	strcpy(my_bd, my_bdaddr);
-	printf("Test3\n");
-	//char my_bd [18] = *print_own_bd_addr();
-    
-    ll_foreach(nb_list, it){
-    if('T' == it->de){
-    	if(0 == strcmp(my_bd, it->nb_bdaddr)){
-    		statefunc = delegated;
-    		}
-    	}
-      	add_to_array(arr, nb_list, &counter);
-    }
-    printf("Test4\n");
-  
-  
-	  // Add entries in datastructure
-	  struct nb_object *ptr[16] = { 0 };
-	  *ptr = fill_entries(ptr, nb_list);
-	  printf("Test5\n");
-	  printf("%d\n", ptr);
-	  
-	  print_nb(ptr);
-	  
-	  // Show neighbours neighbour, remove when sure it works.
-	  struct nb_object *rtn = NULL;
-	  printf("Test6\n");
-	  rtn = rtn_nb_ptr(ptr);
-	  
-	  printf("dab on the haters\n");
-	  printf("%d\n", rtn->nb_bdaddr);
-	  //~ printf("dab on the haters\n");
-	  ll_foreach(rtn, it){
-		printf("dont dab on the haters\n");
-		print_nb_nb(ptr, it->nb_bdaddr);
-	  }
-	  // Add prey list
-	  char prey[10][18];
-	  int nmb_of_prey = 0;
-	  
-	  ll_foreach(rtn, it){
-		if(0 < strcmp(my_bd, it->nb_bdaddr)) { // This means my_bd > it->nb_bdaddr
-		  strcpy(prey[nmb_of_prey], it->nb_bdaddr);
-		  nmb_of_prey++;
+	if (changed) {
+		nb_snapshot_save(&snapshot, &pass_graph); // Only writes when the topology changed
+		if (warm_graph.count > 0 && nb_snapshot_merge(&pass_graph, &warm_graph) == 0) {
+			printf("Every neighbour from the snapshot has been heard again\n");
+			nb_data_clear(&warm_graph);
 		}
-		else{ // This node has a nb with a higher unique identifier
-		  i_am_prey = 1;  
-		}
-	  }
-	  
-	  if (time(0) - start >= 20) {
-	  	if(i_am_prey) {
-			printf("i am prey\n");
-	  		continue;
-	  	} else {
-			printf("Going into delegate\n");
-	  		statefunc = delegate;
-	  		break;
-	  	}
-      }
-
-	  if(nmb_of_prey <= 2) { // Go into connect phase
-		printf("Going into connection phase\n");
-		statefunc = ble_connect;
-		printf("Gonna run brak next line\n");
-		break;
-	  }
+		deliver(FORM_EV_GRAPH, BDADDR_KEY_NONE, &pass_graph, NULL);
 	}
 
+	n = scan_take_frames(frames, SCAN_FRAME_QUEUE);
+	for (int i = 0; i < n; i++)
+		deliver(FORM_EV_FRAME, frames[i].from, NULL, &frames[i].msg);
 }
 
-void delegate(void) {
-	printf("Now in DELEGATE\n");
-	//Advertise a prey msg to neigbour_max
-	//Remove neighbour_max from prey_list
-	//Remove Common neighbours from prey 
-	//Decrement connection_capacity
-	//Color edge to neighbour_max blue
-	//If (timer times out and neigbour_max < own_addr) and prey_length > connection_capacity go to the DELEGATE state
-	//If (timer times out and neigbour_max < own_addr) and prey_length <= connection_capacity go to the CONNECT state	
-}
-void delegated(void) {
-	
-	printf("Now in DELEGATED!!\n");
-	
-	//Calculate Common neighbours
-	//Connect to Common neighbours
-	//Color edges
-	//Go to the DONE state
+static void connect_event(void) {
+	char addr[18];
+	uint64_t peer = connect_peer;
+	int fd = connect_fd;
+
+	connect_fd = -1;
+	if (connect_finish(fd, key_to_str(peer, addr)) < 0) {
+		deliver(FORM_EV_CONNECT_FAILED, peer, NULL, NULL);
+		return;
+	}
+	keep_connection(fd);
+	deliver(FORM_EV_CONNECTED, peer, NULL, NULL);
 }
-void ble_connect(void) {
-	
-	printf("Now in CONNECT\n");
-	
-	//Connect to neighbours
-	//color edges 
-	//Go to the DONE state
+
+static void connect_timeout(void) {
+	char addr[18];
+	uint64_t peer = connect_peer;
+
+	printf("Pi %s did not answer within %d ms\n", key_to_str(peer, addr), CONNECT_TIMEOUT_MS);
+	close(connect_fd);
+	connect_fd = -1;
+	deliver(FORM_EV_CONNECT_FAILED, peer, NULL, NULL);
 }
-void done(void) {
-	//Go to Phase 2, I guess...
+
+static void accept_event(void) {
+	char addr[18];
+	int fd;
+
+	while ((fd = accept_ready(listen_fd, addr)) >= 0) {
+		keep_connection(fd);
+		deliver(FORM_EV_ACCEPTED, str_to_key(addr), NULL, NULL);
+	}
 }
 
 int main(){
-	if(state < NUM_STATE) {
-		(*statefunc)();
-	} else {
-		perror("Invalid state");
+	struct formation_config config;
+	struct timespec load_start, load_end;
+	struct pollfd pfd[4];
+	uint64_t my_bd, expired, now;
+	int scan_fd, nfds, timeout;
+
+	my_bd = str_to_key(print_own_bd_addr()); // Our own address decides who is prey
+	nb_data_init(&pass_graph);
+	pass_graph.quiet = 1;
+	nb_data_init(&warm_graph);
+	warm_graph.quiet = 1;
+
+	nb_snapshot_init(&snapshot, SNAPSHOT_PATH);
+	clock_gettime(CLOCK_MONOTONIC, &load_start);
+	if (nb_snapshot_load(&snapshot, &warm_graph, NB_SNAPSHOT_MAX_AGE_S) > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &load_end);
+		printf("Warm start with %u neighbours from %s in %ld us\n", warm_graph.count, SNAPSHOT_PATH,
+		       (load_end.tv_sec - load_start.tv_sec) * 1000000 + (load_end.tv_nsec - load_start.tv_nsec) / 1000);
+	}
+
+	scan_fd = scan_event_fd();
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (scan_fd < 0 || timer_fd < 0) {
+		perror("Formation loop");
+		exit(1);
+	}
+	listen_fd = listen_start();
+	if (listen_fd < 0)
+		fprintf(stderr, "Not accepting connections, this node can only connect\n");
+	set_peer_check(scan_peer_alive);
+
+	formation_config_default(&config);
+	config.capacity = MAX_CONNECTION_LIMIT;
+	formation_init(&engine, my_bd, &config, &node_ops, NULL);
+	deliver(FORM_EV_START, BDADDR_KEY_NONE, NULL, NULL);
+
+	while (1) {
+		if (failed_peer != BDADDR_KEY_NONE) {
+			uint64_t peer = failed_peer;
+			failed_peer = BDADDR_KEY_NONE;
+			deliver(FORM_EV_CONNECT_FAILED, peer, NULL, NULL);
+			continue;
+		}
+
+		nfds = 0;
+		pfd[nfds++] = (struct pollfd) { .fd = scan_fd, .events = POLLIN };
+		pfd[nfds++] = (struct pollfd) { .fd = timer_fd, .events = POLLIN };
+		pfd[nfds++] = (struct pollfd) { .fd = listen_fd, .events = POLLIN }; // Ignored while -1
+		pfd[nfds++] = (struct pollfd) { .fd = connect_fd, .events = POLLOUT };
+		timeout = -1;
+		if (connect_fd >= 0) {
+			now = monotonic_ms();
+			timeout = connect_deadline_ms > now ? connect_deadline_ms - now : 0;
+		}
+
+		if (poll(pfd, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			exit(1);
+		}
+
+		if (pfd[0].revents & POLLIN)
+			scan_event(scan_fd);
+		if ((pfd[1].revents & POLLIN) && read(timer_fd, &expired, sizeof(expired)) > 0)
+			deliver(FORM_EV_TIMER, BDADDR_KEY_NONE, NULL, NULL);
+		if (pfd[2].revents & POLLIN)
+			accept_event();
+		if (connect_fd >= 0 && connect_fd == pfd[3].fd && pfd[3].revents)
+			connect_event();
+		else if (connect_fd >= 0 && monotonic_ms() >= connect_deadline_ms)
+			connect_timeout();
 	}
 }
@@ -18,6 +18,8 @@
 #include <bluetooth/hci_lib.h>
 
 #include "list.h"
+#include "bdaddr_key.h"
+#include "dup_cache.h"
 
 #define FLAGS_AD_TYPE 0x01
 #define FLAGS_LIMITED_MODE_BIT 0x01
@@ -150,8 +152,9 @@ list_t* print_advertising_devices(int dd, uint8_t filter_type) {
 	tv.tv_usec = 0;
 	list_t *neighbours = list_new();
 	char arr [100][18];
-	char addr_table[1000][18];
-	int addr_counter = 0;	
+	static struct dup_cache seen;									// Addresses already listed, O(1) per report
+	
+	dup_cache_init(&seen, 20 * 1000);
 	
 	olen = sizeof(of);
 	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
@@ -178,7 +181,6 @@ list_t* print_advertising_devices(int dd, uint8_t filter_type) {
 		evt_le_meta_event *meta;
 		le_advertising_info *info;
 		char addr[18];
-		int addr_exists;
 	
 		
 		while ((len = read(dd, buf, sizeof(buf))) < 0) {
@@ -213,32 +215,17 @@ list_t* print_advertising_devices(int dd, uint8_t filter_type) {
 			ba2str(&info->bdaddr, addr);
 			eir_parse_name(info->data, info->length,
 							name, sizeof(name) - 1);
-			//uint8_t *dat = info->data;
-			char rssi;
-			//printf("%d\n", rssi);
+			int8_t rssi = (int8_t) info->data[info->length];		// RSSI follows the AD data
 			
-			printf("%s %s ", addr, name);
-			for (int i = 0; i < info->length; i++) {
-				rssi = info->data[i];
-				printf("%d ", rssi);
-			}
-			printf("\n");
+			printf("%s %s rssi %d\n", addr, name, rssi);
 	
 			//printf("%s %d %s\n", addr, rssi, name);
 
-			addr_exists = 0; 
-			for (int i = 0; i < sizeof(addr_table)/sizeof(addr_table[0]); i++) {
-				if (strcmp(addr, addr_table[i]) == 0) {
-					addr_exists = 1;
-				}
-			}
-			if (addr_exists == 0) {strcpy(addr_table[addr_counter], addr);
-				list_node_t *a = list_node_new(addr_table[addr_counter]);
+			// Only the address counts here, the TTL outlasts the 20 second scan
+			if (dup_cache_check(&seen, bdaddr_to_key(&info->bdaddr), 0, time(0) * 1000)) {
+				list_node_t *a = list_node_new(strdup(addr));
 				list_rpush(neighbours, a);
 			}
-			
-			addr_counter++;
-			if (addr_counter == (sizeof(addr_table)/sizeof(addr_table[0]) - 1)) addr_counter = 0;
 				
 		}
 	}
@@ -0,0 +1,77 @@
+/*
+Per-neighbour link quality from the RSSI byte that follows the AD data of
+every advertising report.
+*/
+#include <math.h>
+#include <string.h>
+
+#include "link_quality.h"
+
+#define SLOT_MASK (LQ_SLOTS - 1)
+
+void lq_table_init(struct lq_table *table) {
+	memset(table, 0, sizeof(*table));
+}
+
+static size_t slot_of(uint64_t key) {
+	return ((key * 0x9E3779B97F4A7C15ULL) >> 40) & SLOT_MASK;
+}
+
+/** Returns the entry for key, or NULL if key has never been sampled **/
+struct link_quality* lq_table_find(struct lq_table *table, uint64_t key) {
+	size_t slot = slot_of(key);
+
+	for (size_t i = 0; i < LQ_SLOTS; i++, slot = (slot + 1) & SLOT_MASK) {
+		if (table->slots[slot].key == key)
+			return &table->slots[slot];
+		if (table->slots[slot].key == 0)
+			return NULL;
+	}
+	return NULL;
+}
+
+/** Returns the entry for key, adding it if needed. NULL if the table is full. **/
+struct link_quality* lq_table_get(struct lq_table *table, uint64_t key) {
+	size_t slot = slot_of(key);
+
+	for (size_t i = 0; i < LQ_SLOTS; i++, slot = (slot + 1) & SLOT_MASK) {
+		if (table->slots[slot].key == key)
+			return &table->slots[slot];
+		if (table->slots[slot].key == 0) {
+			if (table->used == LQ_SLOTS - 1)						// Keep one empty slot so lookups terminate
+				return NULL;
+			table->used++;
+			table->slots[slot].key = key;
+			return &table->slots[slot];
+		}
+	}
+	return NULL;
+}
+
+/** Adds one RSSI sample in dBm to the moving mean and variance **/
+void lq_sample(struct link_quality *lq, int8_t rssi) {
+	float diff, incr;
+
+	if (rssi == LQ_RSSI_UNAVAILABLE)
+		return;
+
+	lq->last_rssi = rssi;
+	if (lq->samples++ == 0) {
+		lq->rssi_mean = rssi;
+		lq->rssi_var = 0;
+		return;
+	}
+	diff = rssi - lq->rssi_mean;
+	incr = LQ_ALPHA * diff;
+	lq->rssi_mean += incr;
+	lq->rssi_var = (1 - LQ_ALPHA) * (lq->rssi_var + diff * incr);
+}
+
+/**
+ Conservative link estimate used to rank neighbours: the mean less one
+ standard deviation, so a strong but unstable link ranks below a slightly
+ weaker steady one. Higher is better.
+**/
+float lq_score(float rssi_mean, float rssi_var) {
+	return rssi_mean - sqrtf(rssi_var);
+}
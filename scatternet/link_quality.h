@@ -0,0 +1,35 @@
+#ifndef LINK_QUALITY_H_
+#define LINK_QUALITY_H_
+
+#include <stdint.h>
+
+#define LQ_SLOTS 256												// Must be a power of two
+#define LQ_ALPHA 0.125f												// Weight of a new RSSI sample
+#define LQ_RSSI_UNAVAILABLE 127										// Controller could not measure RSSI
+#define LQ_RSSI_FLOOR -127.0f										// Assumed for neighbours without samples
+
+/**
+ Smoothed RSSI of one neighbour: exponentially weighted moving mean and
+ variance over every advertising report received from it, in dBm.
+**/
+struct link_quality {
+	uint64_t key;													// bdaddr key, BDADDR_KEY_NONE when unused
+	float rssi_mean;
+	float rssi_var;
+	uint32_t samples;
+	int8_t last_rssi;
+};
+
+/** Fixed-size open-addressing table of link_quality entries keyed by address **/
+struct lq_table {
+	struct link_quality slots[LQ_SLOTS];
+	unsigned int used;
+};
+
+void lq_table_init(struct lq_table *table);
+struct link_quality* lq_table_find(struct lq_table *table, uint64_t key);
+struct link_quality* lq_table_get(struct lq_table *table, uint64_t key);
+void lq_sample(struct link_quality *lq, int8_t rssi);
+float lq_score(float rssi_mean, float rssi_var);
+
+#endif
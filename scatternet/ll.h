@@ -34,6 +34,33 @@
     (void *_a, void *_b) { \
         type name1 = _a, name2 = _b;
 
+/*
+ * Nodes normally come from malloc. While a thread has an arena set with
+ * ll_arena_set(), its ll_new() nodes are carved out of the arena's slabs
+ * instead: ll_free() and ll_pop() leave them alone and ll_arena_reset()
+ * releases all of them at once. Slabs are kept across resets, so a list
+ * that grows to the same size every round allocates nothing after the
+ * first one.
+ */
+#define LL_SLAB_SIZE 16384
+
+struct ll_slab;
+
+struct ll_arena {
+    struct ll_slab *first;
+    struct ll_slab *current;
+    size_t used;            /* bytes used in current */
+    size_t in_use;          /* bytes handed out since the last reset */
+    size_t high_water;      /* most in_use ever reached */
+    size_t slabs;
+    unsigned long resets;
+};
+
+void ll_arena_init(struct ll_arena *arena);
+struct ll_arena *ll_arena_set(struct ll_arena *arena);
+void ll_arena_reset(struct ll_arena *arena);
+void ll_arena_destroy(struct ll_arena *arena);
+
 void *_ll_new(void *ll, size_t size);
 void *_ll_pop(void *ll);
 void *_ll_next(void *ll);
@@ -0,0 +1,113 @@
+/*
+Encoder and decoder for the mesh advertisement payload, shared by
+advertise() and the scanner.
+*/
+#include <string.h>
+
+#include "mesh_adv.h"
+#include "bdaddr_key.h"
+
+/**
+ Writes msg into buf as AD data. Returns the number of bytes written, or -1
+ if msg does not fit in size bytes or has too many addresses.
+**/
+int mesh_adv_encode(const struct mesh_adv *msg, uint8_t *buf, size_t size) {
+	size_t len = MESH_ADV_HEADER_SIZE + (size_t) msg->count * MESH_ADV_ADDR_SIZE;
+	uint8_t *p = buf;
+
+	if (msg->type == MESH_ADV_DIGEST)
+		len = MESH_ADV_HEADER_SIZE + MESH_ADV_DIGEST_SIZE;
+	if (msg->count > MESH_ADV_EXT_MAX_ADDRS || len > size)
+		return -1;
+
+	*p++ = len - 1;
+	*p++ = EIR_MANUFACTURER_DATA;
+	*p++ = MESH_ADV_COMPANY_ID & 0xff;
+	*p++ = MESH_ADV_COMPANY_ID >> 8;
+	*p++ = (MESH_ADV_VERSION << 4) | (msg->type & 0x0f);
+	*p++ = msg->seq;
+	if (msg->type == MESH_ADV_DIGEST) {
+		for (int b = 0; b < 4; b++)
+			*p++ = (msg->digest >> (8 * b)) & 0xff;
+		*p++ = msg->generation & 0xff;
+		*p++ = msg->generation >> 8;
+		*p++ = msg->total;
+		return len;
+	}
+	for (int i = 0; i < msg->count; i++) {
+		for (int b = 0; b < MESH_ADV_ADDR_SIZE; b++)
+			*p++ = (msg->addrs[i] >> (8 * b)) & 0xff;
+	}
+	return len;
+}
+
+/**
+ Decodes the mesh advertisement in data, already split up by ad_parse().
+ Nodes still sending the old text format (a "Pi" or "De" name followed by
+ one address as text) are decoded too, with seq 0. Returns 0, or -1 if the
+ report is not a mesh advertisement this version understands.
+**/
+int mesh_adv_decode(const uint8_t *data, const struct ad_fields *ad, struct mesh_adv *msg) {
+	const uint8_t *v = data + ad->mfr.off;
+	size_t addr_bytes;
+
+	memset(msg, 0, sizeof(*msg));
+
+	if (ad->mfr.len >= MESH_ADV_HEADER_SIZE - 2 && (v[0] | v[1] << 8) == MESH_ADV_COMPANY_ID) {
+		addr_bytes = ad->mfr.len - (MESH_ADV_HEADER_SIZE - 2);
+		if (v[2] >> 4 != MESH_ADV_VERSION)
+			return -1;
+		if ((v[2] & 0x0f) == MESH_ADV_DIGEST) {
+			if (addr_bytes != MESH_ADV_DIGEST_SIZE)
+				return -1;
+			msg->type = MESH_ADV_DIGEST;
+			msg->seq = v[3];
+			msg->digest = v[4] | v[5] << 8 | v[6] << 16 | (uint32_t) v[7] << 24;
+			msg->generation = v[8] | v[9] << 8;
+			msg->total = v[10];
+			return 0;
+		}
+		if (addr_bytes % MESH_ADV_ADDR_SIZE != 0 ||
+		    addr_bytes / MESH_ADV_ADDR_SIZE > MESH_ADV_EXT_MAX_ADDRS)
+			return -1;
+
+		msg->type = v[2] & 0x0f;
+		msg->seq = v[3];
+		msg->count = addr_bytes / MESH_ADV_ADDR_SIZE;
+		v += 4;
+		for (int i = 0; i < msg->count; i++, v += MESH_ADV_ADDR_SIZE) {
+			for (int b = MESH_ADV_ADDR_SIZE - 1; b >= 0; b--)
+				msg->addrs[i] = (msg->addrs[i] << 8) | v[b];
+		}
+		return msg->type == MESH_ADV_NEIGHBOURS || msg->type == MESH_ADV_DELEGATE ||
+		       msg->type == MESH_ADV_DONE || msg->type == MESH_ADV_CONNECT ? 0 : -1;
+	}
+
+	if (ad_name_is(data, ad, "Pi"))
+		msg->type = MESH_ADV_NEIGHBOURS;
+	else if (ad_name_is(data, ad, "De"))
+		msg->type = MESH_ADV_DELEGATE;
+	else
+		return -1;
+
+	msg->addrs[0] = ad_tail_bdaddr(data, ad);
+	msg->count = msg->addrs[0] != BDADDR_KEY_NONE;
+	return 0;
+}
+
+/**
+ Order independent hash of a neighbour set: the sum of a mixed hash of
+ every address, so both ends get the same digest however they collected
+ the set. The empty set hashes to 0.
+**/
+uint32_t mesh_adv_digest(const uint64_t *addrs, int count) {
+	uint64_t sum = 0;
+
+	for (int i = 0; i < count; i++) {
+		uint64_t h = addrs[i] + 0x9E3779B97F4A7C15ULL;				// splitmix64 finalizer
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		sum += h ^ (h >> 31);
+	}
+	return sum ^ (sum >> 32);
+}
@@ -0,0 +1,172 @@
+/*
+Microbenchmark for common neighbour queries on random graphs of 16, 256
+and 4096 nodes: walking the (neighbour, two-hop neighbour) list the scanner
+produces, probing the hash sets of nb_data, and ANDing nb_bitset rows one
+word at a time and with vector popcounts.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ll.h"
+#include "structs.h"
+#include "bdaddr_key.h"
+#include "nb_data.h"
+#include "nb_bitset.h"
+
+#define DEGREE 16													// Links each node makes, the graph is undirected
+#define KEY_BASE 0x00AA00000000ULL
+#define SELF_KEY 0x00FF00000000ULL
+#define LIST_STEPS 400000000ULL										// Pair visits the list version may take
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Common neighbours of a and b found by walking the pair list, as the list based design would **/
+static int list_common(struct nb_object *list, uint64_t a, uint64_t b) {
+	int n = 0;
+
+	ll_foreach(list, x) {
+		if (x->nb_bdaddr != a)
+			continue;
+		ll_foreach(list, y) {
+			if (y->nb_bdaddr == b && y->nb_nb_bdaddr == x->nb_nb_bdaddr) {
+				n++;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+static int graph_common(const struct nb_data *nb, uint64_t a, uint64_t b) {
+	struct nb_entry *entry_a = nb_find(nb, a), *entry_b = nb_find(nb, b);
+	uint32_t pos = 0;
+	uint64_t key;
+	int n = 0;
+
+	if (entry_a == NULL || entry_b == NULL)
+		return 0;
+	while ((key = nb_nb_next(entry_a, &pos)) != BDADDR_KEY_NONE)
+		n += nb_has_nb_nb(entry_b, key);
+	return n;
+}
+
+static void run(int nodes, int queries) {
+	struct nb_object *list = NULL;
+	struct nb_data nb;
+	struct nb_bitset bs;
+	uint64_t *qa = malloc(queries * sizeof(uint64_t)), *qb = malloc(queries * sizeof(uint64_t));
+	long sum_list = 0, sum_head = 0, sum_graph = 0, sum_scalar = 0, sum_simd = 0;
+	int list_queries, links = 0, simd;
+	double t, ns_list, ns_graph, ns_build, ns_scalar, ns_simd;
+
+	if (qa == NULL || qb == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	nb_data_init(&nb);
+	nb.quiet = 1;
+	nb_bitset_init(&bs);
+	simd = bs.simd;
+
+	for (int i = 0; i < nodes; i++) {
+		for (int d = 0; d < DEGREE && d < nodes - 1; d++) {
+			int j = rng() % nodes;
+			if (j == i)
+				continue;
+			if (add_nb_nb(&nb, KEY_BASE + i, KEY_BASE + j) == 1) {
+				list = ll_new(list);
+				list->nb_bdaddr = KEY_BASE + i;
+				list->nb_nb_bdaddr = KEY_BASE + j;
+				links++;
+			}
+			if (add_nb_nb(&nb, KEY_BASE + j, KEY_BASE + i) == 1) {
+				list = ll_new(list);
+				list->nb_bdaddr = KEY_BASE + j;
+				list->nb_nb_bdaddr = KEY_BASE + i;
+				links++;
+			}
+		}
+	}
+	for (int q = 0; q < queries; q++) {
+		qa[q] = KEY_BASE + rng() % nodes;
+		qb[q] = KEY_BASE + rng() % nodes;
+	}
+
+	list_queries = LIST_STEPS / ((uint64_t) links * (DEGREE * 2 + 1));
+	if (list_queries > queries)
+		list_queries = queries;
+	if (list_queries < 1)
+		list_queries = 1;
+	t = now_ns();
+	for (int q = 0; q < list_queries; q++)
+		sum_list += list_common(list, qa[q], qb[q]);
+	ns_list = (now_ns() - t) / list_queries;
+
+	t = now_ns();
+	for (int q = 0; q < queries; q++) {
+		sum_graph += graph_common(&nb, qa[q], qb[q]);
+		if (q == list_queries - 1)
+			sum_head = sum_graph;
+	}
+	ns_graph = (now_ns() - t) / queries;
+
+	t = now_ns();
+	if (nb_bitset_build(&bs, &nb, SELF_KEY) < 0)
+		exit(1);
+	ns_build = now_ns() - t;
+
+	bs.simd = 0;
+	t = now_ns();
+	for (int q = 0; q < queries; q++)
+		sum_scalar += common_neighbours(&bs, qa[q], qb[q], NULL, 0);
+	ns_scalar = (now_ns() - t) / queries;
+
+	bs.simd = simd;
+	t = now_ns();
+	for (int q = 0; q < queries; q++)
+		sum_simd += common_neighbours(&bs, qa[q], qb[q], NULL, 0);
+	ns_simd = (now_ns() - t) / queries;
+
+	// Self is a neighbour of every node in the bitset but not in the other two
+	sum_scalar -= queries;
+	sum_simd -= queries;
+	if (sum_list != sum_head || sum_graph != sum_scalar || sum_simd != sum_scalar)
+		fprintf(stderr, "%d nodes: results differ, list %ld/%ld hash %ld bitset %ld vector %ld\n",
+			nodes, sum_list, sum_head, sum_graph, sum_scalar, sum_simd);
+
+	printf("%5d nodes %6d links | list %10.0f ns | hash %7.1f ns | bitset %7.1f ns, %s %7.1f ns | build %.0f us\n",
+		nodes, links, ns_list, ns_graph, ns_scalar, simd ? "vector" : "no vector", ns_simd, ns_build / 1000);
+
+	ll_free(list);
+	nb_data_free(&nb);
+	nb_bitset_free(&bs);
+	free(qa);
+	free(qb);
+}
+
+int main(int argc, char *argv[]) {
+	int queries = argc > 1 ? atoi(argv[1]) : 100000;
+
+	if (queries < 1)
+		queries = 1;
+	printf("Common neighbours of random node pairs, %d queries, degree %d\n", queries, DEGREE * 2);
+	run(16, queries);
+	run(256, queries);
+	run(4096, queries);
+	return 0;
+}
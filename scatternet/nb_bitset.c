@@ -0,0 +1,268 @@
+/*
+Bitset adjacency for the formation queries, common_neighbours() and
+max_neighbour(). Rows are ANDed a vector at a time with AVX2 on x86 and
+NEON on ARM when the CPU has it, otherwise a 64-bit word at a time.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nb_bitset.h"
+#include "bdaddr_key.h"
+
+#define INDEX_MIN 16
+
+static uint32_t hash_key(uint64_t key) {
+	return (key * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+
+static int count_scalar(const uint64_t *a, const uint64_t *b, uint32_t words) {
+	int n = 0;
+
+	for (uint32_t i = 0; i < words; i++)
+		n += __builtin_popcountll(a[i] & b[i]);
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+static int simd_available(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+/** Popcount of each byte by nibble table lookup, summed into four 64-bit lanes **/
+__attribute__((target("avx2")))
+static int count_simd(const uint64_t *a, const uint64_t *b, uint32_t words) {
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i acc = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	uint32_t i = 0;
+
+	for (; i + 4 <= words; i += 4) {
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (a + i)),
+		                             _mm256_loadu_si256((const __m256i *) (b + i)));
+		__m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble));
+		__m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+	}
+	_mm256_storeu_si256((__m256i *) lanes, acc);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + count_scalar(a + i, b + i, words - i);
+}
+
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static int simd_available(void) {
+	return 1;
+}
+
+static int count_simd(const uint64_t *a, const uint64_t *b, uint32_t words) {
+	uint64x2_t acc = vdupq_n_u64(0);
+	uint32_t i = 0;
+
+	for (; i + 2 <= words; i += 2) {
+		uint8x16_t v = vreinterpretq_u8_u64(vandq_u64(vld1q_u64(a + i), vld1q_u64(b + i)));
+		acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vcntq_u8(v))));
+	}
+	return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) + count_scalar(a + i, b + i, words - i);
+}
+
+#else
+
+static int simd_available(void) {
+	return 0;
+}
+
+static int count_simd(const uint64_t *a, const uint64_t *b, uint32_t words) {
+	return count_scalar(a, b, words);
+}
+
+#endif
+
+void nb_bitset_init(struct nb_bitset *bs) {
+	memset(bs, 0, sizeof(*bs));
+	bs->simd = simd_available();
+}
+
+void nb_bitset_free(struct nb_bitset *bs) {
+	free(bs->keys);
+	free(bs->rows);
+	free(bs->index);
+	nb_bitset_init(bs);
+}
+
+static uint32_t index_slot(const struct nb_bitset *bs, uint64_t key) {
+	uint32_t mask = bs->index_size - 1;
+	uint32_t slot = hash_key(key) & mask;
+
+	while (bs->index[slot] && bs->keys[bs->index[slot] - 1] != key)
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/** Makes room for up to nodes ids, the index is kept at most half full **/
+static int reserve(struct nb_bitset *bs, uint32_t nodes) {
+	uint32_t size = INDEX_MIN;
+
+	while (size < nodes * 2)
+		size *= 2;
+	if (size > bs->index_size) {
+		free(bs->index);
+		if ((bs->index = malloc(size * sizeof(uint32_t))) == NULL) {
+			bs->index_size = 0;
+			perror("nb_bitset index");
+			return -1;
+		}
+		bs->index_size = size;
+	}
+	memset(bs->index, 0, bs->index_size * sizeof(uint32_t));
+
+	if (nodes > bs->capacity) {
+		uint64_t *keys = realloc(bs->keys, nodes * sizeof(uint64_t));
+		if (keys == NULL) {
+			perror("nb_bitset keys");
+			return -1;
+		}
+		bs->keys = keys;
+		bs->capacity = nodes;
+	}
+	return 0;
+}
+
+static int assign_id(struct nb_bitset *bs, uint64_t key) {
+	uint32_t slot = index_slot(bs, key);
+
+	if (bs->index[slot] == 0) {
+		bs->keys[bs->nodes] = key;
+		bs->index[slot] = ++bs->nodes;
+	}
+	return bs->index[slot] - 1;
+}
+
+static void add_edge(struct nb_bitset *bs, int a, int b) {
+	uint64_t *row_a = bs->rows + (size_t) a * bs->words;
+	uint64_t *row_b = bs->rows + (size_t) b * bs->words;
+
+	if (a == b)
+		return;
+	row_a[b / 64] |= 1ULL << (b % 64);
+	row_b[a / 64] |= 1ULL << (a % 64);
+}
+
+/**
+ Builds the bitset from nb as seen by self: self is linked to every entry
+ of nb and every entry to its own neighbours. Memory from an earlier build
+ is reused. Returns 0 on success, -1 if out of memory.
+**/
+int nb_bitset_build(struct nb_bitset *bs, const struct nb_data *nb, uint64_t self) {
+	uint32_t bound = 1 + nb->count, pos;
+	size_t size;
+	uint64_t key;
+	int self_id, id;
+
+	nb_data_foreach(nb, entry)
+		bound += entry->nb_nb_count;
+	bs->nodes = 0;
+	if (reserve(bs, bound) < 0)
+		return -1;
+
+	self_id = assign_id(bs, self);
+	nb_data_foreach(nb, entry)
+		assign_id(bs, entry->nb_bdaddr);
+	nb_data_foreach(nb, entry) {
+		pos = 0;
+		while ((key = nb_nb_next(entry, &pos)) != BDADDR_KEY_NONE)
+			assign_id(bs, key);
+	}
+
+	bs->words = (bs->nodes + 63) / 64;
+	size = (size_t) bs->nodes * bs->words;
+	if (size > bs->rows_size) {
+		free(bs->rows);
+		if ((bs->rows = malloc(size * sizeof(uint64_t))) == NULL) {
+			bs->rows_size = 0;
+			bs->nodes = 0;
+			perror("nb_bitset rows");
+			return -1;
+		}
+		bs->rows_size = size;
+	}
+	memset(bs->rows, 0, size * sizeof(uint64_t));
+
+	nb_data_foreach(nb, entry) {
+		id = nb_bitset_id(bs, entry->nb_bdaddr);
+		add_edge(bs, self_id, id);
+		pos = 0;
+		while ((key = nb_nb_next(entry, &pos)) != BDADDR_KEY_NONE)
+			add_edge(bs, id, nb_bitset_id(bs, key));
+	}
+	return 0;
+}
+
+/** Returns the id of key, -1 if the graph does not know it **/
+int nb_bitset_id(const struct nb_bitset *bs, uint64_t key) {
+	uint32_t slot;
+
+	if (bs->nodes == 0)
+		return -1;
+	slot = index_slot(bs, key);
+	return bs->index[slot] ? (int) bs->index[slot] - 1 : -1;
+}
+
+/** Number of nodes that are neighbours of both ids a and b **/
+int nb_bitset_common_count(const struct nb_bitset *bs, int a, int b) {
+	if (bs->simd)
+		return count_simd(nb_bitset_row(bs, a), nb_bitset_row(bs, b), bs->words);
+	return count_scalar(nb_bitset_row(bs, a), nb_bitset_row(bs, b), bs->words);
+}
+
+/**
+ Stores up to max addresses that are neighbours of both a and b in keys
+ and returns how many there are in all, which can be more than max. 0 if
+ either address is unknown.
+**/
+int common_neighbours(const struct nb_bitset *bs, uint64_t a, uint64_t b, uint64_t *keys, int max) {
+	int id_a = nb_bitset_id(bs, a), id_b = nb_bitset_id(bs, b), n = 0;
+	const uint64_t *row_a, *row_b;
+
+	if (id_a < 0 || id_b < 0)
+		return 0;
+	if (keys == NULL || max <= 0)
+		return nb_bitset_common_count(bs, id_a, id_b);
+
+	row_a = nb_bitset_row(bs, id_a);
+	row_b = nb_bitset_row(bs, id_b);
+	for (uint32_t i = 0; i < bs->words; i++) {
+		uint64_t word = row_a[i] & row_b[i];
+
+		while (word) {
+			if (n < max)
+				keys[n] = bs->keys[i * 64 + __builtin_ctzll(word)];
+			n++;
+			word &= word - 1;
+		}
+	}
+	return n;
+}
+
+/** Returns the greatest neighbour of key, BDADDR_KEY_NONE if it has none **/
+uint64_t max_neighbour(const struct nb_bitset *bs, uint64_t key) {
+	int id = nb_bitset_id(bs, key);
+	uint64_t max = BDADDR_KEY_NONE;
+	const uint64_t *row;
+
+	if (id < 0)
+		return max;
+	row = nb_bitset_row(bs, id);
+	for (uint32_t i = 0; i < bs->words; i++) {
+		for (uint64_t word = row[i]; word; word &= word - 1) {
+			uint64_t nb_key = bs->keys[i * 64 + __builtin_ctzll(word)];
+			if (nb_key > max)
+				max = nb_key;
+		}
+	}
+	return max;
+}
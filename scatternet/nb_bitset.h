@@ -0,0 +1,39 @@
+#ifndef NB_BITSET_H_
+#define NB_BITSET_H_
+
+#include <stdint.h>
+
+#include "nb_data.h"
+
+/**
+ Dense bitset view of a neighbour graph for set queries. Every address
+ known to the graph gets a small id, and row i holds one bit per id for
+ the neighbours of node i, so common neighbours of two nodes are a word
+ wise AND of their rows and a popcount. The rows are symmetric and built
+ in one go from an nb_data, they are not kept up to date with it.
+**/
+struct nb_bitset {
+	uint64_t *keys;													// Id to address
+	uint64_t *rows;													// nodes rows of words each
+	uint32_t nodes;
+	uint32_t words;
+	uint32_t capacity;												// Ids keys has room for
+	size_t rows_size;												// Words rows has room for
+	uint32_t *index;												// Address to id + 1, 0 marks a free slot
+	uint32_t index_size;
+	int simd;														// Use vector popcounts, set if the CPU has them
+};
+
+void nb_bitset_init(struct nb_bitset *bs);
+void nb_bitset_free(struct nb_bitset *bs);
+int nb_bitset_build(struct nb_bitset *bs, const struct nb_data *nb, uint64_t self);
+int nb_bitset_id(const struct nb_bitset *bs, uint64_t key);
+int nb_bitset_common_count(const struct nb_bitset *bs, int a, int b);
+int common_neighbours(const struct nb_bitset *bs, uint64_t a, uint64_t b, uint64_t *keys, int max);
+uint64_t max_neighbour(const struct nb_bitset *bs, uint64_t key);
+
+static inline const uint64_t* nb_bitset_row(const struct nb_bitset *bs, int id) {
+	return bs->rows + (size_t) id * bs->words;
+}
+
+#endif
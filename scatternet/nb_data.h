@@ -1,11 +1,83 @@
 #ifndef NB_DATA_H_
 #define NB_DATA_H_
 
-void add_nb(struct nb_object **ptr, char *nb_bdaddr, char *nb_nb_bdaddr);
-void add_nb_nb(struct nb_object **ptr, char *nb_bdaddr, char *nb_nb_bdaddr);
-void print_nb(struct nb_object **ptr);
-void print_nb_nb(struct nb_object **ptr, char *nb_bdaddr);
-struct nb_object* fill_entries(struct nb_object **ptr, struct nb_object *list_ptr);
-struct nb_object*  rtn_nb_ptr (struct nb_object **ptr);
+#include <stdint.h>
+
+#include "structs.h"
+
+/** A two-hop neighbour, last_seen_ms and generation as for struct nb_entry **/
+struct nb_link {
+	uint64_t nb_nb_bdaddr;											// BDADDR_KEY_NONE marks a free slot
+	uint64_t last_seen_ms;
+	uint32_t generation;
+};
+
+/** One neighbour and the set of its own neighbours, our two-hop neighbours **/
+struct nb_entry {
+	uint64_t nb_bdaddr;
+	float rssi_mean;												// Smoothed RSSI of the link, see link_quality.h
+	float rssi_var;
+	struct nb_link *nb_nb;											// Open addressing set
+	uint32_t nb_nb_size;											// Slots in nb_nb, a power of two or 0
+	uint32_t nb_nb_count;
+	int provisional;												// Restored from a snapshot, not heard yet
+	uint64_t last_seen_ms;											// nb_data.now_ms when last added or seen again
+	uint32_t generation;											// nb_data.generation at that time
+};
+
+enum nb_event_type {
+	NB_JOIN,														// A new neighbour
+	NB_LEAVE,														// A neighbour expired, its links with it
+	NB_LINK_UP,														// A new two-hop neighbour of nb_bdaddr
+	NB_LINK_DOWN													// A two-hop neighbour of nb_bdaddr expired
+};
+
+/** Called for every join and leave, nb_nb_bdaddr is BDADDR_KEY_NONE for NB_JOIN and NB_LEAVE **/
+typedef void (*nb_event_fn)(void *arg, enum nb_event_type type, uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr);
+
+/**
+ Neighbour graph. Entries are kept densely so iterating them is a plain
+ array walk, and index is an open addressing table from nb_bdaddr to the
+ entry. Both grow by doubling, which keeps inserts and lookups O(1)
+ amortised. There is no shared state, every instance is independent.
+ Pointers to entries stay valid until the next add_nb() or
+ nb_data_expire().
+
+ Entries and links are stamped with now_ms, which the owner keeps current,
+ and with the generation, the number of sweeps so far. nb_data_expire()
+ drops whatever was not seen within a TTL.
+**/
+struct nb_data {
+	struct nb_entry *entries;
+	uint32_t count;
+	uint32_t capacity;												// Entries allocated, from count up they are spare
+	uint32_t *index;												// Entry number + 1, 0 marks a free slot
+	uint32_t index_size;											// A power of two or 0
+	int quiet;														// No log line for every link added
+	uint64_t now_ms;
+	uint32_t generation;
+	nb_event_fn event;												// Join and leave events, NULL for none
+	void *event_arg;
+};
+
+#define nb_data_foreach(nb, entry) \
+	for (struct nb_entry *entry = (nb)->entries; entry < (nb)->entries + (nb)->count; entry++)
+
+void nb_data_init(struct nb_data *nb);
+void nb_data_clear(struct nb_data *nb);
+void nb_data_free(struct nb_data *nb);
+struct nb_entry* nb_find(const struct nb_data *nb, uint64_t nb_bdaddr);
+int nb_has_nb_nb(const struct nb_entry *entry, uint64_t nb_nb_bdaddr);
+uint64_t nb_nb_next(const struct nb_entry *entry, uint32_t *pos);
+struct nb_entry* add_nb(struct nb_data *nb, uint64_t nb_bdaddr);
+int add_nb_nb(struct nb_data *nb, uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr);
+int nb_touch(struct nb_data *nb, uint64_t nb_bdaddr, const uint64_t *links, int count);
+int nb_data_copy(struct nb_data *dst, const struct nb_data *src);
+int nb_data_expire(struct nb_data *nb, uint64_t ttl_ms);
+void print_nb(const struct nb_data *nb);
+void print_nb_nb(const struct nb_data *nb, uint64_t nb_bdaddr);
+int fill_entries(struct nb_data *nb, struct nb_object *list_ptr);
+struct nb_object* rtn_nb_ptr(const struct nb_data *nb);
+void set_link_quality(struct nb_data *nb, uint64_t nb_bdaddr, float rssi_mean, float rssi_var);
 
 #endif
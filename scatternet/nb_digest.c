@@ -0,0 +1,81 @@
+/*
+Change detection for neighbour sets announced with DIGEST frames, see
+mesh_adv.h.
+*/
+#include <string.h>
+
+#include "nb_digest.h"
+
+#define SLOT_MASK (NB_DIGEST_SLOTS - 1)
+
+void nb_digest_init(struct nb_digest_table *table) {
+	memset(table, 0, sizeof(*table));
+}
+
+static size_t slot_of(uint64_t key) {
+	return ((key * 0x9E3779B97F4A7C15ULL) >> 40) & SLOT_MASK;
+}
+
+/** Returns the entry of sender key, or NULL if it never sent a digest **/
+struct nb_digest* nb_digest_find(struct nb_digest_table *table, uint64_t key) {
+	size_t slot = slot_of(key);
+
+	for (size_t i = 0; i < NB_DIGEST_SLOTS; i++, slot = (slot + 1) & SLOT_MASK) {
+		if (table->slots[slot].key == key)
+			return &table->slots[slot];
+		if (table->slots[slot].key == 0)
+			return NULL;
+	}
+	return NULL;
+}
+
+static void check_complete(struct nb_digest *d) {
+	d->complete = d->collected == d->total && mesh_adv_digest(d->addrs, d->collected) == d->digest;
+}
+
+/**
+ Records the DIGEST frame msg from key. Returns 1 if it announces a set we
+ don't have yet, which restarts collection, 0 if nothing changed or the
+ table is full.
+**/
+int nb_digest_update(struct nb_digest_table *table, uint64_t key, const struct mesh_adv *msg) {
+	struct nb_digest *d = nb_digest_find(table, key);
+
+	if (d == NULL) {
+		size_t slot = slot_of(key);
+
+		if (table->used == NB_DIGEST_SLOTS - 1)						// Keep one empty slot so lookups terminate
+			return 0;
+		while (table->slots[slot].key != 0)
+			slot = (slot + 1) & SLOT_MASK;
+		d = &table->slots[slot];
+		d->key = key;
+		table->used++;
+	} else if (d->digest == msg->digest && d->generation == msg->generation) {
+		if (d->collected > d->total) {								// Picked up stale frames, start over
+			d->collected = 0;
+			check_complete(d);
+		}
+		return 0;
+	}
+
+	d->digest = msg->digest;
+	d->generation = msg->generation;
+	d->total = msg->total;
+	d->collected = 0;
+	check_complete(d);
+	table->changes++;
+	return 1;
+}
+
+/** Adds the addresses of a NEIGHBOURS frame from the sender of d **/
+void nb_digest_collect(struct nb_digest *d, const uint64_t *addrs, int count) {
+	for (int i = 0; i < count; i++) {
+		int j;
+
+		for (j = 0; j < d->collected && d->addrs[j] != addrs[i]; j++);
+		if (j == d->collected && d->collected < NB_DIGEST_MAX_SET)
+			d->addrs[d->collected++] = addrs[i];
+	}
+	check_complete(d);
+}
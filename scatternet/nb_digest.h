@@ -0,0 +1,41 @@
+#ifndef NB_DIGEST_H_
+#define NB_DIGEST_H_
+
+#include <stdint.h>
+
+#include "mesh_adv.h"
+#include "adv_scheduler.h"
+
+#define NB_DIGEST_SLOTS 256											// Must be a power of two
+#define NB_DIGEST_MAX_SET ADV_SCHED_MAX								// Neighbours collected per sender, as many as it advertises
+
+/**
+ What we know of one sender's neighbour set: the digest and generation it
+ last advertised, and the addresses collected from its NEIGHBOURS frames
+ since. Once the collected set hashes to the digest it is complete, and
+ further NEIGHBOURS frames from the sender can be skipped until a new
+ digest arrives.
+**/
+struct nb_digest {
+	uint64_t key;													// Sender, BDADDR_KEY_NONE when unused
+	uint32_t digest;
+	uint16_t generation;
+	uint8_t total;
+	uint8_t collected;
+	uint8_t complete;
+	uint64_t addrs[NB_DIGEST_MAX_SET];
+};
+
+struct nb_digest_table {
+	struct nb_digest slots[NB_DIGEST_SLOTS];
+	unsigned int used;
+	unsigned long changes;
+	unsigned long frames_skipped;
+};
+
+void nb_digest_init(struct nb_digest_table *table);
+struct nb_digest* nb_digest_find(struct nb_digest_table *table, uint64_t key);
+int nb_digest_update(struct nb_digest_table *table, uint64_t key, const struct mesh_adv *msg);
+void nb_digest_collect(struct nb_digest *d, const uint64_t *addrs, int count);
+
+#endif
@@ -0,0 +1,142 @@
+/*
+Epoch based publication of the neighbour graph, so the formation logic can
+read a consistent graph while the scan pipeline keeps adding to the next.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nb_table.h"
+
+void nb_table_init(struct nb_table *t) {
+	memset(t, 0, sizeof(*t));
+	atomic_init(&t->current, NULL);
+	atomic_init(&t->epoch, 1);										// Epoch 0 marks a reader outside
+	for (int i = 0; i < NB_TABLE_MAX_READERS; i++) {
+		atomic_init(&t->reader_epoch[i], 0);
+		atomic_init(&t->reader_used[i], 0);
+	}
+}
+
+static void free_views(struct nb_view *view) {
+	struct nb_view *next;
+
+	for (; view != NULL; view = next) {
+		next = view->next;
+		nb_data_free(&view->graph);
+		free(view);
+	}
+}
+
+/** Frees every view, no reader may be inside **/
+void nb_table_destroy(struct nb_table *t) {
+	struct nb_view *current = atomic_exchange(&t->current, NULL);
+
+	if (current != NULL)
+		current->next = NULL;
+	free_views(current);
+	if (t->draft != NULL)
+		t->draft->next = NULL;
+	free_views(t->draft);
+	free_views(t->retired);
+	free_views(t->free);
+	t->draft = t->retired = t->free = NULL;
+}
+
+/** Claims a reader slot. Returns its number, or -1 if all are taken. **/
+int nb_table_register(struct nb_table *t) {
+	for (int i = 0; i < NB_TABLE_MAX_READERS; i++) {
+		int unused = 0;
+		if (atomic_compare_exchange_strong(&t->reader_used[i], &unused, 1))
+			return i;
+	}
+	fprintf(stderr, "No free neighbour table reader slot\n");
+	return -1;
+}
+
+void nb_table_unregister(struct nb_table *t, int reader) {
+	atomic_store(&t->reader_epoch[reader], 0);
+	atomic_store(&t->reader_used[reader], 0);
+}
+
+/**
+ Returns the latest published view, NULL if there is none yet. It stays
+ valid and unchanged until nb_table_exit(). Wait-free.
+**/
+const struct nb_view* nb_table_enter(struct nb_table *t, int reader) {
+	atomic_store(&t->reader_epoch[reader], atomic_load(&t->epoch));
+	return atomic_load(&t->current);
+}
+
+void nb_table_exit(struct nb_table *t, int reader) {
+	atomic_store(&t->reader_epoch[reader], 0);
+}
+
+/** Moves retired views no reader can still hold to the free list **/
+static void reclaim(struct nb_table *t) {
+	uint64_t oldest = UINT64_MAX, e;
+	struct nb_view **link = &t->retired, *view;
+
+	for (int i = 0; i < NB_TABLE_MAX_READERS; i++) {
+		e = atomic_load(&t->reader_epoch[i]);
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+	while ((view = *link) != NULL) {
+		if (view->retired_epoch < oldest) {
+			*link = view->next;
+			view->next = t->free;
+			t->free = view;
+			t->reclaimed++;
+		} else {
+			link = &view->next;
+		}
+	}
+}
+
+/**
+ Returns an empty graph for the writer to fill in, published with
+ nb_table_publish(). The memory of reclaimed views is reused. NULL if out
+ of memory.
+**/
+struct nb_data* nb_table_draft(struct nb_table *t) {
+	if (t->draft == NULL) {
+		if (t->free != NULL) {
+			t->draft = t->free;
+			t->free = t->draft->next;
+		} else if ((t->draft = calloc(1, sizeof(*t->draft))) == NULL) {
+			perror("nb_table view");
+			return NULL;
+		} else {
+			nb_data_init(&t->draft->graph);
+			t->draft->graph.quiet = 1;
+		}
+	}
+	nb_data_clear(&t->draft->graph);
+	return &t->draft->graph;
+}
+
+/**
+ Makes the draft the current view. The one it replaces is retired and
+ reused once no reader can hold it. Returns 0, or -1 if there is no draft.
+**/
+int nb_table_publish(struct nb_table *t) {
+	struct nb_view *old;
+
+	if (t->draft == NULL)
+		return -1;
+	t->draft->version = ++t->version;
+	t->draft->next = NULL;
+	old = atomic_exchange(&t->current, t->draft);
+	t->draft = NULL;
+	t->published++;
+
+	if (old != NULL) {
+		// Readers entering from the next epoch on can only see the new view
+		old->retired_epoch = atomic_fetch_add(&t->epoch, 1);
+		old->next = t->retired;
+		t->retired = old;
+	}
+	reclaim(t);
+	return 0;
+}
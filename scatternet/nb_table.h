@@ -0,0 +1,51 @@
+#ifndef NB_TABLE_H_
+#define NB_TABLE_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "nb_data.h"
+
+#define NB_TABLE_MAX_READERS 8
+
+/** One published version of the neighbour graph, never changed once published **/
+struct nb_view {
+	struct nb_data graph;
+	uint64_t version;
+	uint64_t retired_epoch;											// Writer only, epoch it was replaced in
+	struct nb_view *next;											// Writer only, retired or free list
+};
+
+/**
+ Versioned neighbour table with one writer and up to NB_TABLE_MAX_READERS
+ readers. The writer fills a draft and publishes it, which swaps the
+ current view pointer. Readers enter, use the view they got for as long
+ as they like and exit, all without locks or waiting on the writer. A
+ replaced view is only reused once every reader that could still hold it
+ has exited, tracked with epochs: a reader records the epoch it entered
+ in, and a view retired in epoch e can go once no reader is inside at an
+ epoch of e or earlier.
+**/
+struct nb_table {
+	_Atomic(struct nb_view *) current;
+	atomic_uint_fast64_t epoch;
+	atomic_uint_fast64_t reader_epoch[NB_TABLE_MAX_READERS];		// 0 while the reader is outside
+	atomic_int reader_used[NB_TABLE_MAX_READERS];
+	struct nb_view *draft;											// Writer only from here on
+	struct nb_view *retired;
+	struct nb_view *free;
+	uint64_t version;
+	unsigned long published;
+	unsigned long reclaimed;
+};
+
+void nb_table_init(struct nb_table *t);
+void nb_table_destroy(struct nb_table *t);
+int nb_table_register(struct nb_table *t);
+void nb_table_unregister(struct nb_table *t, int reader);
+const struct nb_view* nb_table_enter(struct nb_table *t, int reader);
+void nb_table_exit(struct nb_table *t, int reader);
+struct nb_data* nb_table_draft(struct nb_table *t);
+int nb_table_publish(struct nb_table *t);
+
+#endif
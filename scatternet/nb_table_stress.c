@@ -0,0 +1,142 @@
+/*
+Stress test for the epoch based neighbour table: reader threads enter and
+exit as fast as they can while the writer publishes a new graph each
+round. A reader checks the view it holds is whole and stays unchanged
+until it exits, which fails if a view is reused too early, and once the
+readers are gone every retired view must have been reclaimed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "bdaddr_key.h"
+#include "nb_data.h"
+#include "nb_table.h"
+
+#define READERS 4
+#define KEY_BASE 0x00AA00000000ULL
+#define TAG_BASE 0x00BB00000000ULL
+#define MAX_NODES 50												// A view of version v holds v % MAX_NODES + 1 nodes
+
+struct reader {
+	pthread_t thread;
+	int slot;
+	unsigned long reads;
+	unsigned long errors;
+};
+
+static struct nb_table table;
+static atomic_int stop;
+
+static uint32_t nodes_of(uint64_t version) {
+	return version % MAX_NODES + 1;
+}
+
+/** Number of ways the view differs from what the writer published as its version **/
+static unsigned long check_view(const struct nb_view *view, uint64_t version) {
+	unsigned long errors = 0;
+
+	if (view->version != version)
+		errors++;
+	if (view->graph.count != nodes_of(version))
+		errors++;
+	nb_data_foreach(&view->graph, entry) {
+		if (entry->nb_nb_count != 1 || !nb_has_nb_nb(entry, TAG_BASE + version))
+			errors++;
+	}
+	return errors;
+}
+
+static void* reader_main(void *arg) {
+	struct reader *r = arg;
+	const struct nb_view *view;
+	uint64_t version, last = 0;
+
+	while (!atomic_load(&stop)) {
+		view = nb_table_enter(&table, r->slot);
+		if (view != NULL) {
+			version = view->version;
+			if (version < last)
+				r->errors++;
+			last = version;
+			r->errors += check_view(view, version);
+			// Hold on to it for a while, the writer keeps publishing meanwhile
+			for (int i = 0; i < (int) (version % 4); i++)
+				r->errors += check_view(view, version);
+			r->reads++;
+		}
+		nb_table_exit(&table, r->slot);
+	}
+	return NULL;
+}
+
+static int list_length(const struct nb_view *view) {
+	int n = 0;
+
+	for (; view != NULL; view = view->next)
+		n++;
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long publishes = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	struct reader readers[READERS];
+	unsigned long reads = 0, errors = 0;
+	struct timespec start, end;
+	struct nb_data *draft;
+	int failed = 0;
+
+	if (publishes < 1)
+		publishes = 1;
+	nb_table_init(&table);
+	for (int i = 0; i < READERS; i++) {
+		readers[i].reads = readers[i].errors = 0;
+		if ((readers[i].slot = nb_table_register(&table)) < 0)
+			exit(1);
+		if (pthread_create(&readers[i].thread, NULL, reader_main, &readers[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (uint64_t v = 1; v <= publishes; v++) {
+		if ((draft = nb_table_draft(&table)) == NULL)
+			exit(1);
+		for (uint32_t k = 0; k < nodes_of(v); k++)
+			add_nb_nb(draft, KEY_BASE + k, TAG_BASE + v);
+		nb_table_publish(&table);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	atomic_store(&stop, 1);
+	for (int i = 0; i < READERS; i++) {
+		pthread_join(readers[i].thread, NULL);
+		nb_table_unregister(&table, readers[i].slot);
+		reads += readers[i].reads;
+		errors += readers[i].errors;
+	}
+
+	printf("%lu publishes in %.1f ms, %d readers made %lu reads\n", publishes,
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, READERS, reads);
+	printf("Views: %lu reclaimed, %d still retired, %d free for reuse\n",
+		table.reclaimed, list_length(table.retired), list_length(table.free));
+	if (errors > 0) {
+		fprintf(stderr, "Readers saw %lu changes in views they held\n", errors);
+		failed = 1;
+	}
+
+	// No reader is inside, so one more publish must reclaim every retired view
+	if ((draft = nb_table_draft(&table)) == NULL)
+		exit(1);
+	nb_table_publish(&table);
+	if (table.retired != NULL || table.reclaimed != table.published - 1) {
+		fprintf(stderr, "%lu of %lu retired views not reclaimed\n",
+			table.published - 1 - table.reclaimed, table.published - 1);
+		failed = 1;
+	}
+
+	nb_table_destroy(&table);
+	return failed;
+}
@@ -0,0 +1,859 @@
+/*
+Discrete event simulator for scatternet formation. Every node runs the
+real formation engine, the radio between them is emulated: beacons carry
+the neighbour set every SIM_BEACON_MS, delegation and done frames go out
+when the engine asks, and each copy reaches a node in range after the
+latency unless it is lost. See net_sim.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "net_sim.h"
+#include "link_quality.h"
+#include "bdaddr_key.h"
+
+#define KEY_MASK 0xFFFFFFFFFFFFULL									// 48-bit addresses
+
+static uint64_t mix(uint64_t x) {
+	x += 0x9E3779B97F4A7C15ULL;										// splitmix64
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t next_rand(uint64_t *state) {
+	*state += 0x9E3779B97F4A7C15ULL;
+	return mix(*state);
+}
+
+/** Uniform in [0, 1) **/
+static double rand_unit(uint64_t *state) {
+	return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void sim_config_default(struct sim_config *config) {
+	memset(config, 0, sizeof(*config));
+	config->topology = SIM_GEOMETRIC;
+	config->nodes = 100;
+	config->degree = 8;
+	config->latency_ms = 5;
+	config->jitter_ms = 5;
+	config->limit_ms = 600000;
+	config->seed = 1;
+	config->threads = 1;
+	formation_config_default(&config->formation);
+}
+
+//-----------------------------------------EVENT QUEUE--------------------
+
+static int event_before(const struct sim_event *a, const struct sim_event *b) {
+	if (a->time != b->time)
+		return a->time < b->time;
+	if (a->node != b->node)
+		return a->node < b->node;
+	if (a->origin != b->origin)
+		return a->origin < b->origin;
+	return a->seq < b->seq;
+}
+
+static int queue_grow(struct sim_queue *q) {
+	struct sim_event *events;
+	uint32_t capacity = q->capacity ? q->capacity * 2 : 1024;
+
+	events = realloc(q->events, capacity * sizeof(*events));
+	if (events == NULL) {
+		perror("sim queue");
+		return -1;
+	}
+	q->events = events;
+	q->capacity = capacity;
+	return 0;
+}
+
+/** Adds ev at the end, for outboxes which are not kept in order **/
+static int queue_append(struct sim_queue *q, const struct sim_event *ev) {
+	if (q->count == q->capacity && queue_grow(q) < 0)
+		return -1;
+	q->events[q->count++] = *ev;
+	return 0;
+}
+
+static int queue_push(struct sim_queue *q, const struct sim_event *ev) {
+	uint32_t i, parent;
+
+	if (q->count == q->capacity && queue_grow(q) < 0)
+		return -1;
+	for (i = q->count++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (!event_before(ev, &q->events[parent]))
+			break;
+		q->events[i] = q->events[parent];
+	}
+	q->events[i] = *ev;
+	return 0;
+}
+
+static void queue_pop(struct sim_queue *q, struct sim_event *out) {
+	struct sim_event last;
+	uint32_t i = 0, child;
+
+	*out = q->events[0];
+	last = q->events[--q->count];
+	while ((child = 2 * i + 1) < q->count) {
+		if (child + 1 < q->count && event_before(&q->events[child + 1], &q->events[child]))
+			child++;
+		if (!event_before(&q->events[child], &last))
+			break;
+		q->events[i] = q->events[child];
+		i = child;
+	}
+	q->events[i] = last;
+}
+
+//-----------------------------------------RADIO--------------------------
+
+static void release(struct sim_payload *p) {
+	if (p != NULL && atomic_fetch_sub(&p->refs, 1) == 1)
+		free(p);
+}
+
+/** Queues ev, caused by the node whose event is being handled, with the worker of the node it is for **/
+static void push(struct sim_part *part, struct sim_event *ev) {
+	struct sim *sim = part->sim;
+	struct sim_part *to = sim->nodes[ev->node].part;
+	int ret;
+
+	ev->origin = part->current - sim->nodes;
+	ev->seq = part->current->seq++;
+	if (to == part)
+		ret = queue_push(&part->queue, ev);
+	else
+		ret = queue_append(&part->outbox[to->index], ev);
+	if (ret < 0)
+		exit(1);
+}
+
+static void broadcast(struct sim_part *part, struct sim_node *node, uint8_t type, const uint64_t *addrs, int count) {
+	const struct sim_config *config = &part->sim->config;
+	struct sim_payload *p = malloc(sizeof(*p) + count * sizeof(uint64_t));
+	struct sim_event ev = { .type = SIM_RX };
+
+	if (p == NULL) {
+		perror("sim payload");
+		exit(1);
+	}
+	atomic_init(&p->refs, 1);										// Ours, until every copy is queued
+	p->version = node->beacon_version;
+	p->type = type;
+	p->count = count;
+	memcpy(p->addrs, addrs, count * sizeof(uint64_t));
+	ev.payload = p;
+	for (uint32_t i = 0; i < node->nmb_of_links; i++) {
+		if (rand_unit(&node->rng) < config->loss) {
+			part->stats.lost++;
+			continue;
+		}
+		ev.node = node->links[i].node;
+		ev.time = part->now_ms + config->latency_ms;
+		if (config->jitter_ms)
+			ev.time += next_rand(&node->rng) % (config->jitter_ms + 1);
+		atomic_fetch_add(&p->refs, 1);
+		push(part, &ev);
+	}
+	release(p);
+}
+
+static struct sim_link* find_link(struct sim *sim, struct sim_node *node, uint64_t key) {
+	for (uint32_t i = 0; i < node->nmb_of_links; i++) {
+		if (sim->nodes[node->links[i].node].key == key)
+			return &node->links[i];
+	}
+	return NULL;
+}
+
+//-----------------------------------------ENGINE OPS---------------------
+
+static void sim_advertise(void *ctx, uint8_t type, const uint64_t *addrs, int count) {
+	struct sim_node *node = ctx;
+	struct sim_part *part = node->part;
+
+	if (type == MESH_ADV_NEIGHBOURS) {								// Goes out with the next beacon
+		if (count > FORMATION_MAX_LINKS)
+			count = FORMATION_MAX_LINKS;
+		if (count != node->beacon_count || memcmp(node->beacon, addrs, count * sizeof(uint64_t)) != 0)
+			node->beacon_version++;
+		node->beacon_count = count;
+		memcpy(node->beacon, addrs, count * sizeof(uint64_t));
+		return;
+	}
+	if (type == MESH_ADV_DELEGATE)
+		part->stats.delegations++;
+	else if (type == MESH_ADV_CONNECT)
+		part->stats.confirmations++;
+	else
+		part->stats.done_frames++;
+	broadcast(part, node, type, addrs, count);
+}
+
+static void sim_connect(void *ctx, uint64_t peer) {
+	struct sim_node *node = ctx;
+	struct sim *sim = node->sim;
+	struct sim_part *part = node->part;
+	struct sim_link *link = find_link(sim, node, peer);
+	struct sim_event ev = { .node = node - sim->nodes, .peer = peer };
+
+	part->stats.connects++;
+	if (link == NULL || rand_unit(&node->rng) < sim->config.loss) {
+		part->stats.connect_failures++;
+		ev.type = SIM_CONNECT_FAILED;
+		ev.time = part->now_ms + SIM_CONNECT_TIMEOUT_MS;
+		push(part, &ev);
+		return;
+	}
+	ev.type = SIM_CONNECTED;
+	ev.time = part->now_ms + 2 * sim->config.latency_ms + SIM_CONNECT_MS;
+	push(part, &ev);
+	ev.type = SIM_ACCEPTED;											// The peer learns at the same moment
+	ev.node = link->node;
+	ev.peer = node->key;
+	push(part, &ev);
+}
+
+static void sim_set_timer(void *ctx, uint64_t at_ms) {
+	struct sim_node *node = ctx;
+	struct sim_part *part = node->part;
+	struct sim_event ev = { .type = SIM_TIMER, .node = node - node->sim->nodes, .peer = at_ms };
+
+	node->timer_ms = at_ms;
+	if (at_ms == 0)
+		return;
+	ev.time = at_ms > part->now_ms ? at_ms : part->now_ms;
+	push(part, &ev);													// Stale ones are dropped when they come up
+}
+
+static void sim_state_changed(void *ctx, StateType from, StateType to) {
+	struct sim_node *node = ctx;
+
+	if (to != DONE)
+		return;
+	node->done_ms = node->part->now_ms;
+	node->part->stats.done++;
+}
+
+static const struct formation_ops sim_ops = {
+	.advertise = sim_advertise,
+	.connect = sim_connect,
+	.set_timer = sim_set_timer,
+	.state_changed = sim_state_changed
+};
+
+//-----------------------------------------TOPOLOGY-----------------------
+
+static int add_radio_link(struct sim_node *node, uint32_t other, double d) {
+	struct sim_link *links;
+	uint32_t n = node->nmb_of_links;
+
+	if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {					// Full at 4, 8, 16 ...
+		links = realloc(node->links, (node->nmb_of_links ? node->nmb_of_links * 2 : 4) * sizeof(*links));
+		if (links == NULL) {
+			perror("sim links");
+			return -1;
+		}
+		node->links = links;
+	}
+	node->links[node->nmb_of_links].node = other;
+	node->links[node->nmb_of_links].rssi = -40.0 - 20.0 * log10(d > 0.1 ? d : 0.1);	// Free space from 1 m
+	node->nmb_of_links++;
+	return 0;
+}
+
+static int cell_of(double v, int cells) {
+	int c = (int) (v / SIM_RANGE_M);
+
+	return c < cells ? c : cells - 1;
+}
+
+/** Links every pair of nodes within SIM_RANGE_M, bucketing nodes in cells of that size **/
+static int link_in_range(struct sim *sim, double side) {
+	int cells = (int) ceil(side / SIM_RANGE_M), n = sim->config.nodes;
+	uint32_t *head, *next;
+	int cx, cy, x, y;
+
+	if (cells < 1)
+		cells = 1;
+	head = malloc((size_t) cells * cells * sizeof(*head));
+	next = malloc(n * sizeof(*next));
+	if (head == NULL || next == NULL) {
+		perror("sim cells");
+		free(head);
+		free(next);
+		return -1;
+	}
+	memset(head, 0xff, (size_t) cells * cells * sizeof(*head));
+	for (int i = n - 1; i >= 0; i--) {								// Cells list their nodes in order
+		cx = cell_of(sim->nodes[i].x, cells);
+		cy = cell_of(sim->nodes[i].y, cells);
+		next[i] = head[cy * cells + cx];
+		head[cy * cells + cx] = i;
+	}
+	for (int i = 0; i < n; i++) {
+		struct sim_node *a = &sim->nodes[i];
+		cx = cell_of(a->x, cells);
+		cy = cell_of(a->y, cells);
+		for (y = cy - 1; y <= cy + 1; y++) {
+			for (x = cx - 1; x <= cx + 1; x++) {
+				if (x < 0 || y < 0 || x >= cells || y >= cells)
+					continue;
+				for (uint32_t j = head[y * cells + x]; j != UINT32_MAX; j = next[j]) {
+					double d = hypot(a->x - sim->nodes[j].x, a->y - sim->nodes[j].y);
+					if ((int) j == i || d > SIM_RANGE_M)
+						continue;
+					if (add_radio_link(a, j, d) < 0)
+						goto failed;
+					if ((int) j > i)
+						sim->stats.radio_links++;
+				}
+			}
+		}
+	}
+	free(head);
+	free(next);
+	return 0;
+
+failed:
+	free(head);
+	free(next);
+	return -1;
+}
+
+static int place_nodes(struct sim *sim) {
+	uint64_t rng = sim->config.seed;
+	int n = sim->config.nodes, cols;
+	double side, spacing;
+
+	if (sim->config.topology == SIM_GRID) {
+		cols = (int) ceil(sqrt(n));
+		spacing = SIM_RANGE_M * 0.9;								// Diagonals are out of range
+		for (int i = 0; i < n; i++) {
+			sim->nodes[i].x = (i % cols) * spacing;
+			sim->nodes[i].y = (i / cols) * spacing;
+		}
+		side = cols * spacing;
+	} else {
+		side = sqrt(n * M_PI * SIM_RANGE_M * SIM_RANGE_M / sim->config.degree);
+		for (int i = 0; i < n; i++) {
+			sim->nodes[i].x = rand_unit(&rng) * side;
+			sim->nodes[i].y = rand_unit(&rng) * side;
+		}
+	}
+	return link_in_range(sim, side);
+}
+
+/** Random distinct addresses, so who is prey of whom varies with the seed **/
+static int assign_keys(struct sim *sim) {
+	struct nb_data used;
+	uint64_t rng = mix(sim->config.seed ^ 0x6B6579735F736565ULL), key;
+	int ret = 0;
+
+	nb_data_init(&used);
+	used.quiet = 1;
+	for (int i = 0; i < sim->config.nodes; i++) {
+		do {
+			key = next_rand(&rng) & KEY_MASK;
+		} while (key == BDADDR_KEY_NONE || nb_find(&used, key) != NULL);
+		if (add_nb(&used, key) == NULL) {
+			ret = -1;
+			break;
+		}
+		sim->nodes[i].key = key;
+	}
+	nb_data_free(&used);
+	return ret;
+}
+
+struct sim_order {
+	double x;
+	uint32_t node;
+};
+
+static int compare_order(const void *a, const void *b) {
+	const struct sim_order *p = a, *q = b;
+
+	if (p->x != q->x)
+		return p->x < q->x ? -1 : 1;
+	return p->node < q->node ? -1 : p->node > q->node;
+}
+
+/** Shares the nodes out to the workers in strips across the area, most frames then stay with one worker **/
+static int assign_parts(struct sim *sim) {
+	uint32_t n = sim->config.nodes, parts = sim->nmb_of_parts;
+	struct sim_order *order = malloc(n * sizeof(*order));
+
+	if (order == NULL) {
+		perror("sim parts");
+		return -1;
+	}
+	for (uint32_t i = 0; i < n; i++)
+		order[i] = (struct sim_order) { .x = sim->nodes[i].x, .node = i };
+	qsort(order, n, sizeof(*order), compare_order);
+	for (uint32_t k = 0; k < n; k++)
+		sim->nodes[order[k].node].part = &sim->parts[(uint64_t) k * parts / n];
+	free(order);
+	return 0;
+}
+
+//-----------------------------------------SIMULATION---------------------
+
+int sim_init(struct sim *sim, const struct sim_config *config) {
+	memset(sim, 0, sizeof(*sim));
+	sim->config = *config;
+	if (config->latency_ms < 1) {									// Workers could not go ahead of each other at all
+		fprintf(stderr, "Radio latency must be at least 1 ms\n");
+		return -1;
+	}
+	sim->nmb_of_parts = config->threads < 1 ? 1 : config->threads;
+	if (sim->nmb_of_parts > config->nodes)
+		sim->nmb_of_parts = config->nodes;
+	sim->nodes = calloc(config->nodes, sizeof(*sim->nodes));
+	sim->parts = calloc(sim->nmb_of_parts, sizeof(*sim->parts));
+	if (sim->nodes == NULL || sim->parts == NULL) {
+		perror("sim nodes");
+		return -1;
+	}
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		struct sim_part *part = &sim->parts[k];
+		part->sim = sim;
+		part->index = k;
+		part->outbox = calloc(sim->nmb_of_parts, sizeof(*part->outbox));
+		if (part->outbox == NULL) {
+			perror("sim outbox");
+			return -1;
+		}
+	}
+	if (pthread_barrier_init(&sim->barrier, NULL, sim->nmb_of_parts) != 0) {
+		perror("sim barrier");
+		return -1;
+	}
+	if (place_nodes(sim) < 0 || assign_keys(sim) < 0 || assign_parts(sim) < 0)
+		return -1;
+	for (int i = 0; i < config->nodes; i++) {
+		struct sim_node *node = &sim->nodes[i];
+		node->sim = sim;
+		node->rng = mix(config->seed + (uint64_t) i * 0xD1B54A32D192ED03ULL);
+		nb_data_init(&node->heard);
+		node->heard.quiet = 1;
+		node->beacon_version = 1;									// Links start at 0, never heard
+		formation_init(&node->engine, node->key, &config->formation, &sim_ops, node);
+	}
+	return 0;
+}
+
+static void receive(struct sim_part *part, struct sim_node *node, const struct sim_event *ev) {
+	struct sim *sim = part->sim;
+	struct sim_node *from = &sim->nodes[ev->origin];
+	const struct sim_payload *p = ev->payload;
+	struct formation_event fev = { .type = FORM_EV_FRAME, .peer = from->key };
+	struct sim_link *link;
+	struct nb_entry *entry;
+	struct mesh_adv msg;
+	int changed = 0;
+
+	part->stats.deliveries++;
+	if (p->type != MESH_ADV_NEIGHBOURS) {
+		memset(&msg, 0, sizeof(msg));
+		msg.type = p->type;
+		msg.count = p->count < MESH_ADV_EXT_MAX_ADDRS ? p->count : MESH_ADV_EXT_MAX_ADDRS;
+		memcpy(msg.addrs, p->addrs, msg.count * sizeof(uint64_t));
+		fev.msg = &msg;
+		formation_handle(&node->engine, part->now_ms, &fev);
+		return;
+	}
+
+	// A set already taken in is skipped, as the scanner does with digests
+	link = find_link(sim, node, from->key);
+	if (link != NULL && link->heard_version == p->version)
+		return;
+	if (link != NULL)
+		link->heard_version = p->version;
+	if (nb_find(&node->heard, from->key) == NULL) {
+		if ((entry = add_nb(&node->heard, from->key)) == NULL)
+			exit(1);
+		entry->rssi_mean = link ? link->rssi : LQ_RSSI_FLOOR;
+		changed = 1;
+	}
+	for (int i = 0; i < p->count; i++)
+		changed |= add_nb_nb(&node->heard, from->key, p->addrs[i]) == 1;
+	if (changed && !node->publish_due) {							// Like the scan pipeline, publish in batches
+		struct sim_event publish = { .type = SIM_PUBLISH, .node = ev->node, .time = part->now_ms + SIM_PUBLISH_MS };
+		node->publish_due = 1;
+		push(part, &publish);
+	}
+}
+
+/** Stops the run if the engine made more connections than its capacity allows **/
+static void check_capacity(const struct sim_node *node) {
+	const struct formation *f = &node->engine;
+	char addr[18];
+
+	if (f->capacity >= 0 && formation_piconet_size(f) - 1 <= f->config.capacity)
+		return;
+	fprintf(stderr, "%s made %d connections, capacity %d, %d left\n", key_to_str(node->key, addr),
+		formation_piconet_size(f) - 1, f->config.capacity, f->capacity);
+	abort();
+}
+
+static void handle(struct sim_part *part, struct sim_event *ev) {
+	struct sim_node *node = &part->sim->nodes[ev->node];
+	struct formation_event fev = { .peer = ev->peer };
+	struct sim_event beacon = { .type = SIM_BEACON, .node = ev->node };
+
+	part->now_ms = ev->time;
+	part->current = node;
+	part->stats.events++;
+	switch (ev->type) {
+	case SIM_BEACON:
+		part->stats.beacons++;
+		broadcast(part, node, MESH_ADV_NEIGHBOURS, node->beacon, node->beacon_count);
+		beacon.time = part->now_ms + SIM_BEACON_MS + next_rand(&node->rng) % (SIM_BEACON_JITTER_MS + 1);
+		push(part, &beacon);
+		return;
+	case SIM_RX:
+		receive(part, node, ev);
+		release(ev->payload);
+		check_capacity(node);
+		return;
+	case SIM_PUBLISH:
+		node->publish_due = 0;
+		fev.type = FORM_EV_GRAPH;
+		fev.graph = &node->heard;
+		break;
+	case SIM_TIMER:
+		if (node->timer_ms != ev->peer)
+			return;
+		node->timer_ms = 0;
+		fev.type = FORM_EV_TIMER;
+		break;
+	case SIM_CONNECTED:
+		fev.type = FORM_EV_CONNECTED;
+		break;
+	case SIM_CONNECT_FAILED:
+		fev.type = FORM_EV_CONNECT_FAILED;
+		break;
+	case SIM_ACCEPTED:
+		fev.type = FORM_EV_ACCEPTED;
+		break;
+	}
+	formation_handle(&node->engine, part->now_ms, &fev);
+	check_capacity(node);
+}
+
+/** Takes in what the other workers queued for part's nodes, and notes where part stands **/
+static void collect(struct sim_part *part) {
+	struct sim *sim = part->sim;
+
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		struct sim_queue *out = &sim->parts[k].outbox[part->index];
+		for (uint32_t i = 0; i < out->count; i++) {
+			if (queue_push(&part->queue, &out->events[i]) < 0)
+				exit(1);
+		}
+		out->count = 0;
+	}
+	part->next_ms = part->queue.count > 0 ? part->queue.events[0].time : UINT64_MAX;
+	part->done = part->stats.done;
+}
+
+/**
+ Every worker works out the next window from where all of them stand, so
+ they agree on it without talking. Returns 0 once the run is over.
+**/
+static int next_window(const struct sim *sim, uint64_t *end_ms) {
+	uint64_t start_ms = UINT64_MAX;
+	uint32_t done = 0;
+
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		if (sim->parts[k].next_ms < start_ms)
+			start_ms = sim->parts[k].next_ms;
+		done += sim->parts[k].done;
+	}
+	if (done == (uint32_t) sim->config.nodes || start_ms == UINT64_MAX || start_ms > sim->config.limit_ms)
+		return 0;
+	*end_ms = start_ms + sim->config.latency_ms;					// Nothing from another node arrives sooner
+	return 1;
+}
+
+static void* part_main(void *arg) {
+	struct sim_part *part = arg;
+	struct sim *sim = part->sim;
+	struct sim_queue *q = &part->queue;
+	struct sim_event ev;
+	uint64_t end_ms;
+
+	while (next_window(sim, &end_ms)) {
+		while (q->count > 0 && q->events[0].time < end_ms && q->events[0].time <= sim->config.limit_ms) {
+			queue_pop(q, &ev);
+			handle(part, &ev);
+		}
+		pthread_barrier_wait(&sim->barrier);						// Every outbox is complete
+		collect(part);
+		pthread_barrier_wait(&sim->barrier);						// Every worker has taken in its events
+	}
+	return NULL;
+}
+
+static void add_stats(struct sim_stats *total, const struct sim_stats *part) {
+	total->done += part->done;
+	total->events += part->events;
+	total->beacons += part->beacons;
+	total->delegations += part->delegations;
+	total->confirmations += part->confirmations;
+	total->done_frames += part->done_frames;
+	total->deliveries += part->deliveries;
+	total->lost += part->lost;
+	total->connects += part->connects;
+	total->connect_failures += part->connect_failures;
+}
+
+/** Runs until every node is done, or config.limit_ms of simulated time went by **/
+void sim_run(struct sim *sim) {
+	struct formation_event start = { .type = FORM_EV_START };
+	struct sim_event ev;
+
+	for (int i = 0; i < sim->config.nodes; i++) {
+		struct sim_node *node = &sim->nodes[i];
+		node->part->current = node;
+		formation_handle(&node->engine, 0, &start);
+		ev = (struct sim_event) { .type = SIM_BEACON, .node = i, .time = next_rand(&node->rng) % SIM_BEACON_MS };
+		push(node->part, &ev);
+	}
+	for (int k = 0; k < sim->nmb_of_parts; k++)
+		collect(&sim->parts[k]);
+
+	for (int k = 1; k < sim->nmb_of_parts; k++) {
+		if (pthread_create(&sim->parts[k].thread, NULL, part_main, &sim->parts[k]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	part_main(&sim->parts[0]);
+	for (int k = 1; k < sim->nmb_of_parts; k++)
+		pthread_join(sim->parts[k].thread, NULL);
+
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		add_stats(&sim->stats, &sim->parts[k].stats);
+		if (sim->parts[k].now_ms > sim->now_ms)
+			sim->now_ms = sim->parts[k].now_ms;
+	}
+	if (sim->stats.done == (uint32_t) sim->config.nodes) {
+		for (int i = 0; i < sim->config.nodes; i++) {
+			if (sim->nodes[i].done_ms > sim->stats.converged_ms)
+				sim->stats.converged_ms = sim->nodes[i].done_ms;
+		}
+	}
+}
+
+//-----------------------------------------METRICS------------------------
+
+static int compare_keys(const void *a, const void *b) {
+	const uint64_t *x = a, *y = b;
+	return *x < *y ? -1 : *x > *y;
+}
+
+/** BFS from start over the formed links, returns the farthest distance and fills dist **/
+static uint32_t bfs(const uint32_t *offset, const uint32_t *adj, uint32_t start, uint32_t *dist, uint32_t *fifo, uint32_t *reached) {
+	uint32_t head = 0, tail = 0, far = 0, v;
+
+	dist[start] = 0;
+	fifo[tail++] = start;
+	while (head < tail) {
+		v = fifo[head++];
+		far = dist[v];
+		for (uint32_t e = offset[v]; e < offset[v + 1]; e++) {
+			if (dist[adj[e]] == UINT32_MAX) {
+				dist[adj[e]] = dist[v] + 1;
+				fifo[tail++] = adj[e];
+			}
+		}
+	}
+	*reached = tail;
+	return far;
+}
+
+/** Components of the radio graph, seen and fifo are scratch space for n nodes **/
+static uint32_t radio_components(const struct sim *sim, uint32_t *seen, uint32_t *fifo) {
+	uint32_t n = sim->config.nodes, components = 0, head, tail, v;
+
+	memset(seen, 0, n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		if (seen[i])
+			continue;
+		components++;
+		seen[i] = 1;
+		head = tail = 0;
+		fifo[tail++] = i;
+		while (head < tail) {
+			v = fifo[head++];
+			for (uint32_t l = 0; l < sim->nodes[v].nmb_of_links; l++) {
+				uint32_t w = sim->nodes[v].links[l].node;
+				if (!seen[w]) {
+					seen[w] = 1;
+					fifo[tail++] = w;
+				}
+			}
+		}
+	}
+	return components;
+}
+
+/** BFS from each of a share of the largest component's nodes, one worker per share **/
+struct diameter_job {
+	const uint32_t *offset, *adj, *starts;
+	uint32_t n, nmb_of_starts;
+	uint32_t far;
+	pthread_t thread;
+};
+
+static void* diameter_main(void *arg) {
+	struct diameter_job *job = arg;
+	uint32_t *dist = malloc(job->n * sizeof(uint32_t)), *fifo = malloc(job->n * sizeof(uint32_t));
+	uint32_t far, reached;
+
+	if (dist == NULL || fifo == NULL) {
+		perror("sim diameter");
+		exit(1);
+	}
+	for (uint32_t k = 0; k < job->nmb_of_starts; k++) {
+		memset(dist, 0xff, job->n * sizeof(uint32_t));
+		far = bfs(job->offset, job->adj, job->starts[k], dist, fifo, &reached);
+		if (far > job->far)
+			job->far = far;
+	}
+	free(dist);
+	free(fifo);
+	return NULL;
+}
+
+/**
+ Piconet sizes, and the components and diameter of the scatternet the
+ formed links make up. The diameter is exact, a BFS from every node of
+ the largest component, shared out to as many threads as simulated.
+**/
+void sim_measure(struct sim *sim) {
+	uint32_t n = sim->config.nodes, edges = 0, reached, largest_start = 0;
+	uint64_t *sorted = malloc(n * 2 * sizeof(uint64_t));
+	uint32_t *offset = calloc(n + 1, sizeof(uint32_t)), *adj, *dist, *fifo, *fill;
+	struct sim_stats *st = &sim->stats;
+	struct diameter_job jobs[sim->nmb_of_parts];
+
+	if (sorted == NULL || offset == NULL) {
+		perror("sim measure");
+		exit(1);
+	}
+	st->piconets = st->largest_piconet = 0;
+	memset(st->piconet_sizes, 0, sizeof(st->piconet_sizes));
+	for (uint32_t i = 0; i < n; i++) {
+		int size = formation_piconet_size(&sim->nodes[i].engine);
+		if (size > 1) {
+			st->piconets++;
+			st->piconet_sizes[size < SIM_MAX_PICONET ? size : SIM_MAX_PICONET]++;
+			if ((uint32_t) size > st->largest_piconet)
+				st->largest_piconet = size;
+		}
+		sorted[2 * i] = sim->nodes[i].key;							// Key to node number
+		sorted[2 * i + 1] = i;
+		edges += sim->nodes[i].engine.nmb_of_links;
+	}
+	qsort(sorted, n, 2 * sizeof(uint64_t), compare_keys);
+
+	adj = malloc((edges + 1) * sizeof(uint32_t));
+	dist = malloc(n * sizeof(uint32_t));
+	fifo = malloc(n * sizeof(uint32_t));
+	fill = calloc(n, sizeof(uint32_t));
+	if (adj == NULL || dist == NULL || fifo == NULL || fill == NULL) {
+		perror("sim measure");
+		exit(1);
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		const struct formation *f = &sim->nodes[i].engine;
+		for (int l = 0; l < f->nmb_of_links; l++) {
+			uint64_t *hit = bsearch(&f->links[l], sorted, n, 2 * sizeof(uint64_t), compare_keys);
+			if (hit != NULL)
+				adj[offset[i] + fill[i]++] = hit[1];
+		}
+		offset[i + 1] = offset[i] + fill[i];
+	}
+
+	st->components = st->largest_component = 0;
+	memset(dist, 0xff, n * sizeof(uint32_t));
+	for (uint32_t i = 0; i < n; i++) {
+		if (dist[i] != UINT32_MAX)
+			continue;
+		bfs(offset, adj, i, dist, fifo, &reached);
+		st->components++;
+		if (reached > st->largest_component) {
+			st->largest_component = reached;
+			largest_start = i;
+		}
+	}
+
+	st->radio_components = radio_components(sim, dist, fifo);
+
+	st->diameter = 0;
+	memset(dist, 0xff, n * sizeof(uint32_t));
+	bfs(offset, adj, largest_start, dist, fifo, &reached);
+	memcpy(fill, fifo, reached * sizeof(uint32_t));					// The largest component's nodes
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		uint32_t first = (uint64_t) k * reached / sim->nmb_of_parts;
+		uint32_t last = (uint64_t) (k + 1) * reached / sim->nmb_of_parts;
+		jobs[k] = (struct diameter_job) { .offset = offset, .adj = adj, .starts = fill + first,
+			.n = n, .nmb_of_starts = last - first };
+		if (k > 0 && pthread_create(&jobs[k].thread, NULL, diameter_main, &jobs[k]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	diameter_main(&jobs[0]);
+	for (int k = 0; k < sim->nmb_of_parts; k++) {
+		if (k > 0)
+			pthread_join(jobs[k].thread, NULL);
+		if (jobs[k].far > st->diameter)
+			st->diameter = jobs[k].far;
+	}
+
+	free(sorted);
+	free(offset);
+	free(adj);
+	free(dist);
+	free(fifo);
+	free(fill);
+}
+
+static void drain(struct sim_queue *q) {
+	for (uint32_t i = 0; i < q->count; i++) {
+		if (q->events[i].type == SIM_RX)
+			release(q->events[i].payload);
+	}
+	free(q->events);
+}
+
+void sim_free(struct sim *sim) {
+	for (int k = 0; sim->parts != NULL && k < sim->nmb_of_parts; k++) {
+		drain(&sim->parts[k].queue);
+		for (int j = 0; sim->parts[k].outbox != NULL && j < sim->nmb_of_parts; j++)
+			drain(&sim->parts[k].outbox[j]);
+		free(sim->parts[k].outbox);
+	}
+	if (sim->parts != NULL)
+		pthread_barrier_destroy(&sim->barrier);
+	free(sim->parts);
+	sim->parts = NULL;
+	for (int i = 0; sim->nodes != NULL && i < sim->config.nodes; i++) {
+		formation_free(&sim->nodes[i].engine);
+		nb_data_free(&sim->nodes[i].heard);
+		free(sim->nodes[i].links);
+	}
+	free(sim->nodes);
+	sim->nodes = NULL;
+}
@@ -0,0 +1,174 @@
+#ifndef NET_SIM_H_
+#define NET_SIM_H_
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "formation.h"
+
+#define SIM_BEACON_MS 500											// ADV_PERIOD_MS of a real node
+#define SIM_BEACON_JITTER_MS 10										// advDelay, keeps beacons from lining up
+#define SIM_PUBLISH_MS 100											// NB_PUBLISH_MS of the scan pipeline
+#define SIM_CONNECT_MS 30											// Connection setup on top of the latency
+#define SIM_CONNECT_TIMEOUT_MS 1000
+#define SIM_RANGE_M 10.0
+#define SIM_MAX_PICONET 16											// Largest piconet size counted one by one
+
+enum sim_topology {
+	SIM_GEOMETRIC,													// Uniform in a square, linked within range
+	SIM_GRID														// Square grid, linked to the four next to it
+};
+
+struct sim_config {
+	enum sim_topology topology;
+	int nodes;
+	double degree;													// SIM_GEOMETRIC: mean degree the square is sized for
+	double loss;													// Chance a frame or connection attempt is lost
+	unsigned int latency_ms;										// Every frame takes this long, at least 1 ms
+	unsigned int jitter_ms;											// plus up to this much
+	unsigned int limit_ms;											// Give up after this much simulated time
+	uint64_t seed;
+	int threads;													// Workers the nodes are shared out to
+	struct formation_config formation;
+};
+
+/** A transmission, shared by every receiver of it **/
+struct sim_payload {
+	atomic_int refs;												// Receivers may be on other workers
+	uint32_t version;												// Beacons: of the sender's neighbour set
+	uint8_t type;
+	uint8_t count;
+	uint64_t addrs[];
+};
+
+enum sim_event_type {
+	SIM_BEACON,														// Time for node to advertise its neighbours
+	SIM_RX,															// payload from origin reaches node
+	SIM_PUBLISH,													// Hand what node heard to its engine
+	SIM_TIMER,
+	SIM_CONNECTED,
+	SIM_CONNECT_FAILED,
+	SIM_ACCEPTED
+};
+
+/**
+ Events are ordered by time, then by the node they are for, then by the
+ node that caused them and the number of that cause. The order therefore
+ depends only on what each node did, never on how the queue was filled.
+**/
+struct sim_event {
+	uint64_t time;
+	uint32_t node;
+	uint32_t origin;
+	uint64_t seq;													// Of origin
+	uint8_t type;
+	uint64_t peer;													// Key for connection events, timer time for SIM_TIMER
+	struct sim_payload *payload;
+};
+
+/** Binary min heap of events **/
+struct sim_queue {
+	struct sim_event *events;
+	uint32_t count;
+	uint32_t capacity;
+};
+
+struct sim_link {
+	uint32_t node;
+	float rssi;
+	uint32_t heard_version;											// Last beacon version taken in from node
+};
+
+struct sim;
+struct sim_part;
+
+struct sim_node {
+	struct sim *sim;
+	struct sim_part *part;											// Worker simulating the node
+	uint64_t key;
+	double x, y;
+	struct sim_link *links;											// Radio neighbours
+	uint32_t nmb_of_links;
+	struct formation engine;
+	struct nb_data heard;											// What the scanner would have built
+	uint64_t beacon[FORMATION_MAX_LINKS];							// Neighbour set being advertised
+	int beacon_count;
+	uint32_t beacon_version;										// Bumped whenever the set changes
+	int publish_due;												// heard changed, a SIM_PUBLISH is queued
+	uint64_t timer_ms;												// Engine wakeup asked for, 0 for none
+	uint64_t seq;
+	uint64_t rng;
+	uint64_t done_ms;												// 0 until DONE
+};
+
+struct sim_stats {
+	uint64_t converged_ms;											// Last node done, 0 if not all were
+	uint32_t done;
+	unsigned long events;
+	unsigned long beacons;
+	unsigned long delegations;
+	unsigned long confirmations;									// Delegates answering
+	unsigned long done_frames;
+	unsigned long deliveries;
+	unsigned long lost;
+	unsigned long connects;
+	unsigned long connect_failures;
+	uint32_t piconets;
+	uint32_t piconet_sizes[SIM_MAX_PICONET + 1];					// The last counts that size and up
+	uint32_t largest_piconet;
+	uint32_t radio_components;										// Of the radio graph, the best formation can do
+	uint32_t components;
+	uint32_t largest_component;
+	uint32_t diameter;												// Of the largest component, in hops
+	unsigned long radio_links;
+};
+
+/**
+ The nodes of one worker, a strip of the area, and everything it changes
+ while simulating them. Events for nodes of other workers go to the
+ outbox for that worker, which takes them in at the end of the window.
+**/
+struct sim_part {
+	struct sim *sim;
+	int index;
+	pthread_t thread;
+	struct sim_queue queue;
+	struct sim_queue *outbox;										// One per worker, unordered
+	uint64_t now_ms;
+	struct sim_node *current;										// Node whose event is being handled
+	struct sim_stats stats;											// Counters of this worker's nodes only
+	uint64_t next_ms;												// Earliest event queued, set between windows
+	uint32_t done;													// stats.done as of then
+};
+
+/**
+ Discrete event simulation of a scatternet forming: every node runs the
+ formation engine of formation.c, over a radio where frames reach the
+ nodes in range after a latency, or get lost. Simulated time only moves
+ from one event to the next, so it runs far faster than real time.
+
+ The nodes are shared out to config.threads workers, which go through
+ simulated time in windows of latency_ms: nothing a node does reaches
+ another node sooner than that, so within a window every worker can
+ handle its own events without waiting for the others. A node sees the
+ same events in the same order however the nodes are shared out, so a
+ seed gives the same result with any number of workers.
+**/
+struct sim {
+	struct sim_config config;
+	struct sim_node *nodes;
+	struct sim_part *parts;
+	int nmb_of_parts;
+	pthread_barrier_t barrier;
+	uint64_t now_ms;												// Last event handled, once sim_run returned
+	struct sim_stats stats;
+};
+
+int sim_init(struct sim *sim, const struct sim_config *config);
+void sim_run(struct sim *sim);
+void sim_measure(struct sim *sim);
+void sim_free(struct sim *sim);
+void sim_config_default(struct sim_config *config);
+
+#endif
@@ -0,0 +1,81 @@
+/*
+Single-producer/single-consumer ring buffer between the HCI reader thread
+and the thread that builds the neighbour list.
+*/
+#include <string.h>
+
+#include "report_ring.h"
+
+#define RING_MASK (REPORT_RING_SLOTS - 1)
+
+void report_ring_init(struct report_ring *ring) {
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->overruns, 0);
+	atomic_init(&ring->high_water, 0);
+}
+
+/**
+ Copies the report info (with its AD data and trailing RSSI byte) into the
+ next free slot. Producer side only. Returns 0, or -1 if the ring is full
+ or the report is too long for a slot.
+**/
+int report_ring_push(struct report_ring *ring, const le_advertising_info *info) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t len = LE_ADVERTISING_INFO_SIZE + info->length + 1;
+	size_t used = head - tail;
+	struct ring_report *slot;
+
+	if (used == REPORT_RING_SLOTS || len > REPORT_MAX_SIZE) {
+		atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+		return -1;
+	}
+
+	slot = &ring->slots[head & RING_MASK];
+	slot->len = len;
+	memcpy(slot->data, info, len);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	if (used + 1 > atomic_load_explicit(&ring->high_water, memory_order_relaxed))
+		atomic_store_explicit(&ring->high_water, used + 1, memory_order_relaxed);
+	return 0;
+}
+
+/**
+ Returns the oldest queued report without removing it, or NULL if the ring
+ is empty. Consumer side only, the slot stays valid until
+ report_ring_release().
+**/
+struct ring_report* report_ring_peek(struct report_ring *ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+	return &ring->slots[tail & RING_MASK];
+}
+
+/** Frees the slot returned by the last report_ring_peek() **/
+void report_ring_release(struct report_ring *ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+/** Number of reports currently queued **/
+size_t report_ring_occupancy(struct report_ring *ring) {
+	return atomic_load_explicit(&ring->head, memory_order_acquire) -
+		atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+/** Reports dropped because the ring was full **/
+unsigned long report_ring_overruns(struct report_ring *ring) {
+	return atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+}
+
+/** Highest occupancy seen since report_ring_init() **/
+unsigned long report_ring_high_water(struct report_ring *ring) {
+	return atomic_load_explicit(&ring->high_water, memory_order_relaxed);
+}
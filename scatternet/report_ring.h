@@ -0,0 +1,44 @@
+#ifndef REPORT_RING_H_
+#define REPORT_RING_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+#include "adv_report.h"
+
+#define REPORT_RING_SLOTS 256										// Must be a power of two
+#define REPORT_MAX_SIZE (LE_ADVERTISING_INFO_SIZE + ADV_REPORT_MAX_DATA + 1)	// Header, AD data and RSSI
+
+/** One raw advertising report: le_advertising_info, AD data, RSSI byte **/
+struct ring_report {
+	uint8_t len;
+	uint8_t data[REPORT_MAX_SIZE];
+};
+
+/**
+ Lock-free single-producer/single-consumer ring of raw advertising
+ reports. The HCI reader pushes, the neighbour processing pops. head is
+ only written by the producer and tail only by the consumer, each on its
+ own cache line. A full ring drops the new report and counts an overrun.
+**/
+struct report_ring {
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+	_Alignas(64) atomic_ulong overruns;
+	atomic_ulong high_water;
+	struct ring_report slots[REPORT_RING_SLOTS];
+};
+
+void report_ring_init(struct report_ring *ring);
+int report_ring_push(struct report_ring *ring, const le_advertising_info *info);
+struct ring_report* report_ring_peek(struct report_ring *ring);
+void report_ring_release(struct report_ring *ring);
+size_t report_ring_occupancy(struct report_ring *ring);
+unsigned long report_ring_overruns(struct report_ring *ring);
+unsigned long report_ring_high_water(struct report_ring *ring);
+
+#endif
@@ -8,10 +8,14 @@
 #include <getopt.h>
 #include <signal.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
@@ -20,60 +24,35 @@
 
 #include "ll.h"
 #include "structs.h"
+#include "bdaddr_key.h"
+#include "ad_parser.h"
 #include "nb_data.h"
-
-#define FLAGS_AD_TYPE 0x01
-#define FLAGS_LIMITED_MODE_BIT 0x01
-#define FLAGS_GENERAL_MODE_BIT 0x02
-
-#define EIR_FLAGS                   0x01  /* flags */
-#define EIR_UUID16_SOME             0x02  /* 16-bit UUID, more available */
-#define EIR_UUID16_ALL              0x03  /* 16-bit UUID, all listed */
-#define EIR_UUID32_SOME             0x04  /* 32-bit UUID, more available */
-#define EIR_UUID32_ALL              0x05  /* 32-bit UUID, all listed */
-#define EIR_UUID128_SOME            0x06  /* 128-bit UUID, more available */
-#define EIR_UUID128_ALL             0x07  /* 128-bit UUID, all listed */
-#define EIR_NAME_SHORT              0x08  /* shortened local name */
-#define EIR_NAME_COMPLETE           0x09  /* complete local name */
-#define EIR_TX_POWER                0x0A  /* transmit power level */
-#define EIR_DEVICE_ID               0x10  /* device ID */
-
-
+#include "nb_table.h"
+#include "scan_session.h"
+#include "adv_report.h"
+#include "hci_source.h"
+#include "hci_loop.h"
+#include "report_ring.h"
+#include "dup_cache.h"
+#include "link_quality.h"
+#include "advertiser.h"
+#include "ctrl_sim.h"
+#include "mesh_adv.h"
+#include "nb_digest.h"
+#include "adv_scheduler.h"
+#include "adv_policy.h"
+#include "scan_adv.h"
 
 // Functions for advertise
 
-int advertise();
+int advertise(uint8_t type, const uint64_t *addrs, int count);
 
-struct hci_request ble_hci_request(uint16_t ocf, int clen, void * status, void * cparam)
-{
-	struct hci_request rq;
-	memset(&rq, 0, sizeof(rq));
-	rq.ogf = OGF_LE_CTL;
-	rq.ocf = ocf;
-	rq.cparam = cparam;
-	rq.clen = clen;
-	rq.rparam = status;
-	rq.rlen = 1;
-	return rq;
-}
-
-le_set_advertising_data_cp ble_hci_params_for_set_adv_data(char * name, char * btaddr)
+le_set_advertising_data_cp ble_hci_params_for_mesh_adv(const struct mesh_adv *msg)
 {
-	int name_len = strlen(name);
-
 	le_set_advertising_data_cp adv_data_cp;
 	memset(&adv_data_cp, 0, sizeof(adv_data_cp));
 
-	adv_data_cp.data[0] = 0x02; // Length.
-	adv_data_cp.data[1] = 0x01; // Flags field.
-	adv_data_cp.data[2] = 0x01; // LE Limited Discoverable Flag set
-
-	adv_data_cp.data[3] = name_len + 1; // Length.
-	adv_data_cp.data[4] = 0x09; // Name field.
-	memcpy(adv_data_cp.data + 5, name, name_len);
-	memcpy(adv_data_cp.data + 5 + name_len, btaddr, strlen(btaddr));
-
-	adv_data_cp.length = strlen(adv_data_cp.data);
+	adv_data_cp.length = mesh_adv_encode(msg, adv_data_cp.data, sizeof(adv_data_cp.data));
 
 	return adv_data_cp;
 }
@@ -87,398 +66,827 @@ static void sigint_handler(int sig)
 	signal_received = sig;
 }
 
-static void eir_parse_name(uint8_t *eir, size_t eir_len,
-						char *buf, size_t buf_len)
+static int check_report_filter(uint8_t procedure, const struct ad_fields *ad)
 {
-	size_t offset;
+	uint8_t flags = ad->flags;
+
+	/* If no discovery procedure is set, all reports are treat as valid */
+	if (procedure == 0)
+		return 1;
 
-	offset = 0;
-	while (offset < eir_len) {
-		uint8_t field_len = eir[0];
-		size_t name_len;
+	/* Flags AD type value from the advertising report if it exists */
+	if (!ad->has_flags)
+		return 0;
 
-		/* Check for the end of EIR */
-		if (field_len == 0)
-			break;
+	switch (procedure) {
+	case 'l': /* Limited Discovery Procedure */
+		if (flags & FLAGS_LIMITED_MODE_BIT)
+			return 1;
+		break;
+	case 'g': /* General Discovery Procedure */
+		if (flags & (FLAGS_LIMITED_MODE_BIT | FLAGS_GENERAL_MODE_BIT))
+			return 1;
+		break;
+	default:
+		fprintf(stderr, "Unknown discovery procedure\n");
+	}
+
+	return 0;
+}
 
-		if (offset + field_len > eir_len)
-			goto failed;
 
-		switch (eir[1]) {
-		case EIR_NAME_SHORT:
-		case EIR_NAME_COMPLETE:
-			name_len = field_len - 1;
-			if (name_len > buf_len)
-				goto failed;
+/*
+Scanning runs as a pipeline. The reader thread drives the HCI event loop and
+only copies raw reports into the ring, so the kernel socket queue is always
+drained promptly. The consumer thread parses the reports and builds the
+pending neighbour list, which print_advertising_devices() hands over to the
+caller once per window. The reader takes its events from an hci_source, so
+the same pipeline can run on a btsnoop trace without an adapter.
+*/
+static struct scan_session session = { .dd = -1 };
+static struct hci_source source = { .fd = -1, .trace_fd = -1, .peer_fd = -1 };
+static enum hci_source_mode source_mode = HCI_SOURCE_LIVE;
+static const char *source_path = NULL;
+static int source_realtime = 1;
+static struct hci_loop loop = { .epfd = -1, .timerfd = -1 };
+static struct report_ring ring;
+static struct dup_cache dup_cache;									// Consumer thread only
+static struct lq_table link_quality;								// Consumer thread, or pending_lock held
+static struct nb_digest_table digests;								// Consumer thread, or pending_lock held
+static struct nb_data live_graph;									// Consumer thread only, published through nb_table
+static struct nb_table nb_table;
+static int live_dirty;												// live_graph changed since the last publish
+static uint64_t last_publish_ms;
+static uint64_t last_sweep_ms;
+static unsigned int neighbour_ttl_ms = NB_TTL_MS;
+static unsigned long joins, leaves;									// Consumer thread, or pending_lock held
+static int ring_wakeup = -1;										// eventfd, signalled after each batch
+static int scan_notify = -1;										// eventfd, signalled on a publish or a queued frame
+static struct scan_frame frames[SCAN_FRAME_QUEUE];					// pending_lock held
+static int frames_head, frames_count;
+static unsigned long frames_dropped;
+static pthread_t reader_thread, consumer_thread;
+static atomic_int pipeline_stop;
+static uint8_t pipeline_filter_type;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct nb_object *pending = NULL;
+static struct ll_arena pending_arenas[2];							// pending is built in one, the other holds the last window
+static int pending_arena;
+static int pending_wanted = 1;										// pending_lock held, 0 once events replace windows
+static int pipeline_started;
+static int print_reports = 1;										// Log every accepted report
+static int want_extended;											// Extended advertising if the controller has it
+static int use_extended;											// The advertiser went extended, so must scanning
+static struct adv_policy adv_policy;								// Controller advertising interval
+static atomic_int source_ended;
+
+#define NB_PUBLISH_MS 100											// Most often the consumer publishes the graph
+#define NB_SWEEP_MS 1000											// How often the live graph is aged
+
+/*
+Replay statistics, written by the consumer thread only. A neighbour is
+discovered when its first report is accepted, the latency is measured from
+the start of the pipeline.
+*/
+#define DISCOVERY_SLOTS 1024
+static atomic_ulong reports_consumed;
+static uint64_t pipeline_start_ms;
+static uint64_t discovered[DISCOVERY_SLOTS];
+static uint64_t discovered_ms[DISCOVERY_SLOTS];
+static int nmb_discovered;
 
-			memcpy(buf, &eir[2], name_len);
-			return;
+/**
+* Reader side: handler for LE Advertising Report subevents, copies every
+* report in the event into the ring without looking at it.
+**/
+static void ingest_adv_reports(const evt_le_meta_event *meta, size_t len, void *arg) {
+	struct adv_report_iter reports;
+	le_advertising_info *info;
+	uint64_t one = 1;
+	int pushed = 0;
+
+	adv_report_iter_init(&reports, meta, len);
+	while ((info = adv_report_next(&reports, NULL)) != NULL) {
+		if (report_ring_push(&ring, info) == 0)
+			pushed++;
+	}
+
+	if (pushed && write(ring_wakeup, &one, sizeof(one)) < 0)
+		perror("ring wakeup");
+}
+
+static void* reader_main(void *arg) {
+	int ret;
+
+	while (!atomic_load(&pipeline_stop)) {
+		ret = hci_loop_run(&loop, 100);
+		if (ret < 0)
+			break;
+		if (ret == 2) {												// End of a replayed trace
+			atomic_store(&source_ended, 1);
+			break;
 		}
+	}
+	return NULL;
+}
 
-		offset += field_len + 1;
-		eir += field_len + 1;
+static void note_discovery(uint64_t key) {
+	for (int i = 0; i < nmb_discovered; i++) {
+		if (discovered[i] == key)
+			return;
 	}
+	if (nmb_discovered == DISCOVERY_SLOTS)
+		return;
+	discovered[nmb_discovered] = key;
+	discovered_ms[nmb_discovered] = monotonic_ms() - pipeline_start_ms;
+	nmb_discovered++;
+}
 
-failed:
-	snprintf(buf, buf_len, "(unknown)");
+/** Join and leave events of the live graph **/
+static void live_event(void *arg, enum nb_event_type type, uint64_t nb_bdaddr, uint64_t nb_nb_bdaddr) {
+	char addr[18], nb_addr[18];
+
+	live_dirty = 1;
+	if (type == NB_JOIN)
+		joins++;
+	else if (type == NB_LEAVE)
+		leaves++;
+	if (!print_reports)
+		return;
+	switch (type) {
+	case NB_JOIN:
+		printf("Neighbour %s joined\n", key_to_str(nb_bdaddr, addr));
+		break;
+	case NB_LEAVE:
+		printf("Neighbour %s left, not heard for %u ms\n", key_to_str(nb_bdaddr, addr), neighbour_ttl_ms);
+		break;
+	case NB_LINK_UP:
+		break;														// add_nb_nb() logs these already
+	case NB_LINK_DOWN:
+		printf("Neighbour %s no longer has %s\n", key_to_str(nb_bdaddr, addr), key_to_str(nb_nb_bdaddr, nb_addr));
+		break;
+	}
 }
 
-static int read_flags(uint8_t *flags, const uint8_t *data, size_t size)
-{
-	size_t offset;
+/** Adds a node and the neighbours it advertised to the live graph **/
+static void add_live(uint64_t key, const uint64_t *addrs, int count, const struct link_quality *lq) {
+	struct nb_entry *entry;
 
-	if (!flags || !data)
-		return -EINVAL;
+	for (int i = 0; i < count; i++)
+		add_nb_nb(&live_graph, key, addrs[i]);						// Changes come back through live_event()
+	if (lq != NULL && (entry = nb_find(&live_graph, key)) != NULL) {
+		entry->rssi_mean = lq->rssi_mean;
+		entry->rssi_var = lq->rssi_var;
+	}
+}
 
-	offset = 0;
-	while (offset < size) {
-		uint8_t len = data[offset];
-		uint8_t type;
+static void notify_scan_event(void) {
+	uint64_t one = 1;
 
-		/* Check if it is the end of the significant part */
-		if (len == 0)
-			break;
+	if (write(scan_notify, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("scan event");
+}
 
-		if (len + offset > size)
-			break;
+/**
+* Queues a delegation or done frame for scan_take_frames(), pending_lock
+* held. When the reader falls behind the oldest frame makes room, the
+* sender repeats it anyway.
+**/
+static void queue_frame(uint64_t key, const struct mesh_adv *msg) {
+	struct scan_frame *frame;
 
-		type = data[offset + 1];
+	if (frames_count == SCAN_FRAME_QUEUE) {
+		frames_head = (frames_head + 1) % SCAN_FRAME_QUEUE;
+		frames_count--;
+		frames_dropped++;
+	}
+	frame = &frames[(frames_head + frames_count) % SCAN_FRAME_QUEUE];
+	frame->from = key;
+	frame->msg = *msg;
+	frames_count++;
+	notify_scan_event();
+}
 
-		if (type == FLAGS_AD_TYPE) {
-			*flags = data[offset + 2];
-			return 0;
-		}
+/**
+* Publishes a copy of the live graph for the readers of nb_table, at most
+* once every NB_PUBLISH_MS so a burst of reports costs one copy.
+**/
+static void publish_live(uint64_t now_ms) {
+	struct nb_data *draft;
+
+	if (!live_dirty || now_ms - last_publish_ms < NB_PUBLISH_MS)
+		return;
+	if ((draft = nb_table_draft(&nb_table)) == NULL || nb_data_copy(draft, &live_graph) < 0)
+		return;														// Try again with the next batch
+	nb_table_publish(&nb_table);
+	live_dirty = 0;
+	last_publish_ms = now_ms;
+	notify_scan_event();
+}
 
-		offset += 1 + len;
+/**
+* Consumer side: parses one report and adds it to nb_list if it comes from
+* a mesh node. Repeats of a report already seen within the duplicate cache
+* TTL are dropped before parsing, but still count as RSSI samples for mesh
+* nodes.
+**/
+static struct nb_object* process_report(struct nb_object *nb_list, le_advertising_info *info, int8_t report_rssi, uint64_t now_ms) {
+	struct ad_fields ad;
+	struct mesh_adv msg;
+	struct link_quality *lq;
+	struct nb_digest *d;
+	uint64_t key = bdaddr_to_key(&info->bdaddr);
+	char addr[18];
+	char de;
+	int i;
+
+	lq = lq_table_find(&link_quality, key);							// Only mesh nodes are in the table
+	if (lq) {
+		lq_sample(lq, report_rssi);
+		nb_touch(&live_graph, key, NULL, 0);							// Heard, even if the report goes no further
 	}
 
-	return -ENOENT;
+	if (!dup_cache_check(&dup_cache, key, dup_payload_hash(info->data, info->length), now_ms))
+		return nb_list;
+
+	ad_parse(info->data, info->length, &ad);
+	if (!check_report_filter(pipeline_filter_type, &ad))
+		return nb_list;
+
+	if (mesh_adv_decode(info->data, &ad, &msg) < 0)				// Drop anything that isn't a mesh node
+		return nb_list;												// before formatting a single string
+	de = msg.type == MESH_ADV_DELEGATE ? 'T' : 0;
+
+	if (lq == NULL && (lq = lq_table_get(&link_quality, key)) != NULL)
+		lq_sample(lq, report_rssi);
+
+	if (de && msg.count == 0)										// A delegation without a target is useless
+		return nb_list;
+	if (de || msg.type == MESH_ADV_DONE || msg.type == MESH_ADV_CONNECT)
+		queue_frame(key, &msg);
+	if (msg.type == MESH_ADV_DONE || msg.type == MESH_ADV_CONNECT)	// Says nothing about its neighbours
+		return nb_list;
+
+	if (msg.type == MESH_ADV_DIGEST) {
+		nb_digest_update(&digests, key, &msg);
+		if ((d = nb_digest_find(&digests, key)) != NULL && d->complete)
+			nb_touch(&live_graph, key, d->addrs, d->collected);	// Its set is unchanged, so those links still stand
+		msg.count = 0;
+	} else if (msg.type == MESH_ADV_NEIGHBOURS && (d = nb_digest_find(&digests, key)) != NULL) {
+		if (d->complete) {											// Already have this generation of its set
+			nb_touch(&live_graph, key, d->addrs, d->collected);
+			digests.frames_skipped++;
+			return nb_list;
+		}
+		nb_digest_collect(d, msg.addrs, msg.count);
+	}
+	if (msg.count == 0)												// Still a neighbour, just without any of its own
+		msg.addrs[msg.count++] = BDADDR_KEY_NONE;
+
+	if (!de)
+		add_live(key, msg.addrs, msg.count, lq);
+
+	for (i = 0; pending_wanted && i < msg.count; i++) {
+		nb_list = ll_new(nb_list);
+		nb_list->nb_bdaddr = key;
+		nb_list->nb_nb_bdaddr = msg.addrs[i];
+		nb_list->de = de;
+		nb_list->rssi_mean = lq ? lq->rssi_mean : 0;
+		nb_list->rssi_var = lq ? lq->rssi_var : 0;
+		if (de)
+			break;													// Only the first address is the delegate
+	}
+	note_discovery(key);
+
+	if (print_reports) {
+		ba2str(&info->bdaddr, addr);
+		if (msg.type == MESH_ADV_DIGEST)
+			printf("%s digest %08x generation %u of %u neighbours, rssi %d\n", addr,
+				msg.digest, msg.generation, msg.total, report_rssi);
+		else
+			printf("%s %s seq %u with %d addresses, rssi %d\n", addr, de ? "De" : "Pi",
+				msg.seq, msg.count, report_rssi);
+	}
+	return nb_list;
 }
 
-static int check_report_filter(uint8_t procedure, le_advertising_info *info)
-{
-	uint8_t flags;
+static void* consumer_main(void *arg) {
+	struct pollfd pfd = { .fd = ring_wakeup, .events = POLLIN };
+	struct ring_report *report;
+	le_advertising_info *info;
+	uint64_t count, now;
+
+	while (!atomic_load(&pipeline_stop)) {
+		now = monotonic_ms();
+		pthread_mutex_lock(&pending_lock);
+		ll_arena_set(&pending_arenas[pending_arena]);
+		live_graph.now_ms = now;
+		while ((report = report_ring_peek(&ring)) != NULL) {
+			info = (le_advertising_info *) report->data;
+			pending = process_report(pending, info, (int8_t) info->data[info->length], now);
+			report_ring_release(&ring);
+			atomic_fetch_add(&reports_consumed, 1);
+		}
+		if (now - last_sweep_ms >= NB_SWEEP_MS) {
+			nb_data_expire(&live_graph, neighbour_ttl_ms);
+			last_sweep_ms = now;
+		}
+		pthread_mutex_unlock(&pending_lock);
+		publish_live(now);
 
-	/* If no discovery procedure is set, all reports are treat as valid */
-	if (procedure == 0)
-		return 1;
+		if (poll(&pfd, 1, 100) > 0 && read(ring_wakeup, &count, sizeof(count)) < 0)
+			perror("ring wakeup");
+	}
+	return NULL;
+}
+
+static void close_scan_session(void) {
+	atomic_store(&pipeline_stop, 1);
+	pthread_join(reader_thread, NULL);
+	pthread_join(consumer_thread, NULL);
+	nb_table_destroy(&nb_table);
+	nb_data_free(&live_graph);
+	hci_loop_close(&loop);
+	hci_source_close(&source);
+	scan_session_close(&session);
+	close(ring_wakeup);
+	close(scan_notify);
+}
+
+/**
+* Picks where the scan pipeline reads HCI events from. Must be called before
+* the first scan. path is the btsnoop file to write in record mode or to read
+* in replay mode, realtime keeps the recorded pacing when replaying.
+**/
+void scan_set_source(enum hci_source_mode mode, const char *path, int realtime) {
+	source_mode = mode;
+	source_path = path;
+	source_realtime = realtime;
+}
 
-	/* Read flags AD type value from the advertising report if it exists */
-	if (read_flags(&flags, info->data, info->length))
+/**
+* Sets the scan profile. Before the first scan it is used when the session
+* is opened, afterwards the running session is reconfigured.
+**/
+int scan_set_profile(const struct scan_profile *profile) {
+	if (!pipeline_started) {
+		scan_session_set_profile(&session, profile);
 		return 0;
+	}
+	if (session.dd < 0) {
+		fprintf(stderr, "No adapter to apply a scan profile to\n");
+		return -1;
+	}
+	return scan_session_apply_profile(&session, profile);
+}
 
-	switch (procedure) {
-	case 'l': /* Limited Discovery Procedure */
-		if (flags & FLAGS_LIMITED_MODE_BIT)
-			return 1;
-		break;
-	case 'g': /* General Discovery Procedure */
-		if (flags & (FLAGS_LIMITED_MODE_BIT | FLAGS_GENERAL_MODE_BIT))
-			return 1;
-		break;
-	default:
-		fprintf(stderr, "Unknown discovery procedure\n");
+/** Opens the configured HCI source, the adapter is only touched when live or recording **/
+static int open_scan_source(void) {
+	if (source_mode == HCI_SOURCE_REPLAY)
+		return hci_source_replay(&source, source_path, source_realtime);
+
+	session.extended = use_extended;
+	if (scan_session_open(&session) < 0)
+		return -1;
+	if (source_mode == HCI_SOURCE_RECORD)
+		return hci_source_record(&source, session.dd, source_path);
+	return hci_source_live(&source, session.dd);
+}
+
+/**
+* Opens the event source and starts the reader and consumer threads. SIGINT
+* stays blocked in both so it still ends the caller's scan window.
+**/
+static int start_scan_pipeline(uint8_t filter_type) {
+	sigset_t block, old;
+
+	if (open_scan_source() < 0)
+		return -1;
+	if (hci_loop_init(&loop, &source) < 0)
+		return -1;
+
+	report_ring_init(&ring);
+	dup_cache_init(&dup_cache, DUP_CACHE_TTL_MS);
+	lq_table_init(&link_quality);
+	nb_digest_init(&digests);
+	nb_data_init(&live_graph);
+	live_graph.quiet = 1;
+	live_graph.event = live_event;
+	live_graph.now_ms = last_sweep_ms = monotonic_ms();
+	nb_table_init(&nb_table);
+	ll_arena_init(&pending_arenas[0]);
+	ll_arena_init(&pending_arenas[1]);
+	ring_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	scan_notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring_wakeup < 0 || scan_notify < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	pipeline_filter_type = filter_type;
+	hci_loop_set_handler(&loop, EVT_LE_ADVERTISING_REPORT, ingest_adv_reports, NULL);
+	hci_loop_set_handler(&loop, EVT_LE_EXTENDED_ADVERTISING_REPORT, ingest_adv_reports, NULL);
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &block, &old);
+	if (pthread_create(&reader_thread, NULL, reader_main, NULL) != 0 ||
+	    pthread_create(&consumer_thread, NULL, consumer_main, NULL) != 0) {
+		perror("pthread_create");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		return -1;
 	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
+	pipeline_start_ms = monotonic_ms();
+	pipeline_started = 1;
+	atexit(close_scan_session);
 	return 0;
 }
 
+/**
+* The table the consumer thread publishes the neighbour graph in, set up by
+* the first scan. Readers register with nb_table_register() and read with
+* nb_table_enter() and nb_table_exit(), while scanning carries on.
+**/
+struct nb_table* scan_neighbour_table(void) {
+	return &nb_table;
+}
 
-struct nb_object* print_advertising_devices(int dd, uint8_t filter_type, struct nb_object *nb_list) {
-	unsigned char buf[HCI_MAX_EVENT_SIZE], *ptr;
-	//struct nb_object *nb_object = NULL;
-	struct hci_filter nf, of;
-	struct sigaction sa;
-	socklen_t olen;
-	int len;
-	time_t start = time(0);
-	struct timeval tv;												//Timeout for socket options for read() to be nonblocking
-	tv.tv_sec = 1;
-	tv.tv_usec = 0;
-	char arr [100][18];
-	char addr_table[1000][18];
-	int addr_counter = 0;
-	
-	
-	
-	olen = sizeof(of);
-	if (getsockopt(dd, SOL_HCI, HCI_FILTER, &of, &olen) < 0) {
-		printf("Could not get socket options\n");
-		exit(-1);
+/**
+* An eventfd that becomes readable whenever the scan pipeline published a
+* new neighbour graph or queued a frame for scan_take_frames(), for callers
+* that poll instead of scanning in windows. The pipeline is started on the
+* first call. Reading the counter is up to the caller. From then on the
+* pipeline no longer collects neighbours for scan windows, as nobody would
+* take them and the list would grow for as long as the program runs.
+**/
+int scan_event_fd(void) {
+	if (!pipeline_started && start_scan_pipeline(0) < 0)
+		return -1;
+	pthread_mutex_lock(&pending_lock);
+	if (pending_wanted) {
+		pending_wanted = 0;
+		pending = NULL;
+		ll_arena_reset(&pending_arenas[pending_arena]);				// The other may still hold the last window
+	}
+	pthread_mutex_unlock(&pending_lock);
+	return scan_notify;
+}
+
+/**
+* Moves up to max queued delegation and done frames, oldest first, into
+* out. Never blocks. Returns the number moved.
+**/
+int scan_take_frames(struct scan_frame *out, int max) {
+	int n = 0;
+
+	pthread_mutex_lock(&pending_lock);
+	for (; n < max && frames_count > 0; n++) {
+		out[n] = frames[frames_head];
+		frames_head = (frames_head + 1) % SCAN_FRAME_QUEUE;
+		frames_count--;
 	}
+	pthread_mutex_unlock(&pending_lock);
+	return n;
+}
 
-	hci_filter_clear(&nf);
-	hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-	hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+/**
+* Sets how long a neighbour or link may go unheard before it is dropped
+* from the live graph. Must be called before the first scan.
+**/
+void scan_set_neighbour_ttl(unsigned int ttl_ms) {
+	neighbour_ttl_ms = ttl_ms;
+}
 
-	if (setsockopt(dd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0) {
-		printf("Could not set socket options\n");
-		//return -1;
+/**
+* Returns 1 if key is in the latest published neighbour graph, so it has
+* been heard within the TTL, 0 if not. Wait-free apart from claiming a
+* reader slot, and safe from any thread.
+**/
+int scan_neighbour_alive(uint64_t key) {
+	const struct nb_view *view;
+	int reader, alive;
+
+	if (!pipeline_started || (reader = nb_table_register(&nb_table)) < 0)
+		return 0;
+	view = nb_table_enter(&nb_table, reader);
+	alive = view != NULL && nb_find(&view->graph, key) != NULL;
+	nb_table_exit(&nb_table, reader);
+	nb_table_unregister(&nb_table, reader);
+	return alive;
+}
+
+/** scan_neighbour_alive() for an address string, as the connection handler keeps them **/
+int scan_peer_alive(const char *addr) {
+	return scan_neighbour_alive(str_to_key(addr));
+}
+
+/**
+* Copies the current smoothed RSSI of the link to the node key into out.
+* Returns 0, or -1 if no report from it has been received yet.
+**/
+int scan_link_quality(uint64_t key, struct link_quality *out) {
+	struct link_quality *lq;
+	int ret = -1;
+
+	pthread_mutex_lock(&pending_lock);
+	lq = lq_table_find(&link_quality, key);
+	if (lq != NULL && lq->samples > 0) {
+		*out = *lq;
+		ret = 0;
 	}
+	pthread_mutex_unlock(&pending_lock);
+	return ret;
+}
 
+/**
+* Waits window_ms milliseconds while the pipeline runs, then moves the
+* neighbours found by the consumer thread onto nb_list.
+**/
+struct nb_object* print_advertising_devices(uint8_t filter_type, struct nb_object *nb_list, unsigned int window_ms) {
+	struct nb_object *found;
+	unsigned long forwarded, suppressed, evictions, changes, skipped;
+	size_t arena_high_water;
+	struct sigaction sa;
+	struct timespec deadline;
+	uint64_t end = monotonic_ms() + window_ms;
+	
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_flags = SA_NOCLDSTOP;
 	sa.sa_handler = sigint_handler;
 	sigaction(SIGINT, &sa,
 	 NULL);
-	setsockopt(dd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);	
-	while (1) {
-		evt_le_meta_event *meta;
-		le_advertising_info *info;
-		char addr[18];
-		int addr_exists;
-	
-		
-		while ((len = read(dd, buf, sizeof(buf))) < 0) {
-			if (errno == EINTR && signal_received == SIGINT) {
-				len = 0;
-				printf("first goto\n");
-				goto done;
-			}
 
-			if (errno == EAGAIN || errno == EINTR)
-				continue;
-				printf("sec goto\n");
-			goto done;
-		}
-
-		if (time(0) - start >= 1) {
-			printf("third goto\n");
-
-			goto done;
-		}
-
-		ptr = buf + (1 + HCI_EVENT_HDR_SIZE);
-		len -= (1 + HCI_EVENT_HDR_SIZE);
-
-		meta = (void *) ptr;
+	deadline.tv_sec = end / 1000;
+	deadline.tv_nsec = (end % 1000) * 1000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+		if (signal_received == SIGINT)
+			break;
+	}
 
-		if (meta->subevent != 0x02){
-			printf("fourth goto\n");
-			goto done;
-		}
-		/* Ignoring multiple reports */
-		info = (le_advertising_info *) (meta->data + 1);
-		if (check_report_filter(filter_type, info)) {
-			char name[30];
-
-			memset(name, 0, sizeof(name));
-
-			ba2str(&info->bdaddr, addr);
-			eir_parse_name(info->data, info->length,
-							name, sizeof(name) - 1);
-			//uint8_t *dat = info->data;
-			char rssi;
-			//printf("%d\n", rssi);
-			
-			if (0 == strcmp("Pi", name)) {
-				
-				char sec_addr[31];
-				printf("Pi read in data ");
-				for (int i = 7; i < 24; i++) {
-					sec_addr[i-7] = info->data[i];
-					//printf("%c", sec_addr[i-7]);
-					//printf("%d ", rssi); 
-				}
-				//printf("\n");
-				if(sec_addr[2] == ':' && sec_addr[5] == ':'){
-					nb_list = ll_new(nb_list);
-					strcpy(nb_list->nb_bdaddr, addr);
-					strcpy(nb_list->nb_nb_bdaddr, sec_addr);
-				} else {
-					nb_list = ll_new(nb_list);
-					strcpy(nb_list->nb_bdaddr, addr);
-				}
-				
-				
-			} else if(0 == strcmp("	De", name)) {
-				char sec_addr[31];
-				printf("De read in data");
-				for (int i = 7; i < 24; i++) {
-					sec_addr[i-7] = info->data[i];
-					//printf("%c", sec_addr[i-7]);
-					//printf("%d ", rssi); 
-				}
-				//printf("\n");
-				if(sec_addr[2] == ':' && sec_addr[5] == ':'){
-					nb_list = ll_new(nb_list);
-					strcpy(nb_list->nb_bdaddr, addr);
-					strcpy(nb_list->nb_nb_bdaddr, sec_addr);
-					nb_list->de = 'T';
-				} 
-			}
-					
-			printf("%s %s ", addr, name);
-			for (int i = 0; i < info->length; i++) {
-				rssi = info->data[i];
-				printf("%d ", rssi); 
-			}
-			printf("\n");
-			
-			addr_counter++;
-			if (addr_counter == (sizeof(addr_table)/sizeof(addr_table[0]) - 1)) addr_counter = 0;
-		}
+	pthread_mutex_lock(&pending_lock);
+	found = pending;
+	pending = NULL;
+	pending_arena ^= 1;												// The last window's list has been copied out
+	ll_arena_reset(&pending_arenas[pending_arena]);
+	arena_high_water = MAX(pending_arenas[0].high_water, pending_arenas[1].high_water);
+	forwarded = dup_cache.forwarded;
+	suppressed = dup_cache.suppressed;
+	evictions = dup_cache.evictions;
+	changes = digests.changes;
+	skipped = digests.frames_skipped;
+	pthread_mutex_unlock(&pending_lock);
+
+	ll_foreach(found, it) {
+		nb_list = ll_new(nb_list);
+		*nb_list = *it;
 	}
+	ll_free(found);
+
+	if (!print_reports)
+		return nb_list;
 
-done:
 	printf("now in done:");
-	setsockopt(dd, SOL_HCI, HCI_FILTER, &of, sizeof(of));
 	
 	ll_foreach(nb_list, it) {
-		printf("My_Neighbour: %s", it->nb_bdaddr);
+		char addr[18], nb_addr[18];
+		printf("My_Neighbour: %s (%.1f dBm)", key_to_str(it->nb_bdaddr, addr), it->rssi_mean);
 		//printf("GOOD PRINT 2 %s\n", nan->addr_data);
-		printf(" Neighbours_Neighbour: %s\n", it->nb_nb_bdaddr);
+		printf(" Neighbours_Neighbour: %s\n", key_to_str(it->nb_nb_bdaddr, nb_addr));
 		
 	}
-	
-	if (len < 0) exit(-1);
+
+	printf("Report ring: %zu queued, %lu high water, %lu overruns\n",
+		report_ring_occupancy(&ring), report_ring_high_water(&ring),
+		report_ring_overruns(&ring));
+	printf("Duplicate cache: %lu forwarded, %lu suppressed, %lu evictions\n",
+		forwarded, suppressed, evictions);
+	printf("Digests: %lu neighbour set changes, %lu unchanged frames skipped\n",
+		changes, skipped);
+	printf("Report lists: %zu bytes high water\n", arena_high_water);
+	if (adv_policy.fast)
+		printf("Advertising interval: %u ms, %lu backoffs\n",
+			advertising_interval_ms(), adv_policy.backoffs);
 
 	return nb_list;
 }
 
+static struct advertiser advertiser = { .dd = -1 };
+static pthread_mutex_t adv_lock = PTHREAD_MUTEX_INITIALIZER;		// Scheduler thread and delegations both advertise
+
+static struct adv_scheduler scheduler = { .timerfd = -1, .stopfd = -1 };
+
+/*
+With extended advertising each kind of frame has a set of its own, so the
+digest and a delegation stay on the air while the neighbours rotate. A
+legacy controller has only set 0 and every frame replaces the one before.
+*/
+enum adv_set_handle {
+	ADV_SET_NEIGHBOURS,
+	ADV_SET_DIGEST,
+	ADV_SET_DELEGATE,												// Also the answer to one, and done frames
+	ADV_SETS_USED
+};
+#define DELEGATE_ADV_MS 2000										// How long a delegation stays on its own set
+
+static void close_advertiser(void) {
+	adv_scheduler_stop(&scheduler);									// It may be sending
+	advertiser_close(&advertiser);
+}
+
+/** Called once the advertiser is attached, scanning follows its mode **/
+static void advertiser_ready(void) {
+	use_extended = advertiser.extended && advertiser.max_sets >= ADV_SETS_USED;
+	atexit(close_advertiser);
+}
+
+static int open_advertiser(void) {
+	if (advertiser.cmd)
+		return 0;
+	if (advertiser_open(&advertiser, want_extended) < 0)
+		return -1;
+	advertiser_ready();
+	return 0;
+}
+
+static struct mesh_adv last_adv;									// Last frame sent, for its sequence number
 
-//should be public
 /**
-*Advertise(char *array), takes a char array of maximum size 24
-*And advertises that, (u8bit) advertisement will look like: 2 bytes for name "pi" followed by
-*5 bytes for control and flags followed by the 24 byte message.
+* Sends msg, bumping its sequence number if the content differs from the
+* last frame. The adapter is opened on the first call, later calls only
+* send what changed.
 **/
-int advertise(char *array) {
-	//------------------------ADVERTISE------------------------		
-	int ret, status;
+static int advertise_frame(struct mesh_adv *msg) {
+	uint8_t data[EXT_ADV_MAX_DATA];
+	uint8_t handle = 0;
+	uint16_t interval;
+	unsigned int duration_ms = 0;
+	uint64_t now = monotonic_ms();
+	int len;
 
-	const int device = hci_open_dev(hci_get_route(NULL));
-	if ( device < 0 ) { 
-		perror("Failed to open HC device.");
-		return 0; 
+	if (msg->type == MESH_ADV_DELEGATE || msg->type == MESH_ADV_CONNECT)
+		adv_policy_activity(&adv_policy, now, DELEGATE_ADV_MS);		// Stay fast while the handshake is on
+	interval = adv_policy_interval(&adv_policy, now);
+
+	pthread_mutex_lock(&adv_lock);
+	msg->seq = last_adv.seq;
+	if (memcmp(msg, &last_adv, sizeof(*msg)) != 0)
+		msg->seq++;
+	last_adv = *msg;
+
+	if (open_advertiser() < 0)
+		goto out;
+
+	if (use_extended) {
+		handle = msg->type == MESH_ADV_DIGEST ? ADV_SET_DIGEST :
+			msg->type == MESH_ADV_NEIGHBOURS ? ADV_SET_NEIGHBOURS : ADV_SET_DELEGATE;
+		if (handle == ADV_SET_DELEGATE) {
+			interval = adv_policy.fast;
+			duration_ms = DELEGATE_ADV_MS;
+		}
 	}
 
-	// Set BLE advertisement parameters.
-	
-	le_set_advertising_parameters_cp adv_params_cp;
-	memset(&adv_params_cp, 0, sizeof(adv_params_cp));
-	adv_params_cp.min_interval = htobs(0x0800);
-	adv_params_cp.max_interval = htobs(0x0800);
-	adv_params_cp.chan_map = 7;
-	
-	struct hci_request adv_params_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISING_PARAMETERS,
-		LE_SET_ADVERTISING_PARAMETERS_CP_SIZE, &status, &adv_params_cp);
-	
-	ret = hci_send_req(device, &adv_params_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set advertisement parameters data.");
-		return 0;
-	}
-	
-	// Set BLE advertisement data.
-	//struct neighbour *next = ll_next(neighbours);
-	
-	le_set_advertising_data_cp adv_data_cp = ble_hci_params_for_set_adv_data("De", array);
-	
-	struct hci_request adv_data_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISING_DATA,
-		LE_SET_ADVERTISING_DATA_CP_SIZE, &status, &adv_data_cp);
-
-	ret = hci_send_req(device, &adv_data_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to set advertising data.");
-		return 0;
-	}
+	len = mesh_adv_encode(msg, data, advertiser.max_data);
+	if (len < 0)
+		goto out;
+	if (adv_set_params(&advertiser, handle, interval, interval) < 0)
+		goto out;
+	if (adv_set_data(&advertiser, handle, data, len) < 0)
+		goto out;
+	adv_set_enable(&advertiser, handle, 1, duration_ms);
+
+out:
+	pthread_mutex_unlock(&adv_lock);
+	return 0;
+}
 
-	// Enable advertising.
+//should be public
+/**
+*advertise() sends a mesh advertisement of the given type (see mesh_adv.h)
+*carrying the first count addresses of addrs, at most MESH_ADV_MAX_ADDRS.
+**/
+int advertise(uint8_t type, const uint64_t *addrs, int count) {
+	struct mesh_adv msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.count = count < MESH_ADV_MAX_ADDRS ? count : MESH_ADV_MAX_ADDRS;
+	if (msg.count > 0)
+		memcpy(msg.addrs, addrs, msg.count * sizeof(*addrs));
+	return advertise_frame(&msg);
+}
 
-	le_set_advertise_enable_cp advertise_cp;
-	memset(&advertise_cp, 0, sizeof(advertise_cp));
-	advertise_cp.enable = 0x01;
+/** Scheduler callback, runs on the scheduler thread **/
+static void send_mesh_adv(const struct mesh_adv *msg, void *arg) {
+	struct mesh_adv frame = *msg;
 
-	struct hci_request enable_adv_rq = ble_hci_request(
-		OCF_LE_SET_ADVERTISE_ENABLE,
-		LE_SET_ADVERTISE_ENABLE_CP_SIZE, &status, &advertise_cp);
+	advertise_frame(&frame);
+}
 
-	ret = hci_send_req(device, &enable_adv_rq, 1000);
-	if ( ret < 0 ) {
-		hci_close_dev(device);
-		perror("Failed to enable advertising.");
-		return 0;
-	}
+static void stop_advertising(void) {
+	adv_scheduler_stop(&scheduler);
+}
 
-	hci_close_dev(device);
-	
+//should be public
+/**
+* Asks for LE extended advertising, and with it extended scanning, when the
+* controller supports it. Must be called before advertising starts.
+**/
+void set_extended_advertising(int want) {
+	want_extended = want;
+}
+
+//should be public
+/**
+* Sets the advertising interval policy from a "fast,slow,stable" spec in
+* milliseconds, see adv_policy.h. Must be called before advertising starts.
+**/
+int set_advertising_policy(const char *spec) {
+	return adv_policy_parse(&adv_policy, spec);
+}
+
+//should be public
+/** The advertising interval in use right now, in milliseconds **/
+unsigned int advertising_interval_ms(void) {
+	return adv_policy.fast ? adv_policy_interval_ms(&adv_policy) : 0;
+}
+
+//should be public
+/**
+* Starts rotating the advertised neighbour set on its own thread, one frame
+* every period_ms, see adv_scheduler.h. How often the controller repeats
+* each frame follows the interval policy. The adapter is opened here unless
+* a simulated controller is attached already.
+**/
+int start_advertising(unsigned int period_ms) {
+	if (adv_policy.fast == 0)
+		adv_policy_init(&adv_policy, ADV_FAST_MS, ADV_SLOW_MS, ADV_STABLE_MS);
+	if (scheduler.stopfd >= 0)
+		return adv_scheduler_set_rate(&scheduler, period_ms);
+	if (adv_scheduler_start(&scheduler, period_ms, 1, send_mesh_adv, NULL) < 0)
+		return -1;
+	atexit(stop_advertising);
+
+	pthread_mutex_lock(&adv_lock);
+	if (open_advertiser() < 0)
+		fprintf(stderr, "Advertising without an adapter, frames are dropped\n");
+	else if (use_extended)
+		adv_scheduler_set_frame_addrs(&scheduler,
+			(MIN(advertiser.max_data, MESH_ADV_EXT_MAX_SIZE) - MESH_ADV_HEADER_SIZE) / MESH_ADV_ADDR_SIZE);
+	pthread_mutex_unlock(&adv_lock);
 	return 0;
 }
 
+//should be public
+/** Replaces the neighbour set being advertised, new entries go out first **/
+void advertise_set(const uint64_t *arr, int counter) {
+	if (scheduler.stopfd < 0 && start_advertising(ADV_PERIOD_MS) < 0)
+		exit(1);
+	if (adv_scheduler_update(&scheduler, arr, counter))
+		adv_policy_activity(&adv_policy, monotonic_ms(), 0);
+}
 
 //should be public
-//*
-struct nb_object* scan(struct nb_object *nb_list) {
+/**
+* scan_window() collects window_ms milliseconds of neighbours from the
+* scan pipeline. The source is opened, scanning enabled and the pipeline
+* threads started on the first call only, they run until the program exits.
+**/
+struct nb_object* scan_window(struct nb_object *nb_list, unsigned int window_ms) {
 //-----------------------------------------SCAN---------------------------
 	
-	int err, opt, dd, dev_id;
-	uint8_t own_type = LE_PUBLIC_ADDRESS;
-	uint8_t scan_type = 0x01;
 	uint8_t filter_type = 0;
-	uint8_t filter_policy = 0x00;
-	uint16_t interval = htobs(0x0010);
-	uint16_t window = htobs(0x0010);
-	uint8_t filter_dup = 0x01;
 	
-	
-	// Might break comparisons because of the size/actual size
-	int address_dec [] = {66, 56, 58, 50, 55, 58, 69, 66, 58, 52, 70, 58, 68, 54, 58, 53, 54};
-	char address_ascii [18] = {0};
-	for (int i = 0; i < 17; i++) {
-				address_ascii[i] = address_dec[i];
-				//~ printf("hardcoded %c\n", address_ascii[i]);
-			}
-	printf("hardcoded %s\n", address_ascii);
-	printf("%c\n", address_ascii[17]);
-	//~ printf("xd\n");
-	
-	dev_id = hci_get_route(NULL);
-
-	dd = hci_open_dev(dev_id);
-	
-	err = hci_le_set_scan_parameters(dd, scan_type, interval, window,
-						own_type, filter_policy, 10000);
-	if (err < 0) {
-		perror("Set scan parameters failed");
+	if (!pipeline_started && start_scan_pipeline(filter_type) < 0)
 		exit(1);
-	}
 
-	err = hci_le_set_scan_enable(dd, 0x01, filter_dup, 10000);
-	if (err < 0) {
-		perror("Enable scan failed");
-		exit(1);
-	}
-
-	printf("LE Scan ...\n");
-
-	printf("%d\n", &nb_list);
-	nb_list = print_advertising_devices(dd, filter_type, nb_list);
-	printf("%d\n", &nb_list);
-	
-	err = hci_le_set_scan_enable(dd, 0x00, filter_dup, 10000);
-	if (err < 0) {
-		perror("Disable scan failed");
-		exit(1);
+	if (print_reports)
+		printf("%p\n", (void *) &nb_list);
+	nb_list = print_advertising_devices(filter_type, nb_list, window_ms);
+	if (print_reports) {
+		printf("%p\n", (void *) &nb_list);
+		printf("try to return from scan\n");
 	}
-
-	hci_close_dev(dd);
-	printf("try to return from scan\n");
 	return nb_list;
 }
 
-void add_to_array(char (*arr)[18], struct nb_object *nb_list, int *counter){
+//should be public
+/** Scans for one default length window, see scan_window() **/
+struct nb_object* scan(struct nb_object *nb_list) {
+	return scan_window(nb_list, SCAN_WINDOW_MS);
+}
+
+void add_to_array(uint64_t *arr, struct nb_object *nb_list, int *counter){
+	if(nb_list->nb_bdaddr == BDADDR_KEY_NONE || *counter >= NB_ARRAY_SIZE){
+		return;
+	}
 	for(int i = 0; i < *counter; i++){
-		if(0 == strcmp(arr[i], nb_list->nb_bdaddr)){
+		if(arr[i] == nb_list->nb_bdaddr){
 			return;
 		}
 	}
-	strcpy(arr[*counter], nb_list->nb_bdaddr);
-	*counter++;
+	arr[*counter] = nb_list->nb_bdaddr;
+	(*counter)++;
 }
 
 
@@ -491,32 +899,21 @@ struct nb_object* scan_adv(){
 	//strcpy(neighbours->addr_bt, "0"); 
 	time_t start = time(0);
 	
-	char arr[10][18];
+	uint64_t arr[NB_ARRAY_SIZE];
+	char addr[18], nb_addr[18];
 	int counter = 0;
-	int current = 0;
 	
 	struct nb_object *nb_list = NULL;
 
+	advertise_set(arr, counter);										// Advertising runs alongside scanning
 	while (1) {
 		
-		char neighbour_1 [] = "";
-		
-		if ((nb_list != NULL)) {
-			printf("this is being advertised %s\n", arr[current]);
-			advertise(arr[current]);
-			current++;
-			if(current > counter){
-				current = 0;
-			}
-		} else {
-			advertise(neighbour_1);
-		}
-	
 		nb_list = scan(nb_list);
 		
 		ll_foreach(nb_list, it){
-			add_to_array(arr, nb_list, &counter);
+			add_to_array(arr, it, &counter);
 		}
+		advertise_set(arr, counter);
 		
 		if (time(0) - start >= 20) {
 			break;
@@ -530,33 +927,309 @@ struct nb_object* scan_adv(){
 	}
 	*/
 	
-	struct nb_object *ptr[16];
+	struct nb_data graph;
 	
-	*ptr = fill_entries(ptr, nb_list);
+	nb_data_init(&graph);
+	if (fill_entries(&graph, nb_list) < 0)
+		exit(1);
 	
 	struct nb_object *rtn = NULL;
-	rtn = rtn_nb_ptr(ptr);
+	rtn = rtn_nb_ptr(&graph);
 	
-	printf("%s\n", rtn->nb_bdaddr);
+	printf("%s\n", key_to_str(rtn->nb_bdaddr, addr));
 	
 	printf("dab on the haters\n");
 	ll_foreach(rtn, it){
 		printf("dont dab on the haters\n");
-		print_nb_nb(ptr, it->nb_bdaddr);
-		print_nb_nb(ptr, it->nb_bdaddr);
+		print_nb_nb(&graph, it->nb_bdaddr);
+		print_nb_nb(&graph, it->nb_bdaddr);
 	}
 	
 	ll_foreach(rtn, it){
-		printf("%s\n", it->nb_bdaddr);
-		printf("%s\n", it->nb_nb_bdaddr);
+		printf("%s\n", key_to_str(it->nb_bdaddr, addr));
+		printf("%s\n", key_to_str(it->nb_nb_bdaddr, nb_addr));
 	}
-	
+	nb_data_free(&graph);
 	
 	return nb_list;
 }
 
+/**
+* Writes a synthetic btsnoop trace for benchmarking without a radio: nodes
+* mesh nodes advertise the addresses of the next nodes in a ring, with a
+* digest of that set in every other frame. Three reports per event and one
+* event every interval_us microseconds.
+**/
+int write_synthetic_trace(const char *path, int nodes, int events, unsigned int interval_us) {
+	unsigned char pkt[HCI_MAX_EVENT_SIZE];
+	uint64_t ts = (uint64_t) time(0) * 1000000;
+	int fd, node = 0, frame = 0;
+
+	fd = btsnoop_create(path);
+	if (fd < 0)
+		return -1;
+
+	for (int e = 0; e < events; e++, ts += interval_us) {
+		unsigned char *p = pkt + 1 + HCI_EVENT_HDR_SIZE;
+		evt_le_meta_event *meta = (evt_le_meta_event *) p;
+
+		meta->subevent = EVT_LE_ADVERTISING_REPORT;
+		meta->data[0] = 3;												// Number of reports
+		p = meta->data + 1;
+		for (int r = 0; r < 3; r++, node = (node + 1) % nodes) {
+			le_advertising_info *info = (le_advertising_info *) p;
+			le_set_advertising_data_cp adv;
+			struct mesh_adv msg = { .type = MESH_ADV_NEIGHBOURS };
+
+			for (int n = 1; n < nodes && msg.count < MESH_ADV_MAX_ADDRS; n++)
+				msg.addrs[msg.count++] = 0x020000000000ULL + (node + n) % nodes;
+			if (frame++ / nodes % 2) {
+				msg.type = MESH_ADV_DIGEST;
+				msg.digest = mesh_adv_digest(msg.addrs, msg.count);
+				msg.total = msg.count;
+				msg.count = 0;
+			}
+			adv = ble_hci_params_for_mesh_adv(&msg);
+			info->evt_type = 0x00;										// ADV_IND
+			info->bdaddr_type = LE_PUBLIC_ADDRESS;
+			key_to_bdaddr(0x020000000000ULL + node, &info->bdaddr);
+			info->length = adv.length;
+			memcpy(info->data, adv.data, adv.length);
+			info->data[adv.length] = (uint8_t) (-40 - node % 50);		// RSSI
+			p += LE_ADVERTISING_INFO_SIZE + adv.length + 1;
+		}
+
+		pkt[0] = HCI_EVENT_PKT;
+		((hci_event_hdr *) (pkt + 1))->evt = EVT_LE_META_EVENT;
+		((hci_event_hdr *) (pkt + 1))->plen = p - (pkt + 1 + HCI_EVENT_HDR_SIZE);
+		if (btsnoop_write(fd, pkt, p - pkt, ts) < 0) {
+			perror("Could not write trace");
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/**
+* Runs the scan pipeline over the configured replay source until the trace
+* ends, then prints reports per second and neighbour discovery latency.
+**/
+int replay_bench(void) {
+	struct ll_arena window;
+	uint64_t start, elapsed, total = 0, worst = 0;
+	unsigned long reports;
+	const struct nb_view *view;
+	int reader;
+
+	print_reports = 0;
+	ll_arena_init(&window);
+	ll_arena_set(&window);
+	start = monotonic_ms();
+	do {
+		scan_window(NULL, 100);
+		ll_arena_reset(&window);
+	} while (!atomic_load(&source_ended) && signal_received != SIGINT);
+	scan_window(NULL, 100);										// Let the consumer drain the ring
+	ll_arena_set(NULL);
+	elapsed = monotonic_ms() - start;
+	pthread_mutex_lock(&pending_lock);								// Consumer owns the statistics
+
+	reports = atomic_load(&reports_consumed);
+	printf("Replayed %lu events, %lu reports in %llu ms: %.0f reports/sec\n",
+		atomic_load(&source.packets), reports, (unsigned long long) elapsed,
+		elapsed ? reports * 1000.0 / elapsed : 0.0);
+	printf("Report ring: %lu high water, %lu overruns\n",
+		report_ring_high_water(&ring), report_ring_overruns(&ring));
+	printf("Duplicate cache: %lu forwarded, %lu suppressed, %lu evictions\n",
+		dup_cache.forwarded, dup_cache.suppressed, dup_cache.evictions);
+	printf("Digests: %lu neighbour set changes, %lu unchanged frames skipped\n",
+		digests.changes, digests.frames_skipped);
+	printf("Neighbour events: %lu joins, %lu leaves, generation %u\n",
+		joins, leaves, live_graph.generation);
+	printf("Neighbour lists: %zu bytes high water per window, %zu bytes in report lists, %zu + %zu slabs\n",
+		window.high_water, MAX(pending_arenas[0].high_water, pending_arenas[1].high_water),
+		window.slabs, pending_arenas[0].slabs + pending_arenas[1].slabs);
+	if ((reader = nb_table_register(&nb_table)) >= 0) {
+		view = nb_table_enter(&nb_table, reader);
+		printf("Neighbour table: version %llu with %u neighbours\n",
+			(unsigned long long) (view ? view->version : 0), view ? view->graph.count : 0);
+		nb_table_exit(&nb_table, reader);
+		nb_table_unregister(&nb_table, reader);
+	}
+
+	for (int i = 0; i < nmb_discovered; i++) {
+		total += discovered_ms[i];
+		if (discovered_ms[i] > worst)
+			worst = discovered_ms[i];
+	}
+	printf("Discovered %d neighbours, latency mean %llu ms, max %llu ms\n", nmb_discovered,
+		(unsigned long long) (nmb_discovered ? total / nmb_discovered : 0),
+		(unsigned long long) worst);
+	pthread_mutex_unlock(&pending_lock);
+	ll_arena_destroy(&window);
+	return 0;
+}
+
+/** Forgets what has been discovered so far, so a new measurement starts clean **/
+static void reset_scan_stats(void) {
+	pthread_mutex_lock(&pending_lock);
+	dup_cache_init(&dup_cache, DUP_CACHE_TTL_MS);
+	nmb_discovered = 0;
+	pipeline_start_ms = monotonic_ms();
+	atomic_store(&reports_consumed, 0);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+/**
+* Scans live for seconds with each built-in profile in turn, or only with
+* profile if it is not NULL, and prints how many reports and distinct mesh
+* nodes each one delivered per second.
+**/
+int profile_bench(const struct scan_profile *profile, unsigned int seconds) {
+	struct nb_object *nb_list = NULL;
+	int first = 0, last = profile ? 0 : nmb_scan_profiles - 1;
+	unsigned long reports;
+	uint64_t all_found_ms;
+
+	print_reports = 0;
+	for (int i = first; i <= last && signal_received != SIGINT; i++) {
+		const struct scan_profile *p = profile ? profile : &scan_profiles[i];
+
+		if (scan_set_profile(p) < 0)
+			return 1;
+		nb_list = scan_window(nb_list, 0);								// Opens the session on the first run
+		reset_scan_stats();
+		for (unsigned int s = 0; s < seconds && signal_received != SIGINT; s++) {
+			nb_list = scan_window(nb_list, 1000);
+			ll_free(nb_list);
+			nb_list = NULL;
+		}
+
+		pthread_mutex_lock(&pending_lock);
+		reports = atomic_load(&reports_consumed);
+		all_found_ms = nmb_discovered ? discovered_ms[nmb_discovered - 1] : 0;
+		scan_profile_print(p);
+		printf("\n\t%.1f reports/s, %.2f devices/s (%d mesh nodes, last found after %llu ms)\n",
+			(double) reports / seconds, (double) nmb_discovered / seconds,
+			nmb_discovered, (unsigned long long) all_found_ms);
+		pthread_mutex_unlock(&pending_lock);
+	}
+	return 0;
+}
+
+/**
+* Runs the advertiser against a simulated controller, with or without
+* extended advertising, printing every command it is sent. The node
+* advertises a neighbour set, the set grows, it delegates once and the
+* set shrinks back to what a legacy frame carries.
+* Returns 0 if the controller accepted every command.
+**/
+int sim_advertising(int extended) {
+	static struct ctrl_sim sim;
+	uint64_t set[10];
+
+	ctrl_sim_init(&sim, extended, ADV_SETS_USED, stdout);
+	pthread_mutex_lock(&adv_lock);
+	advertiser_attach(&advertiser, ctrl_sim_cmd, &sim, 1);
+	advertiser_ready();
+	pthread_mutex_unlock(&adv_lock);
+
+	for (int i = 0; i < 10; i++)
+		set[i] = 0x020000000000ULL + i;
+	if (start_advertising(50) < 0)
+		return -1;
+	advertise_set(set, 6);
+	usleep(300 * 1000);
+	advertise_set(set, 10);
+	advertise(MESH_ADV_DELEGATE, &set[3], 1);
+	usleep(300 * 1000);
+	advertise_set(set, 2);
+	usleep(300 * 1000);
+	adv_scheduler_stop(&scheduler);
+
+	printf("%s controller, %s advertising: %lu frames, %lu commands sent, %lu skipped, %lu rejected, %d sets on\n",
+		extended ? "Extended" : "Legacy", advertiser.extended ? "extended" : "legacy",
+		scheduler.frames_sent, advertiser.commands_sent, advertiser.commands_skipped,
+		sim.rejected, ctrl_sim_enabled_sets(&sim));
+	return sim.rejected ? -1 : 0;
+}
+
+static void usage(const char *prog) {
+	printf("Usage: %s [-s profile] [-b [-t seconds]] [-a ms] [-i policy] [-T ms] [-x] [-c ext|legacy] [-r trace] [-p trace [-f]] [-g trace [-n nodes] [-e events]]\n"
+		"\t-s profile  scan profile: name[,interval=ms][,window=ms][,dup|nodup]\n"
+		"\t-b          measure discovery rate for each profile (or only -s) and exit\n"
+		"\t-t seconds  how long -b scans with each profile, default 10\n"
+		"\t-a ms       advertise a new frame every ms milliseconds, default 500\n"
+		"\t-i policy   advertising interval fast,slow,stable in ms, default 100,1280,10000\n"
+		"\t-T ms       drop neighbours not heard for ms milliseconds, default 30000\n"
+		"\t-x          use extended advertising and scanning if the controller has them\n"
+		"\t-c ctrl     advertise to a simulated ext or legacy controller and exit\n"
+		"\t-r trace    record every HCI event to a btsnoop file while running\n"
+		"\t-p trace    replay a btsnoop file through the scanner and print statistics\n"
+		"\t-f          replay as fast as possible instead of at the recorded pace\n"
+		"\t-g trace    write a synthetic trace of nodes mesh nodes and exit\n"
+		"Scan profiles:\n", prog);
+	for (int i = 0; i < nmb_scan_profiles; i++) {
+		printf("\t");
+		scan_profile_print(&scan_profiles[i]);
+		printf("\n");
+	}
+}
 
 int main(int argc, char *argv[]) {	
+	const char *record = NULL, *replay = NULL, *synthetic = NULL, *sim = NULL;
+	struct scan_profile profile;
+	int opt, realtime = 1, nodes = 16, events = 10000;
+	int have_profile = 0, bench = 0, seconds = 10, adv_period = ADV_PERIOD_MS;
+
+	while ((opt = getopt(argc, argv, "s:bt:a:i:T:xc:r:p:fg:n:e:h")) != -1) {
+		switch (opt) {
+		case 's':
+			if (scan_profile_parse(&profile, optarg) < 0)
+				return 1;
+			have_profile = 1;
+			break;
+		case 'b': bench = 1; break;
+		case 't': seconds = atoi(optarg); break;
+		case 'a': adv_period = atoi(optarg); break;
+		case 'i':
+			if (set_advertising_policy(optarg) < 0)
+				return 1;
+			break;
+		case 'T': scan_set_neighbour_ttl(atoi(optarg)); break;
+		case 'x': set_extended_advertising(1); break;
+		case 'c': sim = optarg; break;
+		case 'r': record = optarg; break;
+		case 'p': replay = optarg; break;
+		case 'f': realtime = 0; break;
+		case 'g': synthetic = optarg; break;
+		case 'n': nodes = atoi(optarg); break;
+		case 'e': events = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (sim)
+		return sim_advertising(strcmp(sim, "ext") == 0) < 0;
+	if (synthetic)
+		return write_synthetic_trace(synthetic, nodes > 0 ? nodes : 1, events, 1000) < 0;
+	if (replay) {
+		scan_set_source(HCI_SOURCE_REPLAY, replay, realtime);
+		return replay_bench();
+	}
+	if (record)
+		scan_set_source(HCI_SOURCE_RECORD, record, 0);
+	if (bench)
+		return profile_bench(have_profile ? &profile : NULL, seconds > 0 ? seconds : 10);
+	if (have_profile)
+		scan_set_profile(&profile);
+	if (start_advertising(adv_period > 0 ? adv_period : ADV_PERIOD_MS) < 0)
+		return 1;
+
 	//struct nb_object *new = NULL;
 	//new = scan(new);
 	scan_adv();
@@ -8,25 +8,79 @@
 
 #include "ll.h"
 #include "structs.h"
+#include "bdaddr_key.h"
+#include "ad_parser.h"
 #include "nb_data.h"
+#include "nb_table.h"
+#include "scan_session.h"
+#include "hci_source.h"
+#include "hci_loop.h"
+#include "link_quality.h"
+#include "mesh_adv.h"
 
+#define SCAN_WINDOW_MS 1000
+#define NB_ARRAY_SIZE 10
+#define ADV_PERIOD_MS 500
+#define NB_TTL_MS 30000												// Neighbours unheard for this long are dropped
+#define SCAN_FRAME_QUEUE 16											// Delegation and done frames waiting for the caller
 
-le_set_advertising_data_cp ble_hci_params_for_set_adv_data(char * name, char * btaddr);
+/** A delegation or done frame as heard, see scan_take_frames() **/
+struct scan_frame {
+	uint64_t from;
+	struct mesh_adv msg;
+};
+
+
+le_set_advertising_data_cp ble_hci_params_for_mesh_adv(const struct mesh_adv *msg);
 
 static void sigint_handler(int sig);
 
-static void eir_parse_name(uint8_t *eir, size_t eir_len, char *buf, size_t buf_len);
+static int check_report_filter(uint8_t procedure, const struct ad_fields *ad);
+
+struct nb_object* print_advertising_devices(uint8_t filter_type, struct nb_object *nb_object, unsigned int window_ms);
+
+int advertise(uint8_t type, const uint64_t *addrs, int count);
+
+void set_extended_advertising(int want);
 
-static int read_flags(uint8_t *flags, const uint8_t *data, size_t size);
+int set_advertising_policy(const char *spec);
 
-static int check_report_filter(uint8_t procedure, le_advertising_info *info);
+unsigned int advertising_interval_ms(void);
 
-struct nb_object* print_advertising_devices(int dd, uint8_t filter_type, struct nb_object *nb_object);
+int start_advertising(unsigned int period_ms);
 
-int advertise(char *array);
+void advertise_set(const uint64_t *arr, int counter);
+
+struct nb_object* scan_window(struct nb_object *nb_object, unsigned int window_ms);
 
 struct nb_object* scan(struct nb_object *nb_object);
 
-void add_to_array(char (*arr)[18], struct nb_object *nb_object, int *counter);
+void add_to_array(uint64_t *arr, struct nb_object *nb_object, int *counter);
+
+void scan_set_source(enum hci_source_mode mode, const char *path, int realtime);
+
+int write_synthetic_trace(const char *path, int nodes, int events, unsigned int interval_us);
+
+int replay_bench(void);
+
+int scan_link_quality(uint64_t key, struct link_quality *out);
+
+struct nb_table* scan_neighbour_table(void);
+
+void scan_set_neighbour_ttl(unsigned int ttl_ms);
+
+int scan_event_fd(void);
+
+int scan_take_frames(struct scan_frame *out, int max);
+
+int scan_neighbour_alive(uint64_t key);
+
+int scan_peer_alive(const char *addr);
+
+int scan_set_profile(const struct scan_profile *profile);
+
+int profile_bench(const struct scan_profile *profile, unsigned int seconds);
+
+int sim_advertising(int extended);
 
 #endif
@@ -0,0 +1,58 @@
+#ifndef SCAN_SESSION_H_
+#define SCAN_SESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+
+/**
+ Scan settings applied to the controller. scan_type is 0x00 for passive
+ scanning, which only listens, or 0x01 for active scanning, which also sends
+ a SCAN_REQ to every advertiser it hears. interval and window are in
+ controller units of 0.625 ms, host byte order.
+**/
+struct scan_profile {
+	const char *name;
+	uint8_t scan_type;
+	uint16_t interval;
+	uint16_t window;
+	uint8_t filter_dup;
+};
+
+extern const struct scan_profile scan_profiles[];				// scan_profiles[0] is the default
+extern const int nmb_scan_profiles;
+
+/**
+ A scan session opens the adapter once and keeps LE scanning enabled
+ across discovery rounds. Reports are pulled from it with the
+ non-blocking scan_session_read(), so the controller is never deaf
+ while it is being reconfigured between windows.
+**/
+struct scan_session {
+	int dev_id;
+	int dd;
+	int enabled;
+	int extended;													// Use the LE Extended Scan commands, see advertiser.h
+	uint8_t own_type;
+	uint8_t scan_type;
+	uint8_t filter_policy;
+	uint8_t filter_dup;
+	uint16_t interval;
+	uint16_t window;
+	struct hci_filter of;											// Filter to restore on close
+};
+
+const struct scan_profile* scan_profile_find(const char *name);
+int scan_profile_parse(struct scan_profile *profile, const char *spec);
+void scan_profile_print(const struct scan_profile *profile);
+
+void scan_session_set_profile(struct scan_session *session, const struct scan_profile *profile);
+int scan_session_apply_profile(struct scan_session *session, const struct scan_profile *profile);
+int scan_session_open(struct scan_session *session);
+int scan_session_read(struct scan_session *session, unsigned char *buf, size_t size);
+int scan_session_wait(struct scan_session *session, int timeout_ms);
+void scan_session_close(struct scan_session *session);
+
+#endif
@@ -2,12 +2,16 @@
 #define STRUCTS_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
+/** Addresses are bdaddr keys, see bdaddr_key.h **/
 struct nb_object {
- 	char nb_bdaddr[18];
-	char nb_nb_bdaddr[18];
+	uint64_t nb_bdaddr;
+	uint64_t nb_nb_bdaddr;
 	char edge_color;
 	char de;
+	float rssi_mean;												// Smoothed RSSI of nb_bdaddr in dBm, see link_quality.h
+	float rssi_var;
 };
 
 